@@ -0,0 +1,360 @@
+// HashTableBenchmark.cpp
+// Measures how fast SLICHashTable is built and queried, so table layouts and bucket configs can be
+// compared on the same data: insert throughput, freeze time, memory per entry, and single and batch
+// query latencies (P50 / P99) across thread counts, for the unordered_map staging table (what a table is
+// before freeze()), the frozen layout and a frozen table mapped from a saved index.
+//
+// The index is built from synthetic superpixel stats by default (every image gets a small palette of
+// colors, skewed toward greys like real photos, spread over its grid) so the table is measured without
+// the cost of SLIC, or from the images of a folder such as COCO val2017 with --coco.
+// Queries are indexed images with their colors slightly moved, so every query has a true match.
+//
+// Built by the HashTableBenchmark target of CMakeLists.txt (OpenCV 4 with opencv_contrib):
+// cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build --target HashTableBenchmark
+//
+// Run with:
+// HashTableBenchmark [--images 10000] [--superpixels 300] [--queries 2000] [--threads 1,2,4,8]
+//                    [--k 10] [--probe-budget 1] [--idf] [--stop-bucket-size 0] [--coco val2017]
+
+#include "SLICHashTable.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/ximgproc/slic.hpp>
+using namespace cv;
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchmarkOptions
+{
+	int images = 10000;
+	int superpixels = 300;
+	int queries = 2000;
+	std::vector<int> threads = { 1, 2, 4, 8 };
+	std::string coco_folder;
+	QueryOptions query;
+};
+
+static double elapsedMs(const Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Value below which p percent of the values are (the values get sorted)
+static double percentile(std::vector<double>& values, const int p)
+{
+	if (values.empty()) return 0;
+	std::sort(values.begin(), values.end());
+	return values[(values.size() - 1) * p / 100];
+}
+
+static size_t entryCount(const std::vector<std::vector<HashKey>>& images)
+{
+	size_t entries = 0;
+	for (const std::vector<HashKey>& image : images) entries += image.size();
+	return entries;
+}
+
+// Superpixel stats of a synthetic image: superpixels on a regular grid over one of a few common
+// resolutions, colored from a palette of 6 colors with a little noise. Lightness is uniform and a / b
+// are centered on neutral (128), which crowds the grey buckets like real images do
+static std::vector<HashKey> makeSyntheticImage(const uint32_t image_id, const int superpixels, std::mt19937& random)
+{
+	static const int sizes[3][2] = { { 640, 480 }, { 1920, 1080 }, { 3840, 2160 } };
+	const int size = random() % 3;
+	const int width = sizes[size][0];
+	const int height = sizes[size][1];
+	const int columns = std::max(1, (int) std::sqrt((double) superpixels * width / height));
+	const int rows = std::max(1, (superpixels + columns - 1) / columns);
+	const int cell_width = std::max(1, width / columns);
+	const int cell_height = std::max(1, height / rows);
+
+	std::normal_distribution<float> chroma(128.0f, 20.0f);
+	std::uniform_real_distribution<float> lightness(0.0f, 255.0f);
+	std::uniform_real_distribution<float> noise(-6.0f, 6.0f);
+	float palette[6][3];
+	for (int c = 0; c < 6; c += 1)
+	{
+		palette[c][0] = lightness(random);
+		palette[c][1] = chroma(random);
+		palette[c][2] = chroma(random);
+	}
+
+	std::vector<HashKey> image(superpixels);
+	for (int s = 0; s < superpixels; s += 1)
+	{
+		const float* color = palette[random() % 6];
+		const int col = s % columns;
+		const int row = std::min(rows - 1, s / columns);
+		HashKey& key = image[s];
+		key = HashKey();
+		key.image_id = image_id;
+		key.image_width = width;
+		key.image_height = height;
+		key.x_range = std::make_pair(col * cell_width, std::min(width, (col + 1) * cell_width) - 1);
+		key.y_range = std::make_pair(row * cell_height, std::min(height, (row + 1) * cell_height) - 1);
+		key.pixel_count = (unsigned long) cell_width * cell_height;
+		key.l_tot = (long) (std::min(255.0f, std::max(0.0f, color[0] + noise(random))) * key.pixel_count);
+		key.a_tot = (long) (std::min(255.0f, std::max(0.0f, color[1] + noise(random))) * key.pixel_count);
+		key.b_tot = (long) (std::min(255.0f, std::max(0.0f, color[2] + noise(random))) * key.pixel_count);
+	}
+	return image;
+}
+
+// Superpixel stats of the first count .jpg images of a folder, segmented like the demo does
+static std::vector<std::vector<HashKey>> loadFolderImages(const std::string& folder, const int count)
+{
+	std::vector<std::string> files;
+	glob(folder + "/*.jpg", files, false);
+	files.resize(std::min((int) files.size(), count));
+
+	std::vector<std::vector<HashKey>> images(files.size());
+	parallel_for_(Range(0, (int) files.size()), [&](const Range& range)
+	{
+		for (int i = range.start; i < range.end; i += 1)
+		{
+			Mat image = imread(files[i]);
+			if (image.empty()) continue;
+			Mat lab_image;
+			cvtColor(image, lab_image, COLOR_BGR2Lab);
+			Ptr<ximgproc::SuperpixelSLIC> slic = ximgproc::createSuperpixelSLIC(lab_image, ximgproc::SLIC, 40, 10.0f);
+			slic->iterate();
+			slic->enforceLabelConnectivity(25);
+			Mat labels;
+			slic->getLabels(labels);
+			images[i] = SLICHashTable::compute_superpixel_stats(lab_image, labels, slic->getNumberOfSuperpixels(), i);
+		}
+	});
+	return images;
+}
+
+// Copies of random indexed images with every superpixel color moved by up to 3 levels per channel
+static std::vector<std::vector<HashKey>> makeQueries(const std::vector<std::vector<HashKey>>& images, const int count,
+	std::mt19937& random)
+{
+	std::uniform_int_distribution<int> shift(-3, 3);
+	std::vector<std::vector<HashKey>> queries(count);
+	for (int q = 0; q < count; q += 1)
+	{
+		queries[q] = images[random() % images.size()];
+		for (HashKey& key : queries[q])
+		{
+			key.image_id = (uint32_t) -1;
+			key.l_tot = std::max(0L, key.l_tot + (long) shift(random) * (long) key.pixel_count);
+			key.a_tot = std::max(0L, key.a_tot + (long) shift(random) * (long) key.pixel_count);
+			key.b_tot = std::max(0L, key.b_tot + (long) shift(random) * (long) key.pixel_count);
+		}
+	}
+	return queries;
+}
+
+// Runs the queries on threads threads at once (each one its own slice) and prints the latency of a
+// single query under that load
+static void benchmarkQueries(const char* layout, const SLICHashTable& table,
+	const std::vector<std::vector<HashKey>>& queries, const QueryOptions& options, const int threads)
+{
+	std::vector<std::vector<double>> latencies(threads);
+	std::vector<std::thread> workers;
+	Clock::time_point start = Clock::now();
+	for (int t = 0; t < threads; t += 1)
+	{
+		workers.push_back(std::thread([&, t]()
+		{
+			VoteAccumulator votes;
+			std::vector<ImageMatch> matches;
+			for (size_t q = t; q < queries.size(); q += threads)
+			{
+				Clock::time_point query_start = Clock::now();
+				table.query(queries[q], options, votes, matches);
+				latencies[t].push_back(elapsedMs(query_start));
+			}
+		}));
+	}
+	for (std::thread& worker : workers) worker.join();
+	const double total = elapsedMs(start);
+
+	std::vector<double> all;
+	for (const std::vector<double>& thread_latencies : latencies)
+	{
+		all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+	}
+	const double p50 = percentile(all, 50);
+	const double p99 = percentile(all, 99);
+	printf("  %-8s single  threads %2d  p50 %8.3f ms  p99 %8.3f ms  %10.0f queries/s\n",
+		layout, threads, p50, p99, queries.size() * 1000.0 / total);
+}
+
+// Runs the queries in batches of batch_size through query_batch() (parallel_for_ over threads threads)
+// and prints the latency of a whole batch
+static void benchmarkBatches(const char* layout, const SLICHashTable& table,
+	const std::vector<std::vector<HashKey>>& queries, const QueryOptions& options, const int threads)
+{
+	const size_t batch_size = 64;
+	setNumThreads(threads);
+	std::vector<double> latencies;
+	std::vector<std::vector<ImageMatch>> matches;
+	Clock::time_point start = Clock::now();
+	for (size_t first = 0; first < queries.size(); first += batch_size)
+	{
+		std::vector<std::vector<HashKey>> batch(queries.begin() + first,
+			queries.begin() + std::min(queries.size(), first + batch_size));
+		Clock::time_point batch_start = Clock::now();
+		table.query_batch(batch, options, matches);
+		latencies.push_back(elapsedMs(batch_start));
+	}
+	const double total = elapsedMs(start);
+	const double p50 = percentile(latencies, 50);
+	const double p99 = percentile(latencies, 99);
+	printf("  %-8s batch%-2d threads %2d  p50 %8.3f ms  p99 %8.3f ms  %10.0f queries/s\n",
+		layout, (int) batch_size, threads, p50, p99, queries.size() * 1000.0 / total);
+}
+
+static void benchmarkLayout(const char* layout, const SLICHashTable& table,
+	const std::vector<std::vector<HashKey>>& queries, const BenchmarkOptions& options)
+{
+	HashTableStats stats = table.occupancy_stats();
+	printf("%s: %zu entries, %.1f bytes/entry, %zu occupied buckets, largest %zu\n",
+		layout, stats.entry_count, stats.bytes_per_entry, stats.occupied_buckets, stats.max_bucket_size);
+	for (int threads : options.threads) benchmarkQueries(layout, table, queries, options.query, threads);
+	for (int threads : options.threads) benchmarkBatches(layout, table, queries, options.query, threads);
+}
+
+static std::vector<int> parseThreads(const char* list)
+{
+	std::vector<int> threads;
+	for (const char* next = list; *next != '\0'; )
+	{
+		int count = atoi(next);
+		if (count > 0) threads.push_back(count);
+		const char* comma = strchr(next, ',');
+		if (comma == nullptr) break;
+		next = comma + 1;
+	}
+	return threads;
+}
+
+static bool parseArguments(int argc, char* argv[], BenchmarkOptions& options)
+{
+	for (int i = 1; i < argc; i += 1)
+	{
+		const std::string flag = argv[i];
+		const bool has_value = i + 1 < argc;
+		if (flag == "--idf") options.query.idf_weighting = true;
+		else if (!has_value) return false;
+		else if (flag == "--images") options.images = atoi(argv[++i]);
+		else if (flag == "--superpixels") options.superpixels = atoi(argv[++i]);
+		else if (flag == "--queries") options.queries = atoi(argv[++i]);
+		else if (flag == "--threads") options.threads = parseThreads(argv[++i]);
+		else if (flag == "--k") options.query.k = atoi(argv[++i]);
+		else if (flag == "--probe-budget") options.query.probe_budget = atoi(argv[++i]);
+		else if (flag == "--stop-bucket-size") options.query.stop_bucket_size = (unsigned int) atoi(argv[++i]);
+		else if (flag == "--coco") options.coco_folder = argv[++i];
+		else return false;
+	}
+	return options.images > 0 && options.superpixels > 0 && options.queries > 0 && !options.threads.empty();
+}
+
+int main(int argc, char* argv[])
+{
+	BenchmarkOptions options;
+	if (!parseArguments(argc, argv, options))
+	{
+		fprintf(stderr, "usage: %s [--images N] [--superpixels N] [--queries N] [--threads 1,2,4,8] "
+			"[--k N] [--probe-budget N] [--idf] [--stop-bucket-size N] [--coco FOLDER]\n", argv[0]);
+		return 1;
+	}
+	const int default_threads = getNumThreads();
+	std::mt19937 random(42);
+
+	// Superpixel stats of the database images
+	Clock::time_point start = Clock::now();
+	std::vector<std::vector<HashKey>> images;
+	if (options.coco_folder.empty())
+	{
+		for (int i = 0; i < options.images; i += 1)
+		{
+			images.push_back(makeSyntheticImage((uint32_t) i, options.superpixels, random));
+		}
+	}
+	else
+	{
+		images = loadFolderImages(options.coco_folder, options.images);
+	}
+	if (entryCount(images) == 0)
+	{
+		fprintf(stderr, "no images to index\n");
+		return 1;
+	}
+	std::vector<std::vector<HashKey>> queries = makeQueries(images, options.queries, random);
+	const size_t entries = entryCount(images);
+	printf("%zu images, %zu superpixels (%.0f ms to prepare), %zu queries, k %d, probe budget %d%s\n\n",
+		images.size(), entries, elapsedMs(start), queries.size(), options.query.k, options.query.probe_budget,
+		options.query.idf_weighting ? ", idf" : "");
+
+	// Inserts into the unordered_map staging table, one image after the other
+	SLICHashTable staged;
+	start = Clock::now();
+	for (const std::vector<HashKey>& image : images) staged.Hash(image);
+	double insert_ms = elapsedMs(start);
+	printf("build\n");
+	printf("  staged inserts              %10.1f ms  %12.0f entries/s\n", insert_ms, entries * 1000.0 / insert_ms);
+
+	// Concurrent builds: every stripe of images hashed into its own staging buffer, then one freeze()
+	for (int threads : options.threads)
+	{
+		setNumThreads(threads);
+		SLICHashTable table;
+		std::vector<HashStaging> stagings;
+		std::mutex stagings_mutex;
+		start = Clock::now();
+		parallel_for_(Range(0, (int) images.size()), [&](const Range& range)
+		{
+			HashStaging staging;
+			for (int i = range.start; i < range.end; i += 1) table.Hash(images[i], staging);
+			std::lock_guard<std::mutex> lock(stagings_mutex);
+			stagings.push_back(std::move(staging));
+		});
+		insert_ms = elapsedMs(start);
+		start = Clock::now();
+		table.freeze(stagings);
+		const double freeze_ms = elapsedMs(start);
+		printf("  threads %2d  staging inserts %10.1f ms  %12.0f entries/s  freeze %8.1f ms\n",
+			threads, insert_ms, entries * 1000.0 / insert_ms, freeze_ms);
+	}
+	SLICHashTable frozen;
+	for (const std::vector<HashKey>& image : images) frozen.Hash(image);
+	frozen.freeze();
+
+	// The frozen table written to an index file and mapped back
+	const std::string index_file = "benchmark_index.slic";
+	SLICHashTable mapped;
+	start = Clock::now();
+	const bool saved = frozen.save(index_file);
+	const double save_ms = elapsedMs(start);
+	start = Clock::now();
+	const bool loaded = saved && mapped.load(index_file);
+	const double load_ms = elapsedMs(start);
+	if (loaded) printf("  save %8.1f ms  load (map) %8.3f ms\n\n", save_ms, load_ms);
+	else printf("  couldn't write %s, skipping the mapped table\n\n", index_file.c_str());
+
+	printf("queries\n");
+	// Before freeze() there are no IDF weights: with --idf the staged table weighs every bucket the same
+	benchmarkLayout("staged", staged, queries, options);
+	benchmarkLayout("frozen", frozen, queries, options);
+	if (loaded) benchmarkLayout("mapped", mapped, queries, options);
+
+	setNumThreads(default_threads);
+	remove(index_file.c_str());
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include "SLICHashTable.hpp"
 #include <iostream>
 #include <string>
+#include <mutex>
 #ifdef _WIN32
     #include <direct.h>
     #define chdir _chdir
@@ -14,7 +15,6 @@
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/ximgproc/slic.hpp>
-#include <map>
 using namespace cv;
 
 // main - Generates superpixels for an images using SLIC and displays those superpixels on the image.
@@ -36,7 +36,8 @@ int main(int argc, char* argv[])
 	// Use this for VSCode, comment out for Visual Studio / actual submission
 	chdir("../../");
 
-	std::vector<Mat> database_images(input_count);
+	// the index is saved here after it is built, later runs map it instead of hashing every image again
+	const std::string index_file = "index.slic";
 	std::string ext = ".jpg";
 	std::string base = "input";
 	const int min_superpixel_size_percent = 4;
@@ -46,69 +47,79 @@ int main(int argc, char* argv[])
 	// initialize hash table
 	SLICHashTable hash_table;
 
-	for (int i = 0; i < input_count; i++) {
-		std::string num = std::to_string(i);
-		// Reads the input image
-		std::string file_name = base + num + ext;
-		//std::cout << file_name << "\n" << std::endl; 
-		database_images[i] = imread(file_name);
-		Mat lab_image;
-		//cvtColor(database_images[i], lab_image, COLOR_BGR2Lab);
+	if (!hash_table.load(index_file)) {
+		// the table keeps the file name of every image id, so the best match can be loaded again by its id
+		for (int i = 0; i < input_count; i++) {
+			hash_table.set_image_path(i, base + std::to_string(i) + ext);
+		}
+
+		// images are segmented and hashed in parallel, each stripe of images into its own staging buffer
+		std::vector<HashStaging> stagings;
+		std::mutex stagings_mutex;
+		parallel_for_(Range(0, input_count), [&](const Range& range) {
+			HashStaging staging;
+			for (int i = range.start; i < range.end; i++) {
+				std::string num = std::to_string(i);
+				// Reads the input image
+				std::string file_name = base + num + ext;
+				//std::cout << file_name << "\n" << std::endl; 
+				Mat database_image = imread(file_name);
+				Mat lab_image;
+				//cvtColor(database_images[i], lab_image, COLOR_BGR2Lab);
 
 		
 		
-		Ptr<ximgproc::SuperpixelSLIC> slic = ximgproc::createSuperpixelSLIC(database_images[i], ximgproc::SLIC, avg_superpixel_size, smoothness);
-		slic->iterate();
-		slic->enforceLabelConnectivity(min_superpixel_size_percent);
-
-		// Gets 2D array of the superpixel each pixel is a part of
-		Mat labels;
-		slic->getLabels(labels);
-		int superpixel_count = slic->getNumberOfSuperpixels();
-
-		// Counts how many pixels are in each superpixel
-		unsigned long* pixel_count = (unsigned long*) calloc(superpixel_count, sizeof(unsigned long));
-		for (int row = 0; row < labels.rows; row += 1)
-		{
-			for (int col = 0; col < labels.cols; col += 1)
-			{
-				pixel_count[labels.at<int>(row, col)] += 1;
+				Ptr<ximgproc::SuperpixelSLIC> slic = ximgproc::createSuperpixelSLIC(database_image, ximgproc::SLIC, avg_superpixel_size, smoothness);
+				slic->iterate();
+				slic->enforceLabelConnectivity(min_superpixel_size_percent);
+
+				// Gets 2D array of the superpixel each pixel is a part of
+				Mat labels;
+				slic->getLabels(labels);
+				int superpixel_count = slic->getNumberOfSuperpixels();
+
+				// Gathers the stats of every superpixel in one pass and hashes them in this stripe's buffer
+				std::vector<HashKey> stats = SLICHashTable::compute_superpixel_stats(database_image, labels, superpixel_count, i);
+				hash_table.Hash(stats, staging);
+
+				// Prints out the pixel count of each superpixel
+				// for (int i = 0; i < superpixel_count; i += 1)
+				// {
+				// 	std::cout << i << ": " << stats[i].pixel_count << std::endl;
+				// }
+
+				// Gets overlay image of superpixels
+				// Mat superpixels;
+				// slic->getLabelContourMask(superpixels);
+
+				// // Creates the output image of superpixels
+				// Mat output(input_image);
+				// // Set each pixel in output to white if it's a superpixel border
+				// for (int row = 0; row < output.rows; row += 1)
+				// for (int col = 0; col < output.cols; col += 1)
+				// {
+				// 	if (superpixels.at<uchar>(row, col) != 0)
+				// 	{
+				// 		output.at<Vec3b>(row, col)[0] = superpixels.at<uchar>(row, col);
+				// 		output.at<Vec3b>(row, col)[1] = superpixels.at<uchar>(row, col);
+				// 		output.at<Vec3b>(row, col)[2] = superpixels.at<uchar>(row, col);
+				// 	}
+				// }
+
+				// // Displays output to a window
+				// imshow(window_name, output);
+				// waitKey(0);
+		
+				// // Write output to an image file
+				// imwrite("output.png", output);
 			}
-		}
+			std::lock_guard<std::mutex> lock(stagings_mutex);
+			stagings.push_back(std::move(staging));
+		});
 
-		// hash superpixels in table
-		hash_table.Hash(database_images[i], labels, superpixel_count, pixel_count);
-
-		// Prints out the pixel count of each superpixel
-		// for (int i = 0; i < superpixel_count; i += 1)
-		// {
-		// 	std::cout << i << ": " << pixel_count[i] << std::endl;
-		// }
-
-		// Gets overlay image of superpixels
-		// Mat superpixels;
-		// slic->getLabelContourMask(superpixels);
-
-		// // Creates the output image of superpixels
-		// Mat output(input_image);
-		// // Set each pixel in output to white if it's a superpixel border
-		// for (int row = 0; row < output.rows; row += 1)
-		// for (int col = 0; col < output.cols; col += 1)
-		// {
-		// 	if (superpixels.at<uchar>(row, col) != 0)
-		// 	{
-		// 		output.at<Vec3b>(row, col)[0] = superpixels.at<uchar>(row, col);
-		// 		output.at<Vec3b>(row, col)[1] = superpixels.at<uchar>(row, col);
-		// 		output.at<Vec3b>(row, col)[2] = superpixels.at<uchar>(row, col);
-		// 	}
-		// }
-
-		// // Displays output to a window
-		// imshow(window_name, output);
-		// waitKey(0);
-		
-		// // Write output to an image file
-		// imwrite("output.png", output);
+		// lay the table out for lookups now that every database image is in it
+		hash_table.freeze(stagings);
+		hash_table.save(index_file);
 	}
 
 	// load query image
@@ -123,88 +134,46 @@ int main(int argc, char* argv[])
 	query_slic->getLabels(query_labels);
 	int query_superpixel_count = query_slic->getNumberOfSuperpixels();
 
-	// count pixels in each query superpixel
-	unsigned long* query_pixel_count = (unsigned long*) calloc(query_superpixel_count, sizeof(unsigned long));
-	for (int row = 0; row < query_labels.rows; row += 1) {
-		for (int col = 0; col < query_labels.cols; col += 1) {
-			query_pixel_count[query_labels.at<int>(row, col)] += 1;
-		}
-	}
-
 	// build HashKey structs for query superpixels
-	HashKey *query_superpixels = (HashKey*) calloc(query_superpixel_count, sizeof(HashKey));
-	for (int row = 0; row < query_labels.rows; row++) {
-		for (int col = 0; col < query_labels.cols; col++) {
-			cv::Vec3b lab_pixel = query_image.at<cv::Vec3b>(row, col); // using BGR as LAB
-			int sp = query_labels.at<int>(row, col);
-			HashKey &curr = query_superpixels[sp];
-
-			// add to total color values
-			curr.l_tot += lab_pixel[0];
-			curr.a_tot += lab_pixel[1];
-			curr.b_tot += lab_pixel[2];
-
-			// set initial params
-			if (curr.pixel_count == 0) {
-				curr.x_range.first = col;
-				curr.x_range.second = col;
-				curr.y_range.first = row;
-				curr.y_range.second = row;
-				curr.original_image = &query_image;
-			// update spatial extent
-			} else {
-				if (curr.x_range.first > col) curr.x_range.first = col;
-				if (curr.x_range.second < col) curr.x_range.second = col;
-				if (curr.y_range.first > row) curr.y_range.first = row;
-				if (curr.y_range.second < row) curr.y_range.second = row;
-			}
-			curr.pixel_count += 1;
-		}
-	}
+	std::vector<HashKey> query_superpixels = SLICHashTable::compute_superpixel_stats(query_image, query_labels, query_superpixel_count, (uint32_t)-1);
 
 	// find matches by counting hash collisions
-	std::map<const cv::Mat*, int> match_counts;
-	for (int i = 0; i < query_superpixel_count; i++) {
-		int query_key = hash_table.calculate_hash_key(query_superpixels[i]);
-		if (query_key == -1) continue;
-
-		// check if this hash key exists in the table
-		if (hash_table.hashTable.count(query_key)) {
-			// if so, iterate all superpixels that share this key
-			std::vector<HashKey>& matches = hash_table.hashTable[query_key];
-			for (const HashKey& match : matches) {
-				// increment the count for the image this superpixel belongs to
-				match_counts[match.original_image]++;
-			}
-		}
-	}
-
-	// find the image with the highest match count
-	const cv::Mat* best_match_image_ptr = nullptr;
-	int max_matches = 0;
-	for (auto const& pair : match_counts) {
-		if (pair.second > max_matches) {
-			max_matches = pair.second;
-			best_match_image_ptr = pair.first;
-		}
+	// rank the database images by the IDF weights of the buckets their superpixels share with the query,
+	// each query superpixel also visiting the neighbouring buckets it is closest to (up to 4 buckets).
+	// buckets with more than 2000 entries are skipped, and buckets stop being visited once the top 3 is known
+	QueryOptions options;
+	options.k = 3;
+	options.probe_budget = 4;
+	options.idf_weighting = true;
+	options.stop_bucket_size = 2000;
+	options.early_termination = true;
+	VoteAccumulator votes;
+	std::vector<ImageMatch> matches;
+	QueryStats query_stats;
+	hash_table.query(query_superpixels, options, votes, matches, &query_stats);
+
+	// how the index is spread over its buckets and what the query had to visit, for tuning the buckets
+	std::cout << hash_table.occupancy_stats().to_json() << std::endl;
+	std::cout << query_stats.to_json() << std::endl;
+
+	for (const ImageMatch& match : matches) {
+		std::cout << hash_table.image_path(match.image_id) << ": " << match.votes << " votes" << std::endl;
 	}
+	int best_match_id = matches.empty() ? -1 : (int)matches[0].image_id;
 
 	// display the query image and the best match
 	namedWindow("Query Image");
 	imshow("Query Image", query_image);
 
-	if (best_match_image_ptr != nullptr) {
+	if (best_match_id != -1) {
 		namedWindow("Best Match");
-		imshow("Best Match", *best_match_image_ptr);
+		imshow("Best Match", imread(hash_table.image_path(best_match_id)));
 	} else {
 		std::cout << "No matches found." << std::endl;
 	}
 	
 	waitKey(0);
 
-	free(query_pixel_count);
-	free(query_superpixels);
-
 	
 
 	return 0;
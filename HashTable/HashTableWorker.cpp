@@ -0,0 +1,13 @@
+// HashTableWorker.cpp
+// Worker process of SLICHashCluster: maps one shard written by SLICHashCluster::partition() and answers
+// the queries of coordinators on a Unix-domain socket until one of them stops it (POSIX only).
+//
+// Run with (SLICHashCluster::start_workers() does this for every shard):
+// HashTableWorker <index file> <socket path>
+
+#include "SLICHashCluster.hpp"
+
+int main(int argc, char** argv)
+{
+	return SLICHashCluster::worker_main(argc, argv);
+}
@@ -0,0 +1,412 @@
+#ifndef SLICHASHCLUSTER_HPP
+#define SLICHASHCLUSTER_HPP
+
+#include "SLICHashTable.hpp"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* A superpixel index partitioned across local worker processes (POSIX only). The image ids are sharded
+   over N saved SLICHashTables (image_id % N, see partition()), every worker process maps one of them and
+   answers queries on a Unix-domain socket, and the coordinator sends a query to every worker at once and
+   merges their top k. An image lives in exactly one shard and every shard keeps the IDF weights of the
+   whole table, so its votes are the ones the whole table would give it and the merged top k is the top k
+   of the whole table.
+
+   A worker is a process of its own, HashTableWorker (worker_main()), started with fork and exec so it
+   shares nothing with a coordinator that may already run threads. Queries travel as the raw HashKeys of
+   the query superpixels, so the coordinator and the workers have to be built from the same sources with
+   the same Config. */
+template<class Config = DefaultBucketConfig>
+class SLICHashClusterT {
+    private:
+        typedef SLICHashTableT<Config> Table;
+
+        enum RequestType : uint32_t { QUERY = 1, STOP = 2 };
+
+        // fixed-size head of a request, followed by superpixel_count HashKeys for a query.
+        // the answer is a uint32_t match count followed by that many ImageMatches
+        struct Request {
+            uint32_t type;
+            uint32_t superpixel_count;
+            int32_t k;
+            int32_t probe_budget;
+            uint32_t stop_bucket_size;
+            uint8_t idf_weighting;
+            uint8_t truncate_stop_buckets;
+            uint8_t early_termination;
+            uint8_t reserved;
+        };
+
+        // the largest query a worker takes, so a garbled request is refused instead of making it allocate
+        // gigabytes. far above the superpixels of any image and any sensible k
+        static constexpr uint32_t max_query_superpixels = 1 << 20;
+        static constexpr int32_t max_k = 1 << 16;
+
+        struct Worker {
+            std::string socket_path;
+            // -1 once the connection failed, the worker is left out from then on
+            int socket = -1;
+            // the process, if this coordinator spawned it
+            pid_t pid = -1;
+        };
+
+        std::vector<Worker> workers;
+        // one query at a time goes over the connections
+        std::mutex query_mutex;
+
+        static bool write_all(int socket, const void* data, size_t size) {
+            const char* bytes = (const char*)data;
+            while (size > 0) {
+                ssize_t written = send(socket, bytes, size, MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0) return false;
+                bytes += written;
+                size -= written;
+            }
+            return true;
+        }
+
+        static bool read_all(int socket, void* data, size_t size) {
+            char* bytes = (char*)data;
+            while (size > 0) {
+                ssize_t read = recv(socket, bytes, size, 0);
+                if (read < 0 && errno == EINTR) continue;
+                if (read <= 0) return false;
+                bytes += read;
+                size -= read;
+            }
+            return true;
+        }
+
+        // closes the connection of a worker that didn't take a request or answer it, whatever it sent
+        // after that can't be told apart from the next answer
+        static void drop(Worker& worker) {
+            close(worker.socket);
+            worker.socket = -1;
+        }
+
+        static bool socket_address(const std::string& socket_path, sockaddr_un& address) {
+            address = sockaddr_un();
+            address.sun_family = AF_UNIX;
+            if (socket_path.size() >= sizeof(address.sun_path)) return false;
+            memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+            return true;
+        }
+
+        // answers the requests of one coordinator until it disconnects or sends a request that isn't one
+        // (the connection is dropped then). returns false on a STOP request
+        static bool serve_connection(const Table& table, int connection) {
+            VoteAccumulator votes;
+            std::vector<HashKey> query_superpixels;
+            std::vector<ImageMatch> matches;
+            Request request;
+            while (read_all(connection, &request, sizeof(request))) {
+                if (request.type == STOP) return false;
+                if (request.type != QUERY || request.superpixel_count > max_query_superpixels ||
+                    request.k < 0 || request.k > max_k) {
+                    break;
+                }
+                query_superpixels.resize(request.superpixel_count);
+                if (!read_all(connection, query_superpixels.data(), query_superpixels.size() * sizeof(HashKey))) break;
+
+                QueryOptions options;
+                options.k = request.k;
+                options.probe_budget = request.probe_budget;
+                options.idf_weighting = request.idf_weighting != 0;
+                options.stop_bucket_size = request.stop_bucket_size;
+                options.truncate_stop_buckets = request.truncate_stop_buckets != 0;
+                options.early_termination = request.early_termination != 0;
+                table.query(query_superpixels, options, votes, matches);
+
+                uint32_t count = (uint32_t)matches.size();
+                if (!write_all(connection, &count, sizeof(count))) break;
+                if (!write_all(connection, matches.data(), matches.size() * sizeof(ImageMatch))) break;
+            }
+            return true;
+        }
+
+        // top k of the matches of every shard, most votes first (ties go to the lower id like top_k())
+        static void merge_matches(int k, std::vector<ImageMatch>& matches) {
+            std::sort(matches.begin(), matches.end(), [](const ImageMatch& first, const ImageMatch& second) {
+                return first.votes > second.votes || (first.votes == second.votes && first.image_id < second.image_id);
+            });
+            if ((int)matches.size() > k) matches.resize(std::max(k, 0));
+        }
+
+    public:
+        // shard of an image in a cluster of shard_count workers
+        static int shard_of(uint32_t image_id, int shard_count) {
+            return (int)(image_id % (uint32_t)shard_count);
+        }
+
+        // splits a frozen table into shard_count tables saved as <prefix>_<shard>.slic, which keep their
+        // image paths and the bucket weights of the whole table. returns false if one of them can't be written
+        static bool partition(const Table& table, int shard_count, const std::string& prefix) {
+            HashStaging all;
+            table.stage_entries(all);
+            std::vector<HashStaging> shards(shard_count);
+            for (const auto& record : all.records) {
+                shards[shard_of(record.second.image_id, shard_count)].records.push_back(record);
+            }
+            for (int shard = 0; shard < shard_count; shard++) {
+                Table shard_table;
+                for (uint32_t image_id = shard; image_id < table.image_id_count(); image_id += shard_count) {
+                    if (!table.image_path(image_id).empty()) shard_table.set_image_path(image_id, table.image_path(image_id));
+                }
+                std::vector<HashStaging> stagings(1);
+                stagings[0].records.swap(shards[shard].records);
+                // image ids stay what they were, so a shard has room for every id below the highest one
+                stagings[0].image_count = all.image_count;
+                shard_table.freeze(stagings);
+                shard_table.copy_bucket_weights(table);
+                if (!shard_table.save(prefix + "_" + std::to_string(shard) + ".slic")) return false;
+            }
+            return true;
+        }
+
+        // worker: answers queries on table at socket_path (one thread per coordinator connection) until a
+        // coordinator sends STOP. returns false if the socket can't be set up
+        static bool serve(const Table& table, const std::string& socket_path) {
+            sockaddr_un address;
+            if (!socket_address(socket_path, address)) return false;
+            int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener < 0) return false;
+            unlink(socket_path.c_str());
+            if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+                close(listener);
+                return false;
+            }
+
+            // a STOP shuts the listener and every open connection down, which wakes up accept() and the
+            // threads waiting for the next request of their coordinator
+            std::mutex stop_mutex;
+            bool stopped = false;
+            std::vector<int> open_connections;
+            std::vector<std::thread> threads;
+            while (true) {
+                int connection = accept(listener, nullptr, nullptr);
+                if (connection < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(stop_mutex);
+                    if (stopped) {
+                        close(connection);
+                        break;
+                    }
+                    open_connections.push_back(connection);
+                }
+                threads.push_back(std::thread([&, connection]() {
+                    bool stop = !serve_connection(table, connection);
+                    std::lock_guard<std::mutex> lock(stop_mutex);
+                    if (stop && !stopped) {
+                        stopped = true;
+                        shutdown(listener, SHUT_RDWR);
+                        for (int open : open_connections) shutdown(open, SHUT_RDWR);
+                    }
+                    open_connections.erase(std::find(open_connections.begin(), open_connections.end(), connection));
+                    close(connection);
+                }));
+            }
+            for (std::thread& thread : threads) thread.join();
+            close(listener);
+            unlink(socket_path.c_str());
+            return true;
+        }
+
+        // main() of a worker binary: maps the table saved at argv[1] and serves it at argv[2]
+        static int worker_main(int argc, char** argv) {
+            if (argc != 3) {
+                fprintf(stderr, "usage: %s <index file> <socket path>\n", argv[0]);
+                return 2;
+            }
+            Table table;
+            if (!table.load(argv[1])) {
+                fprintf(stderr, "can't load %s\n", argv[1]);
+                return 1;
+            }
+            return serve(table, argv[2]) ? 0 : 1;
+        }
+
+        // starts worker_binary (see worker_main()) for the table saved at index_file and socket_path.
+        // the child only calls exec after the fork, which is safe in a process that runs other threads.
+        // returns its pid, or -1 if it can't be forked (a binary that can't be run exits with 127)
+        static pid_t spawn_worker(const std::string& worker_binary, const std::string& index_file,
+                                  const std::string& socket_path) {
+            char* arguments[] = { (char*)worker_binary.c_str(), (char*)index_file.c_str(), (char*)socket_path.c_str(), nullptr };
+            pid_t pid = fork();
+            if (pid != 0) return pid;
+            execv(arguments[0], arguments);
+            _exit(127);
+        }
+
+        SLICHashClusterT() {}
+        SLICHashClusterT(const SLICHashClusterT&) = delete;
+        SLICHashClusterT& operator=(const SLICHashClusterT&) = delete;
+
+        ~SLICHashClusterT() {
+            disconnect();
+        }
+
+        // adds a running worker, or a spawned one whose process stop_workers() should wait for. connecting is
+        // retried for up to timeout_ms, for a worker that is still loading its index. a spawned worker that
+        // doesn't come up is killed (if it is still running) and waited for
+        bool connect_worker(const std::string& socket_path, pid_t pid = -1, int timeout_ms = 5000) {
+            sockaddr_un address;
+            if (!socket_address(socket_path, address)) return false;
+            Worker worker;
+            worker.socket_path = socket_path;
+            worker.pid = pid;
+            for (int waited = 0; ; waited += 10) {
+                worker.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (worker.socket < 0) return false;
+                if (connect(worker.socket, (const sockaddr*)&address, sizeof(address)) == 0) break;
+                close(worker.socket);
+                worker.socket = -1;
+                // a spawned worker that already exited won't come up
+                if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) return false;
+                if (waited >= timeout_ms) {
+                    if (pid > 0) {
+                        kill(pid, SIGTERM);
+                        waitpid(pid, nullptr, 0);
+                        unlink(socket_path.c_str());
+                    }
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            workers.push_back(worker);
+            return true;
+        }
+
+        // spawns (see spawn_worker()) and connects a worker for every shard written by partition(). if one of
+        // them doesn't come up, the ones started before it are stopped again (workers connected before the
+        // call are kept)
+        bool start_workers(const std::string& worker_binary, const std::string& prefix, int shard_count,
+                           const std::string& socket_directory) {
+            size_t first = workers.size();
+            for (int shard = 0; shard < shard_count; shard++) {
+                std::string socket_path = socket_directory + "/shard_" + std::to_string(shard) + ".sock";
+                pid_t pid = spawn_worker(worker_binary, prefix + "_" + std::to_string(shard) + ".slic", socket_path);
+                if (pid < 0 || !connect_worker(socket_path, pid)) {
+                    stop_workers(first);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // workers still connected
+        size_t worker_count() const {
+            return std::count_if(workers.begin(), workers.end(), [](const Worker& worker) { return worker.socket >= 0; });
+        }
+
+        // SLICHashTableT::query() over every shard: the request goes out to every worker before any answer is
+        // read, so the shards are searched at the same time. options.early_termination isn't used (the images
+        // are the ones it would find, with their full votes). returns false if a worker didn't answer, then
+        // matches only hold the images of the other shards and the worker is dropped (see worker_count()),
+        // and without sending anything for more than max_query_superpixels superpixels or k above max_k
+        bool query(const std::vector<HashKey>& query_superpixels, const QueryOptions& options,
+                   std::vector<ImageMatch>& matches) {
+            // a query the workers would refuse isn't sent
+            matches.clear();
+            if (query_superpixels.size() > max_query_superpixels || options.k < 0 || options.k > max_k) return false;
+            std::lock_guard<std::mutex> lock(query_mutex);
+            Request request = {};
+            request.type = QUERY;
+            request.superpixel_count = (uint32_t)query_superpixels.size();
+            request.k = options.k;
+            request.probe_budget = options.probe_budget;
+            request.stop_bucket_size = options.stop_bucket_size;
+            request.idf_weighting = options.idf_weighting;
+            request.truncate_stop_buckets = options.truncate_stop_buckets;
+            // every shard counts the votes of its top k to the end: early_termination stops each shard at its
+            // own point, and votes cut short there can't be ranked against the votes of other shards
+            request.early_termination = false;
+
+            bool answered = true;
+            for (Worker& worker : workers) {
+                if (worker.socket < 0) {
+                    answered = false;
+                } else if (!write_all(worker.socket, &request, sizeof(request)) ||
+                           !write_all(worker.socket, query_superpixels.data(), query_superpixels.size() * sizeof(HashKey))) {
+                    drop(worker);
+                    answered = false;
+                }
+            }
+
+            matches.clear();
+            for (Worker& worker : workers) {
+                if (worker.socket < 0) continue;
+                uint32_t count = 0;
+                size_t first = matches.size();
+                // a worker answers with its top k at most
+                bool read = read_all(worker.socket, &count, sizeof(count)) && count <= (uint32_t)std::max(options.k, 0);
+                if (read) {
+                    matches.resize(first + count);
+                    read = read_all(worker.socket, matches.data() + first, count * sizeof(ImageMatch));
+                }
+                if (!read) {
+                    // no part of an answer gets merged
+                    matches.resize(first);
+                    drop(worker);
+                    answered = false;
+                }
+            }
+            merge_matches(options.k, matches);
+            return answered;
+        }
+
+        bool query(const std::vector<HashKey>& query_superpixels, int k, int probe_budget,
+                   std::vector<ImageMatch>& matches) {
+            QueryOptions options;
+            options.k = k;
+            options.probe_budget = probe_budget;
+            return query(query_superpixels, options, matches);
+        }
+
+        // closes the connections (the workers keep running)
+        void disconnect() {
+            for (Worker& worker : workers) {
+                if (worker.socket >= 0) close(worker.socket);
+            }
+            workers.clear();
+        }
+
+        // stops the workers from the first-th one on (every worker by default) and waits for the ones this
+        // coordinator spawned. a worker that can't be sent a STOP (it was dropped) is killed and its socket
+        // removed if it was spawned here, and left running otherwise
+        void stop_workers(size_t first = 0) {
+            Request request = {};
+            request.type = STOP;
+            for (size_t w = first; w < workers.size(); w++) {
+                Worker& worker = workers[w];
+                bool sent = worker.socket >= 0 && write_all(worker.socket, &request, sizeof(request));
+                if (!sent && worker.pid > 0) {
+                    kill(worker.pid, SIGTERM);
+                    unlink(worker.socket_path.c_str());
+                }
+            }
+            for (size_t w = first; w < workers.size(); w++) {
+                if (workers[w].pid > 0) waitpid(workers[w].pid, nullptr, 0);
+                if (workers[w].socket >= 0) close(workers[w].socket);
+            }
+            workers.resize(first);
+        }
+};
+
+typedef SLICHashClusterT<> SLICHashCluster;
+
+
+#endif
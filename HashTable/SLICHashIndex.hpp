@@ -0,0 +1,349 @@
+#ifndef SLICHASHINDEX_HPP
+#define SLICHASHINDEX_HPP
+
+#include "SLICHashTable.hpp"
+#include <stdio.h>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* A persistent superpixel index kept in a directory as saved SLICHashTables ("segments") that are served
+   straight from their mapped files. The first segment is the base, every append() adds a delta segment
+   with the new images, and merge_in_background() folds the segments into a new base on another thread
+   while queries keep running on the old ones. The list of live segments is the "segments" file in the
+   directory, which is replaced (not rewritten) whenever it changes. Every file is synced to the disk before
+   it is renamed into place and the directory after it, so a crash or a power loss leaves either the old
+   or the new list behind, with every segment it names complete. Config is the bucket geometry of every segment (see SLICBucketConfig).
+
+   Images can be removed (remove_images()) or replaced (upsert()) without rewriting a segment: every
+   segment has a bitmap of the image ids whose entries don't vote anymore ("tombstones"), kept next to
+   it as "<segment>.removed". The next merge drops those entries for good.
+
+   Queries never lock: the segments and their tombstones are an immutable snapshot that writers copy,
+   change and publish as a whole with an atomic store, so a query runs on the snapshot it loaded and an
+   old snapshot goes away with its last query. Writers are serialized by writer_mutex. */
+template<class Config = DefaultBucketConfig>
+class SLICHashIndexT {
+    private:
+        typedef SLICHashTableT<Config> Table;
+        typedef std::vector<uint64_t> Bitmap;
+
+        struct Segment {
+            std::string file_name;
+            std::shared_ptr<const Table> table;
+            // nullptr until an image of the segment is removed
+            std::shared_ptr<const Bitmap> removed;
+        };
+
+        // live segments, base first
+        typedef std::vector<Segment> Snapshot;
+
+        std::string directory;
+
+        // only accessed through std::atomic_load / std::atomic_store
+        std::shared_ptr<const Snapshot> current;
+
+        // held while the index changes (append, remove_images, upsert and the swap at the end of a merge)
+        std::mutex writer_mutex;
+        int next_segment = 0;
+
+        std::thread merge_thread;
+        std::atomic<bool> merging;
+
+        std::string file_path(const std::string& file_name) const {
+            return directory + "/" + file_name;
+        }
+
+        std::shared_ptr<const Snapshot> snapshot() const {
+            return std::atomic_load(&current);
+        }
+
+        void publish(const Snapshot& segments) {
+            std::atomic_store(&current, std::shared_ptr<const Snapshot>(new Snapshot(segments)));
+        }
+
+        // writes the list of segments next to the old one and renames it over it (writer_mutex held)
+        bool write_segment_list(const Snapshot& segments) const {
+            std::string list = file_path("segments");
+            std::string temporary = list + ".tmp";
+            FILE* stream = fopen(temporary.c_str(), "w");
+            if (stream == nullptr) return false;
+            bool written = fprintf(stream, "%d\n", next_segment) > 0;
+            for (const Segment& segment : segments) {
+                written = written && fprintf(stream, "%s\n", segment.file_name.c_str()) > 0;
+            }
+            written = close_synced(stream) && written;
+            if (!written || !rename_synced(temporary, list)) {
+                remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // writes the tombstones of a segment the same way
+        bool write_removed(const Segment& segment) const {
+            std::string path = file_path(segment.file_name + ".removed");
+            std::string temporary = path + ".tmp";
+            FILE* stream = fopen(temporary.c_str(), "wb");
+            if (stream == nullptr) return false;
+            const Bitmap& removed = *segment.removed;
+            bool written = fwrite(removed.data(), sizeof(uint64_t), removed.size(), stream) == removed.size();
+            written = close_synced(stream) && written;
+            if (!written || !rename_synced(temporary, path)) {
+                remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // reads the tombstones of a segment into removed (nullptr if it has none). false if the file is
+        // there but doesn't hold one bit per image id of the table, rounded up to whole words
+        bool read_removed(const std::string& file_name, const Table& table, std::shared_ptr<const Bitmap>& removed) const {
+            removed = nullptr;
+            FILE* stream = fopen(file_path(file_name + ".removed").c_str(), "rb");
+            if (stream == nullptr) return true;
+            std::shared_ptr<Bitmap> words(new Bitmap((table.image_id_count() + 63) / 64));
+            bool complete = fread(words->data(), sizeof(uint64_t), words->size(), stream) == words->size()
+                            && fgetc(stream) == EOF;
+            fclose(stream);
+            if (!complete) return false;
+            removed = words;
+            return true;
+        }
+
+        void remove_segment_files(const Segment& segment) const {
+            remove(file_path(segment.file_name).c_str());
+            remove(file_path(segment.file_name + ".removed").c_str());
+        }
+
+        // sets image_ids in the tombstones of every segment that has them, copying the bitmaps that change
+        // and writing them to disk (writer_mutex held)
+        bool set_removed(Snapshot& segments, const std::vector<uint32_t>& image_ids) const {
+            for (Segment& segment : segments) {
+                std::shared_ptr<Bitmap> removed;
+                for (uint32_t image_id : image_ids) {
+                    if (image_id >= segment.table->image_id_count()) continue;
+                    if (is_image_removed(segment.removed.get(), image_id)) continue;
+                    if (removed == nullptr) {
+                        removed.reset(segment.removed != nullptr ? new Bitmap(*segment.removed) : new Bitmap());
+                        removed->resize((segment.table->image_id_count() + 63) / 64, 0);
+                    }
+                    (*removed)[image_id / 64] |= (uint64_t)1 << (image_id % 64);
+                }
+                if (removed == nullptr) continue;
+                segment.removed = removed;
+                if (!write_removed(segment)) return false;
+            }
+            return true;
+        }
+
+        // saves a frozen table as a new segment file and maps it (writer_mutex held)
+        bool save_segment(const Table& table, Segment& segment) {
+            segment.file_name = "segment_" + std::to_string(next_segment++) + ".slic";
+            segment.removed = nullptr;
+            std::shared_ptr<Table> mapped(new Table());
+            if (!table.save(file_path(segment.file_name)) || !mapped->load(file_path(segment.file_name))) {
+                remove(file_path(segment.file_name).c_str());
+                return false;
+            }
+            segment.table = mapped;
+            return true;
+        }
+
+        // merges the segments of a snapshot into a new base without the entries of removed images, and swaps
+        // it in for them. images removed while the merge runs become tombstones of the new base
+        void merge(std::shared_ptr<const Snapshot> merged) {
+            Table base;
+            std::vector<HashStaging> stagings(merged->size());
+            for (size_t s = 0; s < merged->size(); s++) {
+                const Segment& segment = (*merged)[s];
+                segment.table->stage_entries(stagings[s], segment.removed.get());
+                for (uint32_t image_id = 0; image_id < segment.table->image_id_count(); image_id++) {
+                    const std::string& path = segment.table->image_path(image_id);
+                    if (!path.empty() && !is_image_removed(segment.removed.get(), image_id)) {
+                        base.set_image_path(image_id, path);
+                    }
+                }
+            }
+            base.freeze(stagings);
+
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            Segment merged_base;
+            if (!save_segment(base, merged_base)) {
+                merging = false;
+                return;
+            }
+
+            // merges only ever replace the front of the list, so the merged segments are still the first ones
+            std::shared_ptr<const Snapshot> segments = snapshot();
+            std::vector<uint32_t> removed_since;
+            for (size_t s = 0; s < merged->size(); s++) {
+                const Segment& before = (*merged)[s];
+                const Segment& now = (*segments)[s];
+                if (now.removed == before.removed) continue;
+                for (uint32_t image_id = 0; image_id < now.table->image_id_count(); image_id++) {
+                    if (is_image_removed(now.removed.get(), image_id) && !is_image_removed(before.removed.get(), image_id)) {
+                        removed_since.push_back(image_id);
+                    }
+                }
+            }
+
+            // segments appended while merging stay behind the new base, with their own tombstones: an image
+            // removed since may have been upserted into one of them, so only the new base gets removed_since
+            Snapshot remaining(1, merged_base);
+            bool base_removed = set_removed(remaining, removed_since);
+            remaining.insert(remaining.end(), segments->begin() + merged->size(), segments->end());
+            if (!base_removed || !write_segment_list(remaining)) {
+                remove_segment_files(merged_base);
+                merging = false;
+                return;
+            }
+            publish(remaining);
+
+            // mapped files stay readable after they are removed, for queries still holding them
+            for (const Segment& segment : *merged) remove_segment_files(segment);
+            merging = false;
+        }
+
+    public:
+        // opens the index kept in directory (which has to exist), empty if it has no segment list yet
+        explicit SLICHashIndexT(const std::string& directory) : directory(directory), merging(false) {
+            Snapshot segments;
+            std::ifstream stream(file_path("segments").c_str());
+            std::string file_name;
+            if (!(stream >> next_segment)) next_segment = 0;
+            while (stream >> file_name) {
+                // a segment that can't be read is left out, rather than served with entries it shouldn't have
+                std::shared_ptr<Table> table(new Table());
+                std::shared_ptr<const Bitmap> removed;
+                if (table->load(file_path(file_name)) && read_removed(file_name, *table, removed)) {
+                    segments.push_back(Segment{file_name, table, removed});
+                }
+            }
+            publish(segments);
+        }
+
+        SLICHashIndexT(const SLICHashIndexT&) = delete;
+        SLICHashIndexT& operator=(const SLICHashIndexT&) = delete;
+
+        ~SLICHashIndexT() {
+            wait_for_merge();
+        }
+
+        size_t segment_count() const {
+            return snapshot()->size();
+        }
+
+        // adds the images of a table as a new delta segment (the table is frozen and saved first).
+        // image ids have to be unique across the whole index, use upsert() to replace images
+        bool append(Table& table) {
+            table.freeze();
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            Segment segment;
+            if (!save_segment(table, segment)) return false;
+
+            Snapshot segments = *snapshot();
+            segments.push_back(segment);
+            if (!write_segment_list(segments)) {
+                remove_segment_files(segment);
+                return false;
+            }
+            publish(segments);
+            return true;
+        }
+
+        // removes images from the index: their entries stop voting right away and are dropped by the next merge
+        bool remove_images(const std::vector<uint32_t>& image_ids) {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            Snapshot segments = *snapshot();
+            if (!set_removed(segments, image_ids)) return false;
+            publish(segments);
+            return true;
+        }
+
+        // adds the images of a table like append(), replacing the images with the same ids already in the
+        // index. a query sees either the old or the new version of the images, never both or neither
+        bool upsert(Table& table) {
+            table.freeze();
+            std::vector<uint32_t> image_ids;
+            table.image_ids(image_ids);
+
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            Segment segment;
+            if (!save_segment(table, segment)) return false;
+
+            Snapshot segments = *snapshot();
+            if (!set_removed(segments, image_ids)) {
+                remove_segment_files(segment);
+                return false;
+            }
+            segments.push_back(segment);
+            if (!write_segment_list(segments)) {
+                remove_segment_files(segment);
+                return false;
+            }
+            publish(segments);
+            return true;
+        }
+
+        // starts folding every current segment into a new base on another thread, which also compacts away
+        // the entries of removed images. returns false if a merge is already running or there's nothing to do
+        bool merge_in_background() {
+            if (merging.exchange(true)) return false;
+            if (merge_thread.joinable()) merge_thread.join();
+            std::shared_ptr<const Snapshot> merged = snapshot();
+            bool has_removed = false;
+            for (const Segment& segment : *merged) has_removed = has_removed || segment.removed != nullptr;
+            if (merged->size() < 2 && !has_removed) {
+                merging = false;
+                return false;
+            }
+            merge_thread = std::thread(&SLICHashIndexT::merge, this, merged);
+            return true;
+        }
+
+        void wait_for_merge() {
+            if (merge_thread.joinable()) merge_thread.join();
+        }
+
+        // SLICHashTableT::query() over every segment
+        void query(const std::vector<HashKey>& query_superpixels, int k, int probe_budget,
+                   VoteAccumulator& votes, std::vector<ImageMatch>& matches) const {
+            QueryOptions options;
+            options.k = k;
+            options.probe_budget = probe_budget;
+            query(query_superpixels, options, votes, matches);
+        }
+
+        // query() with stop buckets (IDF weights are per segment, so idf_weighting isn't used here)
+        void query(const std::vector<HashKey>& query_superpixels, const QueryOptions& options,
+                   VoteAccumulator& votes, std::vector<ImageMatch>& matches) const {
+            std::shared_ptr<const Snapshot> segments = snapshot();
+            for (const Segment& segment : *segments) {
+                votes.prepare(segment.table->image_id_count());
+                segment.table->add_votes(query_superpixels, options, votes, segment.removed.get());
+            }
+            votes.top_k(options.k, matches);
+            votes.reset();
+        }
+
+        // path an image was last hashed with (empty if it isn't known or was removed)
+        std::string image_path(uint32_t image_id) const {
+            std::shared_ptr<const Snapshot> segments = snapshot();
+            for (auto segment = segments->rbegin(); segment != segments->rend(); ++segment) {
+                if (is_image_removed(segment->removed.get(), image_id)) continue;
+                const std::string& path = segment->table->image_path(image_id);
+                if (!path.empty()) return path;
+            }
+            return std::string();
+        }
+};
+
+typedef SLICHashIndexT<> SLICHashIndex;
+
+
+#endif
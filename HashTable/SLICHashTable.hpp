@@ -1,9 +1,24 @@
 #ifndef SLICHASHTABLE_HPP
 #define SLICHASHTABLE_HPP
 
-#include <opencv2/core/mat.hpp>
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
 
 /* a HashKey pointer will point to an array of size superpixel_count (+1 if labels start at 1), 
 in which HashKeys will occupy the indices of the superpixels they represent.
@@ -12,108 +27,1254 @@ to will be dynamically updated.  */
 typedef struct {
     signed long l_tot, a_tot, b_tot;
     std::pair<int, int> x_range, y_range;
-    const cv::Mat *original_image;
+    // size of the image the superpixel is in, the spatial part of its key is relative to it
+    int image_width, image_height;
+    uint32_t image_id;
     unsigned long pixel_count;
 } HashKey;
 
+/* what the table stores for every superpixel: 16 bytes instead of a full HashKey, and an image id
+   instead of a pointer so the images don't have to stay in memory while they are indexed */
+typedef struct {
+    uint32_t image_id;
+    // average color, rounded to 8 bits per channel
+    uint8_t l, a, b;
+    uint8_t reserved;
+    // center of the superpixel's bounding box relative to the image size, in 1/65536ths of the width / height
+    uint16_t x_center, y_center;
+    uint32_t pixel_count;
+} SuperpixelRecord;
+static_assert(sizeof(SuperpixelRecord) == 16, "SuperpixelRecord should stay 16 bytes");
+
+/* entries of one bucket of the table, as a range that can be used in range-based for loops */
+struct HashBucket {
+    const SuperpixelRecord* first;
+    const SuperpixelRecord* last;
+
+    const SuperpixelRecord* begin() const { return first; }
+    const SuperpixelRecord* end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+};
+
+/* entries hashed by one thread of a concurrent build (see SLICHashTable::Hash(superpixels, staging)),
+   kept as (key, record) pairs until SLICHashTable::freeze(stagings) merges them into the table */
+struct HashStaging {
+    std::vector<std::pair<int, SuperpixelRecord>> records;
+    // full stats of the records, in the same order (only filled if the table keeps them)
+    std::vector<HashKey> stats;
+    // one more than the highest image id staged
+    uint32_t image_count = 0;
+};
+
+/* a whole file mapped read-only into memory (read into a buffer where mmap isn't available),
+   unmapped when the last table serving from it goes away */
+class MappedIndexFile {
+    private:
+        const unsigned char* mapped = nullptr;
+        size_t mapped_size = 0;
+        std::vector<unsigned char> buffer;
+
+        MappedIndexFile() {}
+
+    public:
+        MappedIndexFile(const MappedIndexFile&) = delete;
+        MappedIndexFile& operator=(const MappedIndexFile&) = delete;
+
+        ~MappedIndexFile() {
+#ifndef _WIN32
+            if (mapped != nullptr && buffer.empty()) munmap((void*)mapped, mapped_size);
+#endif
+        }
+
+        // nullptr if the file can't be opened or is empty
+        static std::shared_ptr<MappedIndexFile> open(const std::string& path) {
+            std::shared_ptr<MappedIndexFile> file(new MappedIndexFile());
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return nullptr;
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size == 0) {
+                close(fd);
+                return nullptr;
+            }
+            void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED) return nullptr;
+            file->mapped = (const unsigned char*)data;
+            file->mapped_size = (size_t)info.st_size;
+#else
+            FILE* stream = fopen(path.c_str(), "rb");
+            if (stream == nullptr) return nullptr;
+            unsigned char chunk[65536];
+            size_t read;
+            while ((read = fread(chunk, 1, sizeof(chunk), stream)) > 0) {
+                file->buffer.insert(file->buffer.end(), chunk, chunk + read);
+            }
+            fclose(stream);
+            if (file->buffer.empty()) return nullptr;
+            file->mapped = file->buffer.data();
+            file->mapped_size = file->buffer.size();
+#endif
+            return file;
+        }
+
+        const unsigned char* data() const { return mapped; }
+        size_t size() const { return mapped_size; }
+};
+
+// flushes a file written with stdio to the disk and closes it. false if either fails
+inline bool close_synced(FILE* stream) {
+    bool synced = fflush(stream) == 0;
+#ifndef _WIN32
+    synced = fsync(fileno(stream)) == 0 && synced;
+#endif
+    return fclose(stream) == 0 && synced;
+}
+
+// renames a (synced) temporary file over path and flushes the directory, so after a crash or a power
+// loss path is either the old or the new file
+inline bool rename_synced(const std::string& temporary, const std::string& path) {
+    if (rename(temporary.c_str(), path.c_str()) != 0) return false;
+#ifndef _WIN32
+    size_t slash = path.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+#else
+    return true;
+#endif
+}
+
+/* header of a saved table (see SLICHashTable::save()). the file is laid out as
+   header | bucket offsets (bucket_count + 1 uint32) | bucket weights (bucket_count float) | records |
+   image paths (uint32 length + bytes per id)
+   with the offsets, the weights and the records starting on 16 byte boundaries, so they can be used in place */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucket_count;
+    uint64_t entry_count;
+    uint32_t image_count;
+    // spatial grid of the table that saved the file
+    uint32_t x_buckets, y_buckets;
+    uint32_t reserved;
+    uint64_t offsets_start;
+    uint64_t weights_start;
+    uint64_t entries_start;
+    uint64_t paths_start;
+    uint64_t paths_size;
+} HashIndexFileHeader;
+
+static const char SLIC_HASH_INDEX_MAGIC[8] = {'S', 'L', 'I', 'C', 'H', 'I', 'D', 'X'};
+static const uint32_t SLIC_HASH_INDEX_VERSION = 3;
+
+/* an image returned by a query and the votes it got: the number of query superpixels that collided with
+   its superpixels, or their weight with QueryOptions::idf_weighting */
+struct ImageMatch {
+    uint32_t image_id;
+    float votes;
+};
+
+/* how SLICHashTable::query() ranks images */
+struct QueryOptions {
+    // number of images returned
+    int k = 10;
+    // buckets visited per query superpixel (see SLICHashTable::probe_keys())
+    int probe_budget = 1;
+    // inverted-file scoring: a visited bucket adds its IDF weight (see bucket_weight()) once to every image
+    // with entries in it, instead of one vote per entry, so common buckets (greys, skies) count for little.
+    // a table that was never frozen has no weights yet and gives every bucket the same one
+    bool idf_weighting = false;
+    // buckets with more entries than this are stop buckets (0: no limit). they are skipped, or only their
+    // first stop_bucket_size entries are visited with truncate_stop_buckets
+    unsigned int stop_bucket_size = 0;
+    bool truncate_stop_buckets = false;
+    // with idf_weighting: visit buckets from the highest weight down and stop as soon as the remaining ones
+    // can't change which images are in the top k. the images are the same as without it, their votes (and
+    // so their order) only count the buckets visited until then
+    bool early_termination = false;
+};
+
+/* what a query did, filled by SLICHashTable::query() to tune bucket sizes against query latency */
+struct QueryStats {
+    size_t superpixels = 0;
+    // buckets looked up (with idf_weighting a bucket probed by several superpixels is looked up once),
+    // how many of them were empty, and how many were stop buckets
+    size_t probed_buckets = 0;
+    size_t empty_buckets = 0;
+    size_t stop_buckets = 0;
+    // entries visited, and the images that got votes from them
+    size_t candidates = 0;
+    size_t voted_images = 0;
+    double milliseconds = 0;
+
+    std::string to_json() const {
+        char json[256];
+        snprintf(json, sizeof(json),
+                 "{\"superpixels\": %zu, \"probed_buckets\": %zu, \"empty_buckets\": %zu, \"stop_buckets\": %zu, "
+                 "\"candidates\": %zu, \"voted_images\": %zu, \"milliseconds\": %.4f}",
+                 superpixels, probed_buckets, empty_buckets, stop_buckets, candidates, voted_images, milliseconds);
+        return json;
+    }
+};
+
+/* how the superpixels of a table spread over its buckets, see SLICHashTable::occupancy_stats().
+   sizes are numbers of entries, the ones a query sees (the frozen entries of a frozen table) */
+struct HashTableStats {
+    size_t bucket_count = 0;
+    size_t occupied_buckets = 0;
+    size_t entry_count = 0;
+    uint32_t image_count = 0;
+
+    // size of the biggest bucket and percentiles of the sizes of the occupied buckets
+    size_t max_bucket_size = 0;
+    size_t p50_bucket_size = 0;
+    size_t p90_bucket_size = 0;
+    size_t p99_bucket_size = 0;
+    double mean_bucket_size = 0;
+    // mean size of the bucket of an entry (sum of squared sizes / entries): what a query superpixel
+    // distributed like the indexed ones scans on average, which skew drives up
+    double entry_bucket_size = 0;
+
+    // occupancy_histogram[0] is the number of empty buckets, occupancy_histogram[i] the number of buckets
+    // with 2^(i - 1) up to 2^i - 1 entries
+    std::vector<size_t> occupancy_histogram;
+
+    // entries in every bucket of each dimension of the key (l, a, b, x, y)
+    std::vector<size_t> dimension_entries[5];
+
+    // memory used by the table (staged entries included, an estimate for the unordered_maps)
+    size_t bytes = 0;
+    double bytes_per_entry = 0;
+
+    std::string to_json() const {
+        static const char* const dimensions[5] = {"l", "a", "b", "x", "y"};
+        char numbers[512];
+        snprintf(numbers, sizeof(numbers),
+                 "\"bucket_count\": %zu, \"occupied_buckets\": %zu, \"entry_count\": %zu, \"image_count\": %u, "
+                 "\"max_bucket_size\": %zu, \"p50_bucket_size\": %zu, \"p90_bucket_size\": %zu, \"p99_bucket_size\": %zu, "
+                 "\"mean_bucket_size\": %.3f, \"entry_bucket_size\": %.3f, \"bytes\": %zu, \"bytes_per_entry\": %.3f",
+                 bucket_count, occupied_buckets, entry_count, (unsigned int)image_count, max_bucket_size, p50_bucket_size,
+                 p90_bucket_size, p99_bucket_size, mean_bucket_size, entry_bucket_size, bytes, bytes_per_entry);
+        std::string json = std::string("{") + numbers + ", \"occupancy_histogram\": " + json_array(occupancy_histogram)
+                           + ", \"dimension_entries\": {";
+        for (int d = 0; d < 5; d++) {
+            json += std::string(d > 0 ? ", " : "") + "\"" + dimensions[d] + "\": " + json_array(dimension_entries[d]);
+        }
+        return json + "}}";
+    }
+
+    static std::string json_array(const std::vector<size_t>& values) {
+        std::string json = "[";
+        for (size_t i = 0; i < values.size(); i++) json += (i > 0 ? ", " : "") + std::to_string(values[i]);
+        return json + "]";
+    }
+};
+
+/* true if an image id is set in a bitmap of removed images (64 ids per word, nullptr for none) */
+inline bool is_image_removed(const std::vector<uint64_t>* removed, uint32_t image_id) {
+    if (removed == nullptr || image_id / 64 >= removed->size()) return false;
+    return ((*removed)[image_id / 64] >> (image_id % 64)) & 1;
+}
+
+/* votes of one query for every image id, in a dense array instead of a map so a vote is one increment.
+   the ids that got a vote are kept in a list, which is what top_k() ranks and reset() clears, so a query
+   only pays for the images it touched. use one per thread */
+class VoteAccumulator {
+    private:
+        std::vector<float> counts;
+        // last list (see add_once()) every image got a vote from, 0 for an image without votes
+        std::vector<uint32_t> lists;
+        std::vector<uint32_t> touched;
+        std::vector<float> scratch;
+        // most votes any image has
+        float max_votes = 0;
+
+        // heap order that keeps the worst match (fewest votes, then highest id) on top
+        static bool better(const ImageMatch& first, const ImageMatch& second) {
+            return first.votes > second.votes || (first.votes == second.votes && first.image_id < second.image_id);
+        }
+
+        void grow(uint32_t image_count) {
+            counts.resize(image_count, 0);
+            lists.resize(image_count, 0);
+        }
+
+    public:
+        // makes room for image ids below image_count (the array only grows)
+        void prepare(uint32_t image_count) {
+            if (counts.size() < image_count) grow(image_count);
+        }
+
+        void add(uint32_t image_id, float weight = 1) {
+            if (image_id >= counts.size()) grow(image_id + 1);
+            if (lists[image_id] == 0) {
+                touched.push_back(image_id);
+                lists[image_id] = (uint32_t)-1;
+            }
+            counts[image_id] += weight;
+            max_votes = std::max(max_votes, counts[image_id]);
+        }
+
+        // adds weight to an image only once per list: list is a number above 0 that is the same for every
+        // vote from one posting list and different for the next one
+        void add_once(uint32_t image_id, float weight, uint32_t list) {
+            if (image_id >= counts.size()) grow(image_id + 1);
+            if (lists[image_id] == list) return;
+            if (lists[image_id] == 0) touched.push_back(image_id);
+            lists[image_id] = list;
+            counts[image_id] += weight;
+            max_votes = std::max(max_votes, counts[image_id]);
+        }
+
+        float votes(uint32_t image_id) const { return image_id < counts.size() ? counts[image_id] : 0; }
+
+        // number of images with votes
+        size_t voted_images() const { return touched.size(); }
+
+        // the k images with the most votes, most votes first (ties go to the lower id).
+        // kept in a heap of k matches while the touched ids are scanned, instead of sorting all of them
+        void top_k(int k, std::vector<ImageMatch>& matches) const {
+            matches.clear();
+            if (k <= 0) return;
+            for (uint32_t image_id : touched) {
+                ImageMatch match = {image_id, counts[image_id]};
+                if ((int)matches.size() < k) {
+                    matches.push_back(match);
+                    std::push_heap(matches.begin(), matches.end(), better);
+                } else if (better(match, matches.front())) {
+                    std::pop_heap(matches.begin(), matches.end(), better);
+                    matches.back() = match;
+                    std::push_heap(matches.begin(), matches.end(), better);
+                }
+            }
+            std::sort_heap(matches.begin(), matches.end(), better);
+        }
+
+        // true if no image can enter or leave the top k by getting up to remaining more votes: the k-th best
+        // has more votes than the next one (or an image without votes) will have even with all of remaining
+        bool top_k_is_final(int k, float remaining) {
+            if (remaining <= 0) return true;
+            if (k <= 0) return true;
+            // the k-th best can't be ahead of an image without votes if not even the best one is
+            if ((int)touched.size() < k || max_votes <= remaining) return false;
+            scratch.clear();
+            for (uint32_t image_id : touched) scratch.push_back(counts[image_id]);
+            std::nth_element(scratch.begin(), scratch.begin() + (k - 1), scratch.end(), std::greater<float>());
+            float kth = scratch[k - 1];
+            float next = 0;
+            if ((int)scratch.size() > k) next = *std::max_element(scratch.begin() + k, scratch.end());
+            return kth > next + remaining;
+        }
+
+        void reset() {
+            for (uint32_t image_id : touched) {
+                counts[image_id] = 0;
+                lists[image_id] = 0;
+            }
+            touched.clear();
+            max_votes = 0;
+        }
+};
+
+/* bucket geometry of a table, fixed at compile time: 2^ColorBits buckets per Lab channel and a
+   2^XBits x 2^YBits grid over the image (whatever its resolution, superpixel centers are normalized by the
+   image size). every count is a power of two, so a bucket is a shift of the channel / center and a key is
+   the buckets packed next to each other (l | a | b | x | y, l in the highest bits) */
+template<int ColorBits, int XBits, int YBits>
+struct SLICBucketConfig {
+    static_assert(ColorBits >= 1 && ColorBits <= 8, "color buckets have to split 8-bit channels");
+    static_assert(XBits >= 0 && YBits >= 0 && 3 * ColorBits + XBits + YBits <= 30, "keys have to fit an int");
+
+    static constexpr int color_bits = ColorBits;
+    static constexpr int x_bits = XBits;
+    static constexpr int y_bits = YBits;
+    static constexpr int key_bits = 3 * ColorBits + XBits + YBits;
+    static constexpr int bucket_count = 1 << key_bits;
+};
+
+// 16 x 16 x 16 Lab buckets and an 8 x 8 grid: 262,144 buckets
+typedef SLICBucketConfig<4, 3, 3> DefaultBucketConfig;
+
 /* Class containing an implementation of a hash map meant to hold copies of structs containing superpixel information 
-   Also contains method for hashing (all) superpixels in a an image and an internal method for calculating hash keys */
-class SLICHashTable {
+   Also contains method for hashing (all) superpixels in a an image and an internal method for calculating hash keys.
+   Config is a SLICBucketConfig, tables with different configs can be used side by side */
+template<class Config = DefaultBucketConfig>
+class SLICHashTableT {
     private:
-        const int n = 5;
+        static constexpr int n = 5;
         // this implementation assumes 8-bit unsigned integer images
-        const int lab_buckets = 16;
-        const int lab_bucket_size = 256 / lab_buckets;
-        const int max_img_w = 3840;
-        const int max_img_h = 2160;
-        const int x_buckets = 10;
-        const int y_buckets = 10;
-        const int x_bucket_size = max_img_w / x_buckets;
-        const int y_bucket_size = max_img_h / y_buckets;
-        int dims[5] = {lab_buckets, lab_buckets, lab_buckets, x_buckets, y_buckets};
-
-        
+        static constexpr int color_shift = 8 - Config::color_bits;
+        static constexpr int x_buckets = 1 << Config::x_bits;
+        static constexpr int y_buckets = 1 << Config::y_bits;
+        // every key calculate_hash_key can return is below this
+        static constexpr int bucket_count = Config::bucket_count;
 
-    public:
-        std::unordered_map<int, std::vector<HashKey>> hashTable;
+        // bits of the key taken by a dimension (l, a, b, x, y)
+        static constexpr int dimension_bits(int d) {
+            return d < 3 ? Config::color_bits : (d == 3 ? Config::x_bits : Config::y_bits);
+        }
+
+        // frozen layout (CSR): the entries of bucket k are frozen_entries[bucket_offsets[k]] up to
+        // frozen_entries[bucket_offsets[k + 1]], all buckets back to back in one array
+        std::vector<unsigned int> bucket_offsets;
+        std::vector<SuperpixelRecord> frozen_entries;
+
+        // what lookups read: the data of the two vectors above, or the same sections of a saved table
+        // served straight from the mapped file (see load())
+        const unsigned int* offsets_view = nullptr;
+        const float* weights_view = nullptr;
+        const SuperpixelRecord* entries_view = nullptr;
+        size_t entry_count = 0;
+        std::shared_ptr<MappedIndexFile> mapped_file;
+
+        // IDF weight of every bucket, computed by freeze() (see bucket_weight())
+        std::vector<float> bucket_weights;
+
+        // one bit per bucket, set if lookup() finds entries in it (hashTable before the first freeze(), the
+        // frozen entries after it). it is a few dozen KB and stays in memory, so a probe of an empty bucket
+        // (most of them with fine buckets) is answered without hashing into hashTable or reading the offsets
+        // of a mapped table from disk
+        std::vector<uint64_t> bucket_presence;
+
+        void set_occupied(int key) {
+            bucket_presence[key >> 6] |= (uint64_t)1 << (key & 63);
+        }
 
-        int calculate_hash_key(const HashKey& key) {
-            if (key.pixel_count == 0) return -1;
+        // bucket_presence of frozen offsets. false if the offsets don't describe entry_count entries (they
+        // have to start at 0, never go down and end at entry_count), which only a corrupt file has
+        static bool compute_bucket_presence(const unsigned int* offsets, size_t entry_count, std::vector<uint64_t>& presence) {
+            presence.assign((bucket_count + 63) / 64, 0);
+            if (offsets[0] != 0 || offsets[bucket_count] != entry_count) return false;
+            for (int key = 0; key < bucket_count; key++) {
+                if (offsets[key + 1] < offsets[key]) return false;
+                if (offsets[key + 1] != offsets[key]) presence[key >> 6] |= (uint64_t)1 << (key & 63);
+            }
+            return true;
+        }
+
+        // path of every image id (empty if it wasn't given)
+        std::vector<std::string> image_paths;
+
+        // optional side table with the full stats of every entry, in the same order as the entries
+        // (frozen_stats[i] belongs to frozen_entries[i], fullStats[key][i] to hashTable[key][i])
+        bool keep_full_stats;
+        std::vector<HashKey> frozen_stats;
 
+        // one more than the highest image id hashed so far
+        uint32_t image_count = 0;
+
+        // position of a superpixel in every dimension of the key, in buckets (not clamped yet)
+        void bucket_positions(const HashKey& key, float positions[5]) const {
             // calaculate average color values
             float l_avg = (float)key.l_tot / key.pixel_count;
             float a_avg = (float)key.a_tot / key.pixel_count;
             float b_avg = (float)key.b_tot / key.pixel_count;
-            float x_center = (key.x_range.first + key.x_range.second) / 2.0f;
-            float y_center = (key.y_range.first + key.y_range.second) / 2.0f;
-
-            // calculate color buckets
-            int l_bucket = (int)(l_avg / lab_bucket_size);
-            int a_bucket = (int)(a_avg / lab_bucket_size);
-            int b_bucket = (int)(b_avg / lab_bucket_size);
-            int x_bucket = (int)(x_center / x_bucket_size);
-            int y_bucket = (int)(y_center / y_bucket_size);
-
-            // calculate spatial buckets
-            l_bucket = std::max(0, std::min(l_bucket, dims[0] - 1));
-            a_bucket = std::max(0, std::min(a_bucket, dims[1] - 1));
-            b_bucket = std::max(0, std::min(b_bucket, dims[2] - 1));
-            x_bucket = std::max(0, std::min(x_bucket, dims[3] - 1));
-            y_bucket = std::max(0, std::min(y_bucket, dims[4] - 1));
-
-            // calculate hash key
-            int hash_key = l_bucket;
-            hash_key = hash_key * dims[1] + a_bucket;
-            hash_key = hash_key * dims[2] + b_bucket;
-            hash_key = hash_key * dims[3] + x_bucket;
-            hash_key = hash_key * dims[4] + y_bucket;
+            // center of the bounding box (pixel col c covers [c, c + 1)) relative to the image size
+            float x_center = (key.x_range.first + key.x_range.second + 1) / 2.0f / key.image_width;
+            float y_center = (key.y_range.first + key.y_range.second + 1) / 2.0f / key.image_height;
+
+            positions[0] = l_avg / (1 << color_shift);
+            positions[1] = a_avg / (1 << color_shift);
+            positions[2] = b_avg / (1 << color_shift);
+            positions[3] = x_center * x_buckets;
+            positions[4] = y_center * y_buckets;
+        }
+
+        // bucket of a superpixel in every dimension of the key, in integers only: the average color
+        // shifted down to the color bits, and the center as a fraction of the image size with as many
+        // bits as the grid has (2 * center << bits / (2 * size), the center being a half pixel)
+        static void bucket_coordinates(const HashKey& key, int buckets[5]) {
+            long l_avg = std::max(0L, std::min(255L, (long)(key.l_tot / (long)key.pixel_count)));
+            long a_avg = std::max(0L, std::min(255L, (long)(key.a_tot / (long)key.pixel_count)));
+            long b_avg = std::max(0L, std::min(255L, (long)(key.b_tot / (long)key.pixel_count)));
+            long long x_twice = std::max(0LL, (long long)key.x_range.first + key.x_range.second + 1);
+            long long y_twice = std::max(0LL, (long long)key.y_range.first + key.y_range.second + 1);
 
+            buckets[0] = (int)(l_avg >> color_shift);
+            buckets[1] = (int)(a_avg >> color_shift);
+            buckets[2] = (int)(b_avg >> color_shift);
+            buckets[3] = (int)std::min<long long>(x_buckets - 1, (x_twice << Config::x_bits) / (2LL * key.image_width));
+            buckets[4] = (int)std::min<long long>(y_buckets - 1, (y_twice << Config::y_bits) / (2LL * key.image_height));
+        }
+
+        // key of a bucket in every dimension: the buckets packed next to each other
+        static int combine_buckets(const int buckets[5]) {
+            int hash_key = buckets[0];
+            for (int d = 1; d < n; d++) {
+                hash_key = (hash_key << dimension_bits(d)) | buckets[d];
+            }
             return hash_key;
         }
 
-        // called for hashing segmented images, and storing them in the instance of this class
-        // expects a cielab image for input_image
-        void Hash(const cv::Mat& input_image, const cv::Mat& labels, int superpixel_count, unsigned long* pixel_count) {
-            HashKey *superpixels = (HashKey*) calloc(superpixel_count, sizeof(HashKey));
-            for (int row = 0; row < labels.rows; row++) {
-                for (int col = 0; col < labels.cols; col++) {
-                    cv::Vec3b lab_pixel = input_image.at<cv::Vec3b>(row, col);
-                    int sp = labels.at<int>(row, col);
-                    HashKey &curr = superpixels[sp];
-
-                    // add to total color values to aid in calculating average color later
-                    curr.l_tot += lab_pixel[0];
-                    curr.a_tot += lab_pixel[1];
-                    curr.b_tot += lab_pixel[2];
-
-                    // set initial params indicating spatial extent
-                    if (curr.pixel_count == 0) {
-                        curr.x_range.first = col;
-                        curr.x_range.second = col;
-                        curr.y_range.first = row;
-                        curr.y_range.second = row;
-                        curr.original_image = &input_image;
-
-                    // update spatial extent of superpixel if broader sections are discovered
-                    } else {
-                        if (curr.x_range.first > col) curr.x_range.first = col;
-                        if (curr.x_range.second < col) curr.x_range.second = col;
-                        if (curr.y_range.first > row) curr.y_range.first = row;
-                        if (curr.y_range.second < row) curr.y_range.second = row;
+        // inverse of combine_buckets()
+        static void split_key(int hash_key, int buckets[5]) {
+            for (int d = n - 1; d >= 0; d--) {
+                buckets[d] = hash_key & ((1 << dimension_bits(d)) - 1);
+                hash_key >>= dimension_bits(d);
+            }
+        }
+
+        // memory of an unordered_map of vectors: the vectors, their nodes and the bucket array
+        template<class Entry>
+        static size_t staged_bytes(const std::unordered_map<int, std::vector<Entry>>& staged) {
+            size_t bytes = staged.bucket_count() * sizeof(void*);
+            for (const auto& bucket : staged) {
+                bytes += sizeof(bucket) + sizeof(void*) + bucket.second.capacity() * sizeof(Entry);
+            }
+            return bytes;
+        }
+
+        template<class Entry>
+        void copy_frozen_and_staged(const Entry* frozen,
+                                    const std::unordered_map<int, std::vector<Entry>>& staged,
+                                    const std::vector<unsigned int>& offsets,
+                                    std::vector<Entry>& entries) const {
+            // already frozen entries first, then the new ones of each bucket
+            entries.resize(offsets[bucket_count]);
+            std::vector<unsigned int> out(offsets.begin(), offsets.end() - 1);
+            if (is_frozen()) {
+                for (int key = 0; key < bucket_count; key++) {
+                    out[key] = std::copy(frozen + offsets_view[key],
+                                         frozen + offsets_view[key + 1],
+                                         entries.begin() + out[key]) - entries.begin();
+                }
+            }
+            for (const auto& bucket : staged) {
+                std::copy(bucket.second.begin(), bucket.second.end(), entries.begin() + out[bucket.first]);
+            }
+        }
+
+        // bucket_weights of bucket_offsets / frozen_entries: the number of distinct images in every bucket
+        // (an image is only counted the first time it shows up in a bucket) turned into IDF weights
+        void compute_bucket_weights() {
+            std::vector<int> last_bucket;
+            std::vector<unsigned int> image_buckets(bucket_count, 0);
+            unsigned int images = 0;
+            for (int key = 0; key < bucket_count; key++) {
+                for (unsigned int i = bucket_offsets[key]; i < bucket_offsets[key + 1]; i++) {
+                    uint32_t image_id = frozen_entries[i].image_id;
+                    if (image_id >= last_bucket.size()) last_bucket.resize(image_id + 1, -1);
+                    if (last_bucket[image_id] == key) continue;
+                    if (last_bucket[image_id] == -1) images++;
+                    last_bucket[image_id] = key;
+                    image_buckets[key]++;
+                }
+            }
+            bucket_weights.assign(bucket_count, 0);
+            for (int key = 0; key < bucket_count; key++) {
+                if (image_buckets[key] == 0) continue;
+                bucket_weights[key] = std::log(1.0f + (float)images / image_buckets[key]);
+            }
+        }
+
+    public:
+        // entries hashed since the last freeze() (every entry if the table was never frozen)
+        std::unordered_map<int, std::vector<SuperpixelRecord>> hashTable;
+        // full stats of the entries in hashTable (only filled if keep_full_stats is set)
+        std::unordered_map<int, std::vector<HashKey>> fullStats;
+
+        // keep_full_stats: also keep the full HashKey of every entry (see full_stats()), which makes
+        // every entry 4-5 times bigger
+        explicit SLICHashTableT(bool keep_full_stats = false)
+            : bucket_presence((bucket_count + 63) / 64, 0), keep_full_stats(keep_full_stats) {}
+
+        // a superpixel only gets a key if it has pixels and the size of its image is known
+        static bool is_hashable(const HashKey& key) {
+            return key.pixel_count != 0 && key.image_width > 0 && key.image_height > 0;
+        }
+
+        // lookups read through pointers into the table's own arrays, so a copy would read the original's
+        SLICHashTableT(const SLICHashTableT&) = delete;
+        SLICHashTableT& operator=(const SLICHashTableT&) = delete;
+
+        bool is_frozen() const { return offsets_view != nullptr; }
+
+        // true if the frozen entries are served from a mapped file
+        bool is_mapped() const { return mapped_file != nullptr; }
+
+        // number of frozen entries
+        size_t size() const { return entry_count; }
+
+        // remembers where an image came from, so it can be found again from its id (also kept by save())
+        void set_image_path(uint32_t image_id, const std::string& path) {
+            if (image_id >= image_paths.size()) image_paths.resize(image_id + 1);
+            image_paths[image_id] = path;
+        }
+
+        const std::string& image_path(uint32_t image_id) const {
+            static const std::string unknown;
+            return image_id < image_paths.size() ? image_paths[image_id] : unknown;
+        }
+
+        // one more than the highest image id hashed so far (what a VoteAccumulator has to hold)
+        uint32_t image_id_count() const { return image_count; }
+
+        // full stats of a frozen entry returned by lookup() (nullptr if they weren't kept)
+        const HashKey* full_stats(const SuperpixelRecord* entry) const {
+            if (!keep_full_stats) return nullptr;
+            return &frozen_stats[entry - entries_view];
+        }
+
+        // rounds the stats of a superpixel to what the table stores
+        static SuperpixelRecord make_record(const HashKey& key) {
+            SuperpixelRecord record = {};
+            record.image_id = key.image_id;
+            if (key.pixel_count == 0) return record;
+            record.l = (uint8_t)std::min(255L, (long)(key.l_tot + key.pixel_count / 2) / (long)key.pixel_count);
+            record.a = (uint8_t)std::min(255L, (long)(key.a_tot + key.pixel_count / 2) / (long)key.pixel_count);
+            record.b = (uint8_t)std::min(255L, (long)(key.b_tot + key.pixel_count / 2) / (long)key.pixel_count);
+            if (key.image_width > 0 && key.image_height > 0) {
+                long long x_center = (key.x_range.first + key.x_range.second + 1) * 32768LL / key.image_width;
+                long long y_center = (key.y_range.first + key.y_range.second + 1) * 32768LL / key.image_height;
+                record.x_center = (uint16_t)std::min(65535LL, x_center);
+                record.y_center = (uint16_t)std::min(65535LL, y_center);
+            }
+            record.pixel_count = (uint32_t)key.pixel_count;
+            return record;
+        }
+
+        // moves every entry into the frozen layout: one contiguous array ordered by bucket plus an offset
+        // per bucket, so a lookup is two array reads and there's no heap vector / map node per bucket.
+        // entries hashed afterwards wait in hashTable until freeze() is called again
+        void freeze() {
+            std::vector<HashStaging> stagings;
+            freeze(stagings);
+        }
+
+        // freeze() that also merges the staging buffers of a concurrent build and empties them.
+        // each buffer is counted and scattered into its own slots of the frozen array in parallel
+        void freeze(std::vector<HashStaging>& stagings) {
+            // count entries per bucket (kept from the last freeze for the entries frozen back then)
+            std::vector<unsigned int> counts(bucket_count, 0);
+            if (is_frozen()) {
+                for (int key = 0; key < bucket_count; key++) {
+                    counts[key] = offsets_view[key + 1] - offsets_view[key];
+                }
+            }
+            for (const auto& bucket : hashTable) {
+                counts[bucket.first] += (unsigned int)bucket.second.size();
+            }
+            std::vector<std::vector<unsigned int>> staged_counts(stagings.size());
+            cv::parallel_for_(cv::Range(0, (int)stagings.size()), [&](const cv::Range& range) {
+                for (int s = range.start; s < range.end; s++) {
+                    staged_counts[s].assign(bucket_count, 0);
+                    for (const auto& staged : stagings[s].records) staged_counts[s][staged.first]++;
+                }
+            });
+
+            // bucket offsets are the running total of the counts. in every bucket the staged entries come
+            // after the frozen / hashTable ones, one buffer after the other, so staged_counts is turned
+            // into where each buffer starts writing in each bucket
+            std::vector<unsigned int> offsets(bucket_count + 1, 0);
+            for (int key = 0; key < bucket_count; key++) {
+                unsigned int next = offsets[key] + counts[key];
+                for (std::vector<unsigned int>& staged : staged_counts) {
+                    unsigned int count = staged[key];
+                    staged[key] = next;
+                    next += count;
+                }
+                offsets[key + 1] = next;
+            }
+
+            // lay out the entries (and their full stats the same way)
+            std::vector<SuperpixelRecord> entries;
+            std::vector<HashKey> stats;
+            copy_frozen_and_staged(entries_view, hashTable, offsets, entries);
+            if (keep_full_stats) copy_frozen_and_staged(frozen_stats.data(), fullStats, offsets, stats);
+            cv::parallel_for_(cv::Range(0, (int)stagings.size()), [&](const cv::Range& range) {
+                for (int s = range.start; s < range.end; s++) {
+                    std::vector<unsigned int>& out = staged_counts[s];
+                    const HashStaging& staging = stagings[s];
+                    for (size_t i = 0; i < staging.records.size(); i++) {
+                        unsigned int slot = out[staging.records[i].first]++;
+                        entries[slot] = staging.records[i].second;
+                        if (keep_full_stats) stats[slot] = staging.stats[i];
                     }
-                    curr.pixel_count += 1;
-                    // hash superpixel if all subpixels have been found
-                    if (curr.pixel_count == pixel_count[sp]) {
-                        int key = calculate_hash_key(curr);
-                        if (key != -1) {
-                            hashTable[key].push_back(curr);
+                }
+            });
+            for (HashStaging& staging : stagings) {
+                image_count = std::max(image_count, staging.image_count);
+                staging = HashStaging();
+            }
+
+            bucket_offsets.swap(offsets);
+            frozen_entries.swap(entries);
+            frozen_stats.swap(stats);
+            compute_bucket_weights();
+            offsets_view = bucket_offsets.data();
+            weights_view = bucket_weights.data();
+            entries_view = frozen_entries.data();
+            entry_count = frozen_entries.size();
+            mapped_file.reset();
+            compute_bucket_presence(offsets_view, entry_count, bucket_presence);
+            std::unordered_map<int, std::vector<SuperpixelRecord>>().swap(hashTable);
+            std::unordered_map<int, std::vector<HashKey>>().swap(fullStats);
+        }
+
+        // IDF weight of a bucket: log(1 + images / images with entries in the bucket), over the images with
+        // entries in the table (0 for an empty bucket). the weights are computed by freeze(), before that
+        // every bucket with entries weighs 1, so idf_weighting still counts the distinct buckets an image
+        // shares with the query
+        float bucket_weight(int key) const {
+            if (key < 0 || key >= bucket_count) return 0;
+            if (!is_frozen()) return bucket_occupied(key) ? 1.0f : 0.0f;
+            return weights_view[key];
+        }
+
+        // replaces the IDF weights of a frozen table by the ones of another frozen table, e.g. the whole index
+        // a shard was split from, so the votes of tables holding parts of the same images add up the same way.
+        // freeze() computes the table's own weights again. false if either table isn't frozen
+        bool copy_bucket_weights(const SLICHashTableT& other) {
+            if (!is_frozen() || !other.is_frozen()) return false;
+            bucket_weights.assign(other.weights_view, other.weights_view + bucket_count);
+            weights_view = bucket_weights.data();
+            return true;
+        }
+
+        // copies the frozen entries into a staging buffer, so tables can be merged with freeze(stagings).
+        // entries of images set in removed (see is_image_removed()) are left out
+        void stage_entries(HashStaging& staging, const std::vector<uint64_t>* removed = nullptr) const {
+            if (!is_frozen()) return;
+            staging.records.reserve(staging.records.size() + entry_count);
+            for (int key = 0; key < bucket_count; key++) {
+                for (unsigned int i = offsets_view[key]; i < offsets_view[key + 1]; i++) {
+                    if (is_image_removed(removed, entries_view[i].image_id)) continue;
+                    staging.records.push_back(std::make_pair(key, entries_view[i]));
+                }
+            }
+            staging.image_count = std::max(staging.image_count, image_count);
+        }
+
+        // ids of the images with frozen entries, in increasing order
+        void image_ids(std::vector<uint32_t>& ids) const {
+            ids.clear();
+            std::vector<bool> seen(image_count, false);
+            for (size_t i = 0; i < entry_count; i++) seen[entries_view[i].image_id] = true;
+            for (uint32_t image_id = 0; image_id < image_count; image_id++) {
+                if (seen[image_id]) ids.push_back(image_id);
+            }
+        }
+
+        // bucket occupancy and skew of the table (see HashTableStats), one pass over the buckets
+        HashTableStats occupancy_stats() const {
+            HashTableStats stats;
+            stats.bucket_count = bucket_count;
+            stats.image_count = image_count;
+            for (int d = 0; d < n; d++) stats.dimension_entries[d].assign(1 << dimension_bits(d), 0);
+
+            std::vector<size_t> sizes;
+            double squared_sizes = 0;
+            int buckets[5];
+            for (int key = 0; key < bucket_count; key++) {
+                size_t size = lookup(key).size();
+                int bin = 0;
+                while (bin < 64 && (size >> bin) != 0) bin++;
+                if ((int)stats.occupancy_histogram.size() <= bin) stats.occupancy_histogram.resize(bin + 1, 0);
+                stats.occupancy_histogram[bin]++;
+                if (size == 0) continue;
+
+                sizes.push_back(size);
+                stats.entry_count += size;
+                squared_sizes += (double)size * size;
+                split_key(key, buckets);
+                for (int d = 0; d < n; d++) stats.dimension_entries[d][buckets[d]] += size;
+            }
+
+            stats.occupied_buckets = sizes.size();
+            if (!sizes.empty()) {
+                std::sort(sizes.begin(), sizes.end());
+                stats.max_bucket_size = sizes.back();
+                stats.p50_bucket_size = sizes[(sizes.size() - 1) * 50 / 100];
+                stats.p90_bucket_size = sizes[(sizes.size() - 1) * 90 / 100];
+                stats.p99_bucket_size = sizes[(sizes.size() - 1) * 99 / 100];
+                stats.mean_bucket_size = (double)stats.entry_count / sizes.size();
+                stats.entry_bucket_size = squared_sizes / stats.entry_count;
+            }
+
+            if (is_frozen()) {
+                stats.bytes += (bucket_count + 1) * sizeof(unsigned int) + entry_count * sizeof(SuperpixelRecord);
+                if (weights_view != nullptr) stats.bytes += bucket_count * sizeof(float);
+                stats.bytes += frozen_stats.size() * sizeof(HashKey);
+            }
+            stats.bytes += bucket_presence.size() * sizeof(uint64_t);
+            stats.bytes += staged_bytes(hashTable) + staged_bytes(fullStats);
+            size_t entries = entry_count;
+            for (const auto& bucket : hashTable) entries += bucket.second.size();
+            if (entries > 0) stats.bytes_per_entry = (double)stats.bytes / entries;
+            return stats;
+        }
+
+        // writes the frozen entries and the image paths to a file that load() can map.
+        // the file is written next to path, synced and renamed over it, so neither a reader nor a crash
+        // (of the process or the machine) ever leaves half of it behind
+        bool save(const std::string& path) const {
+            if (!is_frozen()) return false;
+            HashIndexFileHeader header = {};
+            memcpy(header.magic, SLIC_HASH_INDEX_MAGIC, sizeof(header.magic));
+            header.version = SLIC_HASH_INDEX_VERSION;
+            header.bucket_count = (uint32_t)bucket_count;
+            header.entry_count = entry_count;
+            header.image_count = image_count;
+            header.x_buckets = (uint32_t)x_buckets;
+            header.y_buckets = (uint32_t)y_buckets;
+            header.offsets_start = (sizeof(HashIndexFileHeader) + 15) / 16 * 16;
+            header.weights_start = (header.offsets_start + (bucket_count + 1) * sizeof(unsigned int) + 15) / 16 * 16;
+            header.entries_start = header.weights_start + bucket_count * sizeof(float);
+            header.paths_start = header.entries_start + entry_count * sizeof(SuperpixelRecord);
+
+            std::vector<unsigned char> paths;
+            for (uint32_t image_id = 0; image_id < image_count; image_id++) {
+                const std::string& image = image_path(image_id);
+                uint32_t length = (uint32_t)image.size();
+                paths.insert(paths.end(), (const unsigned char*)&length, (const unsigned char*)&length + sizeof(length));
+                paths.insert(paths.end(), image.begin(), image.end());
+            }
+            header.paths_size = paths.size();
+
+            std::string temporary = path + ".tmp";
+            FILE* stream = fopen(temporary.c_str(), "wb");
+            if (stream == nullptr) return false;
+            const char padding[16] = {};
+            bool written =
+                fwrite(&header, sizeof(header), 1, stream) == 1 &&
+                fwrite(padding, 1, header.offsets_start - sizeof(header), stream) == header.offsets_start - sizeof(header) &&
+                fwrite(offsets_view, sizeof(unsigned int), bucket_count + 1, stream) == (size_t)bucket_count + 1 &&
+                fwrite(padding, 1, header.weights_start - header.offsets_start - (bucket_count + 1) * sizeof(unsigned int), stream)
+                    == header.weights_start - header.offsets_start - (bucket_count + 1) * sizeof(unsigned int) &&
+                fwrite(weights_view, sizeof(float), bucket_count, stream) == (size_t)bucket_count &&
+                fwrite(entries_view, sizeof(SuperpixelRecord), entry_count, stream) == entry_count &&
+                fwrite(paths.data(), 1, paths.size(), stream) == paths.size();
+            written = close_synced(stream) && written;
+            if (!written || !rename_synced(temporary, path)) {
+                remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // replaces the table by a saved one. the file is mapped and the offsets and records are used in
+        // place instead of being copied: they are read once (sequentially) to check them, after that the
+        // system can drop their pages and read them back as the buckets they hold are looked up.
+        // full stats aren't saved, a loaded table doesn't keep them.
+        // returns false (and leaves the table as it was) if the file can't be read, doesn't match or is corrupt
+        bool load(const std::string& path) {
+            std::shared_ptr<MappedIndexFile> file = MappedIndexFile::open(path);
+            if (file == nullptr || file->size() < sizeof(HashIndexFileHeader)) return false;
+
+            HashIndexFileHeader header;
+            memcpy(&header, file->data(), sizeof(header));
+            if (memcmp(header.magic, SLIC_HASH_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version != SLIC_HASH_INDEX_VERSION || header.bucket_count != (uint32_t)bucket_count ||
+                header.x_buckets != (uint32_t)x_buckets || header.y_buckets != (uint32_t)y_buckets ||
+                header.offsets_start % 16 != 0 || header.weights_start % 16 != 0 || header.entries_start % 16 != 0) {
+                return false;
+            }
+            // every section has to fit in the file. each start is checked against the size before anything
+            // is added to it or subtracted from the size, so a corrupt header can't wrap around
+            const uint64_t size = file->size();
+            if (header.offsets_start < sizeof(HashIndexFileHeader) || header.offsets_start > size ||
+                (size - header.offsets_start) / sizeof(unsigned int) < (uint64_t)bucket_count + 1 ||
+                header.weights_start < header.offsets_start + (bucket_count + 1) * sizeof(unsigned int) ||
+                header.weights_start > size || (size - header.weights_start) / sizeof(float) < (uint64_t)bucket_count ||
+                header.entries_start != header.weights_start + bucket_count * sizeof(float) ||
+                header.entry_count > (size - header.entries_start) / sizeof(SuperpixelRecord) ||
+                header.paths_start != header.entries_start + header.entry_count * sizeof(SuperpixelRecord) ||
+                header.paths_size > size - header.paths_start ||
+                // every image has at least the length of its path
+                header.image_count > header.paths_size / sizeof(uint32_t)) {
+                return false;
+            }
+            // lookups trust the offsets and votes trust the image ids, so a corrupt file is caught here
+            // instead of reading (or writing) out of bounds later
+            const unsigned int* offsets = (const unsigned int*)(file->data() + header.offsets_start);
+            const SuperpixelRecord* entries = (const SuperpixelRecord*)(file->data() + header.entries_start);
+            std::vector<uint64_t> presence;
+            if (!compute_bucket_presence(offsets, (size_t)header.entry_count, presence)) return false;
+            for (size_t i = 0; i < (size_t)header.entry_count; i++) {
+                if (entries[i].image_id >= header.image_count) return false;
+            }
+
+            std::vector<std::string> paths(header.image_count);
+            const unsigned char* next = file->data() + header.paths_start;
+            const unsigned char* paths_end = next + header.paths_size;
+            for (uint32_t image_id = 0; image_id < header.image_count; image_id++) {
+                uint32_t length;
+                if (paths_end - next < (long)sizeof(length)) return false;
+                memcpy(&length, next, sizeof(length));
+                next += sizeof(length);
+                if (paths_end - next < (long)length) return false;
+                paths[image_id].assign((const char*)next, length);
+                next += length;
+            }
+
+            std::vector<unsigned int>().swap(bucket_offsets);
+            std::vector<float>().swap(bucket_weights);
+            std::vector<SuperpixelRecord>().swap(frozen_entries);
+            std::vector<HashKey>().swap(frozen_stats);
+            std::unordered_map<int, std::vector<SuperpixelRecord>>().swap(hashTable);
+            std::unordered_map<int, std::vector<HashKey>>().swap(fullStats);
+            keep_full_stats = false;
+            image_paths.swap(paths);
+            image_count = header.image_count;
+            offsets_view = offsets;
+            weights_view = (const float*)(file->data() + header.weights_start);
+            entries_view = entries;
+            entry_count = (size_t)header.entry_count;
+            mapped_file = file;
+            bucket_presence.swap(presence);
+            return true;
+        }
+
+        // false if lookup() of the key finds no entries, without looking into the table
+        bool bucket_occupied(int key) const {
+            if (key < 0 || key >= bucket_count) return false;
+            return (bucket_presence[key >> 6] >> (key & 63)) & 1;
+        }
+
+        // entries that share a hash key (the frozen ones if the table is frozen)
+        HashBucket lookup(int key) const {
+            if (!bucket_occupied(key)) return HashBucket{nullptr, nullptr};
+            if (is_frozen()) {
+                return HashBucket{entries_view + offsets_view[key], entries_view + offsets_view[key + 1]};
+            }
+            auto bucket = hashTable.find(key);
+            if (bucket == hashTable.end()) return HashBucket{nullptr, nullptr};
+            return HashBucket{bucket->second.data(), bucket->second.data() + bucket->second.size()};
+        }
+
+        int calculate_hash_key(const HashKey& key) const {
+            if (!is_hashable(key)) return -1;
+
+            // calculate color and spatial buckets
+            int buckets[5];
+            bucket_coordinates(key, buckets);
+            return combine_buckets(buckets);
+        }
+
+        // calculate_hash_key() of every superpixel of an image at once (-1 for the ones without a key),
+        // one tight loop of integer divisions, shifts and ors with no float math or calls in it
+        void calculate_hash_keys(const std::vector<HashKey>& superpixels, std::vector<int>& keys) const {
+            keys.resize(superpixels.size());
+            for (size_t i = 0; i < superpixels.size(); i++) {
+                keys[i] = calculate_hash_key(superpixels[i]);
+            }
+        }
+
+        // keys to visit for a query superpixel in multi-probe mode, at most probe_budget of them.
+        // its own bucket comes first, then the neighbouring buckets it is closest to: in each dimension the
+        // neighbour is the one on the side of the nearest bucket boundary, and buckets across several
+        // boundaries are ordered by the sum of the squared distances to them (in bucket widths), so two
+        // nearly identical superpixels on either side of a boundary still collide with a small budget
+        void probe_keys(const HashKey& key, int probe_budget, std::vector<int>& keys) const {
+            keys.clear();
+            if (!is_hashable(key) || probe_budget <= 0) return;
+
+            float positions[5];
+            bucket_positions(key, positions);
+
+            // home bucket, closest neighbouring bucket (-1 if none) and distance to it in every dimension
+            int home[5], neighbor[5];
+            float distance[5];
+            bucket_coordinates(key, home);
+            for (int d = 0; d < n; d++) {
+                float offset = std::max(0.0f, positions[d] - home[d]);
+                if (offset < 0.5f) {
+                    neighbor[d] = home[d] - 1;
+                    distance[d] = offset;
+                } else {
+                    neighbor[d] = home[d] + 1;
+                    distance[d] = 1.0f - offset;
+                }
+                if (neighbor[d] < 0 || neighbor[d] >= (1 << dimension_bits(d)) || distance[d] < 0) neighbor[d] = -1;
+            }
+
+            // every set of dimensions whose boundary is crossed, best score first (the empty set is home)
+            std::vector<std::pair<float, int>> probes;
+            for (int crossed = 0; crossed < (1 << n); crossed++) {
+                float score = 0;
+                bool possible = true;
+                for (int d = 0; d < n; d++) {
+                    if (!(crossed & (1 << d))) continue;
+                    possible = possible && neighbor[d] != -1;
+                    score += distance[d] * distance[d];
+                }
+                if (possible) probes.push_back(std::make_pair(score, crossed));
+            }
+            int probe_count = std::min(probe_budget, (int)probes.size());
+            std::partial_sort(probes.begin(), probes.begin() + probe_count, probes.end());
+
+            for (int probe = 0; probe < probe_count; probe++) {
+                int buckets[5];
+                for (int d = 0; d < n; d++) {
+                    buckets[d] = (probes[probe].second & (1 << d)) ? neighbor[d] : home[d];
+                }
+                keys.push_back(combine_buckets(buckets));
+            }
+        }
+
+        // per-superpixel stats of a segmented image, gathered in one pass over the labels and the image:
+        // row bands are swept in parallel into their own stats, which are merged at the end.
+        // expects a cielab image for input_image and labels in [0, superpixel_count)
+        static std::vector<HashKey> compute_superpixel_stats(const cv::Mat& input_image, const cv::Mat& labels,
+                                                             int superpixel_count, uint32_t image_id) {
+            const int bands = std::max(1, std::min(cv::getNumThreads(), labels.rows));
+            std::vector<std::vector<HashKey>> band_stats(bands, std::vector<HashKey>(superpixel_count, HashKey()));
+
+            cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& range) {
+                for (int band = range.start; band < range.end; band++) {
+                    std::vector<HashKey>& superpixels = band_stats[band];
+                    const int first_row = (int)((long long)labels.rows * band / bands);
+                    const int last_row = (int)((long long)labels.rows * (band + 1) / bands);
+                    for (int row = first_row; row < last_row; row++) {
+                        const cv::Vec3b* lab_row = input_image.ptr<cv::Vec3b>(row);
+                        const int* label_row = labels.ptr<int>(row);
+                        for (int col = 0; col < labels.cols; col++) {
+                            HashKey &curr = superpixels[label_row[col]];
+
+                            // add to total color values to aid in calculating average color later
+                            curr.l_tot += lab_row[col][0];
+                            curr.a_tot += lab_row[col][1];
+                            curr.b_tot += lab_row[col][2];
+
+                            // set initial params indicating spatial extent
+                            if (curr.pixel_count == 0) {
+                                curr.x_range.first = col;
+                                curr.x_range.second = col;
+                                curr.y_range.first = row;
+                                curr.y_range.second = row;
+
+                            // update spatial extent of superpixel if broader sections are discovered
+                            } else {
+                                if (curr.x_range.first > col) curr.x_range.first = col;
+                                if (curr.x_range.second < col) curr.x_range.second = col;
+                                // rows are swept in order, so only the bottom can grow
+                                curr.y_range.second = row;
+                            }
+                            curr.pixel_count += 1;
                         }
                     }
                 }
+            });
+
+            // merge the bands into the first one
+            std::vector<HashKey>& superpixels = band_stats[0];
+            for (int band = 1; band < bands; band++) {
+                for (int sp = 0; sp < superpixel_count; sp++) {
+                    const HashKey& part = band_stats[band][sp];
+                    HashKey& curr = superpixels[sp];
+                    if (part.pixel_count == 0) continue;
+                    if (curr.pixel_count == 0) {
+                        curr = part;
+                        continue;
+                    }
+                    curr.l_tot += part.l_tot;
+                    curr.a_tot += part.a_tot;
+                    curr.b_tot += part.b_tot;
+                    curr.x_range.first = std::min(curr.x_range.first, part.x_range.first);
+                    curr.x_range.second = std::max(curr.x_range.second, part.x_range.second);
+                    curr.y_range.first = std::min(curr.y_range.first, part.y_range.first);
+                    curr.y_range.second = std::max(curr.y_range.second, part.y_range.second);
+                    curr.pixel_count += part.pixel_count;
+                }
+            }
+            for (HashKey& curr : superpixels) {
+                curr.image_width = labels.cols;
+                curr.image_height = labels.rows;
+                curr.image_id = image_id;
+            }
+            return std::move(superpixels);
+        }
+
+        // called for hashing segmented images, and storing them in the instance of this class
+        // expects a cielab image for input_image, image_id is what lookups return for its superpixels
+        void Hash(const cv::Mat& input_image, const cv::Mat& labels, int superpixel_count, uint32_t image_id) {
+            Hash(compute_superpixel_stats(input_image, labels, superpixel_count, image_id));
+        }
+
+        // hashes superpixels whose stats are already known (e.g. from compute_superpixel_stats())
+        void Hash(const std::vector<HashKey>& superpixels) {
+            std::vector<int> keys;
+            calculate_hash_keys(superpixels, keys);
+            for (size_t i = 0; i < superpixels.size(); i++) {
+                const HashKey& curr = superpixels[i];
+                int key = keys[i];
+                if (key == -1) continue;
+                hashTable[key].push_back(make_record(curr));
+                if (keep_full_stats) fullStats[key].push_back(curr);
+                // entries hashed into a frozen table only show up after the next freeze()
+                if (!is_frozen()) set_occupied(key);
+                image_count = std::max(image_count, curr.image_id + 1);
+            }
+        }
+
+        // Hash() for concurrent builds: the entries go to a staging buffer instead of the table, so threads
+        // that each have their own buffer can hash at the same time. freeze(stagings) merges the buffers
+        void Hash(const std::vector<HashKey>& superpixels, HashStaging& staging) const {
+            std::vector<int> keys;
+            calculate_hash_keys(superpixels, keys);
+            for (size_t i = 0; i < superpixels.size(); i++) {
+                const HashKey& curr = superpixels[i];
+                int key = keys[i];
+                if (key == -1) continue;
+                staging.records.push_back(std::make_pair(key, make_record(curr)));
+                if (keep_full_stats) staging.stats.push_back(curr);
+                staging.image_count = std::max(staging.image_count, curr.image_id + 1);
             }
-            free(superpixels);
+        }
+
+        // ranks images by how many superpixels of a query collide with theirs: every query superpixel
+        // votes once for each entry in the buckets it probes (see probe_keys(), 1 probes only its own).
+        // returns the top k images, most votes first. votes is left reset for the next query
+        void query(const std::vector<HashKey>& query_superpixels, int k, int probe_budget,
+                   VoteAccumulator& votes, std::vector<ImageMatch>& matches) const {
+            QueryOptions options;
+            options.k = k;
+            options.probe_budget = probe_budget;
+            query(query_superpixels, options, votes, matches);
+        }
+
+        // query() with stop buckets and inverted-file scoring (see QueryOptions).
+        // if stats isn't null, it is overwritten with what the query did and how long it took
+        void query(const std::vector<HashKey>& query_superpixels, const QueryOptions& options,
+                   VoteAccumulator& votes, std::vector<ImageMatch>& matches, QueryStats* stats = nullptr) const {
+            std::chrono::steady_clock::time_point start;
+            if (stats != nullptr) {
+                *stats = QueryStats();
+                stats->superpixels = query_superpixels.size();
+                start = std::chrono::steady_clock::now();
+            }
+            votes.prepare(image_count);
+            if (!options.idf_weighting) {
+                add_votes(query_superpixels, options, votes, nullptr, stats);
+            } else {
+                add_weighted_votes(query_superpixels, options, votes, stats);
+            }
+            if (stats != nullptr) stats->voted_images = votes.voted_images();
+            votes.top_k(options.k, matches);
+            votes.reset();
+            if (stats != nullptr) {
+                stats->milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+        }
+
+        // the votes of query() with idf_weighting
+        void add_weighted_votes(const std::vector<HashKey>& query_superpixels, const QueryOptions& options,
+                                VoteAccumulator& votes, QueryStats* stats) const {
+
+            // buckets probed by the query superpixels. a bucket probed m times is one posting list of m times
+            // its weight (what m lists would add to an image in it), so a common bucket is scanned once
+            std::vector<int> probed;
+            std::vector<int> keys;
+            for (const HashKey& superpixel : query_superpixels) {
+                probe_keys(superpixel, options.probe_budget, keys);
+                probed.insert(probed.end(), keys.begin(), keys.end());
+            }
+            std::sort(probed.begin(), probed.end());
+
+            // posting lists (weight, bucket), highest weight first
+            std::vector<std::pair<float, int>> lists;
+            for (size_t first = 0, last = 0; first < probed.size(); first = last) {
+                while (last < probed.size() && probed[last] == probed[first]) last++;
+                float weight = bucket_weight(probed[first]) * (last - first);
+                if (weight > 0 && visited_size(probed[first], options) > 0) lists.push_back(std::make_pair(weight, probed[first]));
+                if (stats != nullptr) count_bucket(probed[first], options, *stats);
+            }
+            std::sort(lists.begin(), lists.end(), [](const std::pair<float, int>& first, const std::pair<float, int>& second) {
+                return first.first > second.first || (first.first == second.first && first.second < second.second);
+            });
+
+            // weight the lists not visited yet can still add to any image
+            float remaining = 0;
+            for (const auto& list : lists) remaining += list.first;
+
+            // how often the top k is checked (it costs a pass over the touched images)
+            const size_t check_interval = 8;
+            for (size_t l = 0; l < lists.size(); l++) {
+                if (options.early_termination && l % check_interval == 0 && votes.top_k_is_final(options.k, remaining)) break;
+                HashBucket bucket = lookup(lists[l].second);
+                const SuperpixelRecord* last = bucket.begin() + visited_size(lists[l].second, options);
+                for (const SuperpixelRecord* match = bucket.begin(); match != last; match++) {
+                    votes.add_once(match->image_id, lists[l].first, (uint32_t)l + 1);
+                }
+                if (stats != nullptr) stats->candidates += last - bucket.begin();
+                remaining -= lists[l].first;
+            }
+        }
+
+        // adds a probed bucket to the bucket counts of a query
+        void count_bucket(int key, const QueryOptions& options, QueryStats& stats) const {
+            size_t size = lookup(key).size();
+            stats.probed_buckets++;
+            if (size == 0) stats.empty_buckets++;
+            if (options.stop_bucket_size != 0 && size > options.stop_bucket_size) stats.stop_buckets++;
+        }
+
+        // entries of a bucket a query visits: none for a skipped stop bucket
+        size_t visited_size(int key, const QueryOptions& options) const {
+            size_t size = lookup(key).size();
+            if (options.stop_bucket_size == 0 || size <= options.stop_bucket_size) return size;
+            return options.truncate_stop_buckets ? options.stop_bucket_size : 0;
+        }
+
+        // the votes of query() without the ranking, for queries over several tables
+        void add_votes(const std::vector<HashKey>& query_superpixels, int probe_budget, VoteAccumulator& votes) const {
+            QueryOptions options;
+            options.probe_budget = probe_budget;
+            add_votes(query_superpixels, options, votes);
+        }
+
+        // add_votes() that leaves out stop buckets (idf_weighting and early_termination are ignored), and the
+        // entries of images set in removed (see is_image_removed()). the buckets and entries visited are added
+        // to stats if it isn't null
+        void add_votes(const std::vector<HashKey>& query_superpixels, const QueryOptions& options,
+                       VoteAccumulator& votes, const std::vector<uint64_t>* removed = nullptr,
+                       QueryStats* stats = nullptr) const {
+            std::vector<int> keys;
+            for (const HashKey& superpixel : query_superpixels) {
+                probe_keys(superpixel, options.probe_budget, keys);
+                for (int key : keys) {
+                    HashBucket bucket = lookup(key);
+                    const SuperpixelRecord* last = bucket.begin() + visited_size(key, options);
+                    if (stats != nullptr) {
+                        count_bucket(key, options, *stats);
+                        stats->candidates += last - bucket.begin();
+                    }
+                    for (const SuperpixelRecord* match = bucket.begin(); match != last; match++) {
+                        if (removed != nullptr && is_image_removed(removed, match->image_id)) continue;
+                        votes.add(match->image_id);
+                    }
+                }
+            }
+        }
+
+        // runs independent queries in parallel (one VoteAccumulator per thread),
+        // matches[i] are the top k images of queries[i]
+        void query_batch(const std::vector<std::vector<HashKey>>& queries, int k, int probe_budget,
+                         std::vector<std::vector<ImageMatch>>& matches) const {
+            QueryOptions options;
+            options.k = k;
+            options.probe_budget = probe_budget;
+            query_batch(queries, options, matches);
+        }
+
+        void query_batch(const std::vector<std::vector<HashKey>>& queries, const QueryOptions& options,
+                         std::vector<std::vector<ImageMatch>>& matches) const {
+            matches.resize(queries.size());
+            cv::parallel_for_(cv::Range(0, (int)queries.size()), [&](const cv::Range& range) {
+                VoteAccumulator votes;
+                for (int i = range.start; i < range.end; i++) {
+                    query(queries[i], options, votes, matches[i]);
+                }
+            });
         }
 };
 
+typedef SLICHashTableT<> SLICHashTable;
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+/**
+ * Synthetic superpixels and scratch directories shared by the HashTable tests.
+ */
+
+#ifndef HASH_TEST_DATA_HPP
+#define HASH_TEST_DATA_HPP
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <random>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SLICHashTable.hpp"
+
+// Superpixel of a 1920x1080 image with a flat color and a single-pixel bounding box at (x, y)
+inline HashKey makeSuperpixel(uint32_t image_id, int l, int a, int b, int x, int y)
+{
+    HashKey key = HashKey();
+    key.image_width = 1920;
+    key.image_height = 1080;
+    key.image_id = image_id;
+    key.pixel_count = 100;
+    key.l_tot = (long) l * 100;
+    key.a_tot = (long) a * 100;
+    key.b_tot = (long) b * 100;
+    key.x_range = std::make_pair(x, x);
+    key.y_range = std::make_pair(y, y);
+    return key;
+}
+
+// Same images on every run: image_count images of superpixel_count superpixels with random colors and
+// centers, so every image mostly collides with itself
+inline std::vector<std::vector<HashKey>> makeImages(int image_count, int superpixel_count, unsigned int seed = 12345)
+{
+    std::mt19937 generator(seed);
+    std::uniform_int_distribution<int> color(0, 255), x(0, 1919), y(0, 1079);
+    std::vector<std::vector<HashKey>> images(image_count);
+    for (int image = 0; image < image_count; image++) {
+        for (int superpixel = 0; superpixel < superpixel_count; superpixel++) {
+            int l = color(generator), a = color(generator), b = color(generator);
+            int center_x = x(generator), center_y = y(generator);
+            images[image].push_back(makeSuperpixel((uint32_t) image, l, a, b, center_x, center_y));
+        }
+    }
+    return images;
+}
+
+// The same images with other ids, e.g. to replace an image by another one
+inline std::vector<HashKey> withImageId(std::vector<HashKey> superpixels, uint32_t image_id)
+{
+    for (HashKey& key : superpixels) key.image_id = image_id;
+    return superpixels;
+}
+
+// Matches are compared as a whole, the order of ties included
+inline void expectSameMatches(const std::vector<ImageMatch>& expected, const std::vector<ImageMatch>& actual)
+{
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_EQ(expected[i].image_id, actual[i].image_id) << "match " << i;
+        EXPECT_EQ(expected[i].votes, actual[i].votes) << "match " << i;
+    }
+}
+
+// Empty directory of its own under the test temporary directory, removed with everything in it at the end
+class ScratchDirectory {
+    public:
+        ScratchDirectory() {
+            std::string pattern = testing::TempDir() + "slic_hash_XXXXXX";
+            if (mkdtemp(&pattern[0]) != nullptr) path = pattern;
+        }
+
+        ~ScratchDirectory() {
+            if (path.empty()) return;
+            DIR* directory = opendir(path.c_str());
+            if (directory != nullptr) {
+                while (dirent* entry = readdir(directory)) {
+                    std::string name = entry->d_name;
+                    if (name != "." && name != "..") unlink((path + "/" + name).c_str());
+                }
+                closedir(directory);
+            }
+            rmdir(path.c_str());
+        }
+
+        std::string file(const std::string& name) const {
+            return path + "/" + name;
+        }
+
+        std::string path;
+};
+
+#endif
@@ -0,0 +1,229 @@
+/**
+ * Tests for SLICHashCluster: a table partitioned over worker processes has to answer queries exactly like
+ * the table itself, stopping the workers has to clean their sockets up, and a worker that goes away has
+ * to be left out of the answers instead of breaking them.
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SLICHashCluster.hpp"
+#include "hash_test_data.hpp"
+
+namespace {
+
+const int IMAGE_COUNT = 120;
+const int SUPERPIXEL_COUNT = 150;
+const int SHARD_COUNT = 3;
+
+// the HashTableWorker binary of this build (set by tests/CMakeLists.txt)
+const std::string WORKER = HASH_TABLE_WORKER;
+
+bool fileExists(const std::string& path)
+{
+    return access(path.c_str(), F_OK) == 0;
+}
+
+class ClusterTest : public testing::Test {
+    protected:
+        void SetUp() override {
+            ASSERT_FALSE(scratch.path.empty());
+            images = makeImages(IMAGE_COUNT, SUPERPIXEL_COUNT);
+            for (uint32_t image_id = 0; image_id < IMAGE_COUNT; image_id++) {
+                table.Hash(images[image_id]);
+                table.set_image_path(image_id, "image_" + std::to_string(image_id) + ".png");
+            }
+            table.freeze();
+            prefix = scratch.file("shard");
+            ASSERT_TRUE(SLICHashCluster::partition(table, SHARD_COUNT, prefix));
+        }
+
+        std::string socketPath(int shard) const {
+            return scratch.file("shard_" + std::to_string(shard) + ".sock");
+        }
+
+        ScratchDirectory scratch;
+        std::vector<std::vector<HashKey>> images;
+        SLICHashTable table;
+        std::string prefix;
+};
+
+} // namespace
+
+//=============================================================================
+// Partitioning
+//=============================================================================
+
+TEST_F(ClusterTest, ShardsSplitTheImages) {
+    size_t entries = 0;
+    for (int shard = 0; shard < SHARD_COUNT; shard++) {
+        SLICHashTable shard_table;
+        ASSERT_TRUE(shard_table.load(prefix + "_" + std::to_string(shard) + ".slic"));
+        entries += shard_table.size();
+        for (uint32_t image_id = 0; image_id < IMAGE_COUNT; image_id++) {
+            bool in_shard = SLICHashCluster::shard_of(image_id, SHARD_COUNT) == shard;
+            EXPECT_EQ(shard_table.image_path(image_id), in_shard ? table.image_path(image_id) : "");
+        }
+    }
+    EXPECT_EQ(entries, table.size());
+}
+
+//=============================================================================
+// Queries Over Workers
+//=============================================================================
+
+TEST_F(ClusterTest, WorkersAnswerLikeTheWholeTable) {
+    SLICHashCluster cluster;
+    ASSERT_TRUE(cluster.start_workers(WORKER, prefix, SHARD_COUNT, scratch.path));
+    EXPECT_EQ(cluster.worker_count(), (size_t) SHARD_COUNT);
+
+    VoteAccumulator votes;
+    std::vector<ImageMatch> expected, actual;
+    for (uint32_t image_id = 0; image_id < IMAGE_COUNT; image_id += 7) {
+        for (int probe_budget = 1; probe_budget <= 4; probe_budget += 3) {
+            table.query(images[image_id], 10, probe_budget, votes, expected);
+            ASSERT_TRUE(cluster.query(images[image_id], 10, probe_budget, actual));
+            SCOPED_TRACE("image " + std::to_string(image_id));
+            expectSameMatches(expected, actual);
+        }
+    }
+
+    cluster.stop_workers();
+    EXPECT_EQ(cluster.worker_count(), 0u);
+    for (int shard = 0; shard < SHARD_COUNT; shard++) {
+        EXPECT_FALSE(fileExists(socketPath(shard))) << "shard " << shard;
+    }
+}
+
+TEST_F(ClusterTest, WeightedQueriesMatchTheWholeTable) {
+    SLICHashCluster cluster;
+    ASSERT_TRUE(cluster.start_workers(WORKER, prefix, SHARD_COUNT, scratch.path));
+
+    QueryOptions options;
+    options.k = 2;
+    options.probe_budget = 2;
+    options.idf_weighting = true;
+    options.early_termination = true;
+    QueryOptions full = options;
+    full.early_termination = false;
+
+    VoteAccumulator votes;
+    std::vector<ImageMatch> early, expected, actual;
+    int cut_short = 0;
+    for (uint32_t image_id = 0; image_id + 1 < IMAGE_COUNT; image_id += 5) {
+        SCOPED_TRACE("image " + std::to_string(image_id));
+        // two images of different shards, the second one only partly, so both shards have a clear best
+        // image and stop early at their own point
+        std::vector<HashKey> query = images[image_id];
+        query.insert(query.end(), images[image_id + 1].begin(), images[image_id + 1].begin() + SUPERPIXEL_COUNT * 2 / 3);
+        table.query(query, options, votes, early);
+        table.query(query, full, votes, expected);
+        ASSERT_TRUE(cluster.query(query, options, actual));
+        cut_short += early[0].votes < expected[0].votes;
+
+        // the images early termination finds on the whole table, with the votes of a full count
+        expectSameMatches(expected, actual);
+        std::vector<uint32_t> early_ids, actual_ids;
+        for (const ImageMatch& match : early) early_ids.push_back(match.image_id);
+        for (const ImageMatch& match : actual) actual_ids.push_back(match.image_id);
+        std::sort(early_ids.begin(), early_ids.end());
+        std::sort(actual_ids.begin(), actual_ids.end());
+        EXPECT_EQ(early_ids, actual_ids);
+    }
+    // early termination did stop before the end
+    EXPECT_GT(cut_short, 0);
+    cluster.stop_workers();
+}
+
+TEST_F(ClusterTest, LostWorkerIsLeftOut) {
+    SLICHashCluster cluster;
+    std::vector<pid_t> pids;
+    for (int shard = 0; shard < SHARD_COUNT; shard++) {
+        pid_t pid = SLICHashCluster::spawn_worker(WORKER, prefix + "_" + std::to_string(shard) + ".slic", socketPath(shard));
+        ASSERT_GT(pid, 0);
+        ASSERT_TRUE(cluster.connect_worker(socketPath(shard), pid));
+        pids.push_back(pid);
+    }
+    const int lost = 1;
+    kill(pids[lost], SIGKILL);
+
+    // the top 10 of the images of the other shards
+    VoteAccumulator votes;
+    std::vector<ImageMatch> all, expected, actual;
+    table.query(images[lost], IMAGE_COUNT, 2, votes, all);
+    for (const ImageMatch& match : all) {
+        if (SLICHashCluster::shard_of(match.image_id, SHARD_COUNT) != lost && expected.size() < 10) {
+            expected.push_back(match);
+        }
+    }
+
+    EXPECT_FALSE(cluster.query(images[lost], 10, 2, actual));
+    expectSameMatches(expected, actual);
+    EXPECT_EQ(cluster.worker_count(), (size_t) SHARD_COUNT - 1);
+
+    // the lost worker stays out of later queries, which still say the answer is incomplete
+    EXPECT_FALSE(cluster.query(images[lost], 10, 2, actual));
+    expectSameMatches(expected, actual);
+    EXPECT_FALSE(cluster.query(images[0], 10, 2, actual));
+    ASSERT_FALSE(actual.empty());
+    EXPECT_EQ(actual[0].image_id, 0u);
+
+    // the other workers stop as usual, and the socket the lost one left behind is removed
+    cluster.stop_workers();
+    for (int shard = 0; shard < SHARD_COUNT; shard++) {
+        EXPECT_FALSE(fileExists(socketPath(shard))) << "shard " << shard;
+    }
+}
+
+TEST_F(ClusterTest, WorkerDropsGarbledRequests) {
+    SLICHashCluster cluster;
+    ASSERT_TRUE(cluster.start_workers(WORKER, prefix, 1, scratch.path));
+
+    // a query header claiming 4 billion superpixels, from a connection of its own
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(connection, 0);
+    sockaddr_un address = sockaddr_un();
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath(0).c_str(), sizeof(address.sun_path) - 1);
+    ASSERT_EQ(connect(connection, (const sockaddr*) &address, sizeof(address)), 0);
+    const uint32_t garbled[6] = { 1, 0xFFFFFFFFu, 10, 1, 0, 0 };
+    ASSERT_EQ(send(connection, garbled, sizeof(garbled), 0), (ssize_t) sizeof(garbled));
+
+    // the worker hangs up on it, and keeps answering the coordinator
+    char answer;
+    EXPECT_EQ(recv(connection, &answer, 1, 0), 0);
+    close(connection);
+    std::vector<ImageMatch> matches;
+    EXPECT_TRUE(cluster.query(images[0], 10, 1, matches));
+    ASSERT_FALSE(matches.empty());
+    EXPECT_EQ(matches[0].image_id, 0u);
+
+    // and the coordinator doesn't send a k no worker takes
+    EXPECT_FALSE(cluster.query(images[0], 1 << 20, 1, matches));
+    EXPECT_TRUE(matches.empty());
+    EXPECT_EQ(cluster.worker_count(), 1u);
+    cluster.stop_workers();
+}
+
+TEST_F(ClusterTest, FailedStartStopsTheStartedWorkers) {
+    // one shard more than partition() wrote: the last worker can't load its index
+    SLICHashCluster cluster;
+    EXPECT_FALSE(cluster.start_workers(WORKER, prefix, SHARD_COUNT + 1, scratch.path));
+    EXPECT_EQ(cluster.worker_count(), 0u);
+    // and a worker binary that isn't there
+    EXPECT_FALSE(cluster.start_workers(scratch.file("missing_worker"), prefix, SHARD_COUNT, scratch.path));
+    EXPECT_EQ(cluster.worker_count(), 0u);
+
+    // every worker process was waited for and every socket removed
+    EXPECT_EQ(waitpid(-1, nullptr, WNOHANG), -1);
+    for (int shard = 0; shard <= SHARD_COUNT; shard++) {
+        EXPECT_FALSE(fileExists(socketPath(shard))) << "shard " << shard;
+    }
+}
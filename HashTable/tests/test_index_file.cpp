@@ -0,0 +1,257 @@
+/**
+ * Tests for saved SLICHashTables: a loaded table has to answer queries like the table that saved it, a
+ * merge of appended segments like a table holding all of them, and load() has to turn down files that
+ * are cut short, from another version or grid, or corrupt.
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SLICHashIndex.hpp"
+#include "hash_test_data.hpp"
+
+namespace {
+
+const int IMAGE_COUNT = 120;
+const int SUPERPIXEL_COUNT = 150;
+
+void hashImages(SLICHashTable& table, const std::vector<std::vector<HashKey>>& images, uint32_t first, uint32_t end)
+{
+    for (uint32_t image_id = first; image_id < end; image_id++) {
+        table.Hash(images[image_id]);
+        table.set_image_path(image_id, "image_" + std::to_string(image_id) + ".png");
+    }
+}
+
+std::vector<unsigned char> readFile(const std::string& path)
+{
+    std::vector<unsigned char> bytes;
+    FILE* stream = fopen(path.c_str(), "rb");
+    if (stream == nullptr) return bytes;
+    unsigned char chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), stream)) > 0) bytes.insert(bytes.end(), chunk, chunk + read);
+    fclose(stream);
+    return bytes;
+}
+
+void writeFile(const std::string& path, const std::vector<unsigned char>& bytes)
+{
+    FILE* stream = fopen(path.c_str(), "wb");
+    ASSERT_NE(stream, nullptr);
+    ASSERT_EQ(fwrite(bytes.data(), 1, bytes.size(), stream), bytes.size());
+    fclose(stream);
+}
+
+HashIndexFileHeader headerOf(const std::vector<unsigned char>& bytes)
+{
+    HashIndexFileHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    return header;
+}
+
+class IndexFileTest : public testing::Test {
+    protected:
+        void SetUp() override {
+            ASSERT_FALSE(scratch.path.empty());
+            images = makeImages(IMAGE_COUNT, SUPERPIXEL_COUNT);
+            hashImages(table, images, 0, IMAGE_COUNT);
+            table.freeze();
+            saved = scratch.file("table.slic");
+            ASSERT_TRUE(table.save(saved));
+        }
+
+        // a copy of the saved file with a change, which a fresh table (and the table that saved the
+        // original, after its own load) has to refuse
+        void expectRejected(const std::vector<unsigned char>& bytes) {
+            std::string corrupt = scratch.file("corrupt.slic");
+            writeFile(corrupt, bytes);
+            SLICHashTable loaded;
+            EXPECT_FALSE(loaded.load(corrupt));
+            EXPECT_FALSE(loaded.is_frozen());
+
+            // a table that is already loaded stays as it was
+            SLICHashTable previous;
+            ASSERT_TRUE(previous.load(saved));
+            EXPECT_FALSE(previous.load(corrupt));
+            EXPECT_EQ(previous.size(), table.size());
+            EXPECT_EQ(previous.image_path(7), "image_7.png");
+        }
+
+        ScratchDirectory scratch;
+        std::vector<std::vector<HashKey>> images;
+        SLICHashTable table;
+        std::string saved;
+};
+
+} // namespace
+
+//=============================================================================
+// Save / Load Round Trip
+//=============================================================================
+
+TEST_F(IndexFileTest, LoadedTableAnswersLikeTheSavedOne) {
+    SLICHashTable loaded;
+    ASSERT_TRUE(loaded.load(saved));
+
+    EXPECT_TRUE(loaded.is_mapped());
+    EXPECT_EQ(loaded.size(), table.size());
+    EXPECT_EQ(loaded.image_id_count(), table.image_id_count());
+    EXPECT_EQ(loaded.image_path(IMAGE_COUNT - 1), table.image_path(IMAGE_COUNT - 1));
+
+    VoteAccumulator votes;
+    std::vector<ImageMatch> expected, actual;
+    for (uint32_t image_id = 0; image_id < IMAGE_COUNT; image_id += 7) {
+        for (int probe_budget = 1; probe_budget <= 4; probe_budget += 3) {
+            table.query(images[image_id], 10, probe_budget, votes, expected);
+            loaded.query(images[image_id], 10, probe_budget, votes, actual);
+            ASSERT_FALSE(expected.empty());
+            EXPECT_EQ(expected[0].image_id, image_id);
+            expectSameMatches(expected, actual);
+        }
+    }
+}
+
+TEST_F(IndexFileTest, LoadedTableKeepsEveryBucket) {
+    SLICHashTable loaded;
+    ASSERT_TRUE(loaded.load(saved));
+
+    for (int key = 0; key < DefaultBucketConfig::bucket_count; key++) {
+        ASSERT_EQ(loaded.bucket_occupied(key), table.bucket_occupied(key)) << "bucket " << key;
+        ASSERT_EQ(loaded.lookup(key).size(), table.lookup(key).size()) << "bucket " << key;
+    }
+}
+
+TEST_F(IndexFileTest, MergedSegmentsAnswerLikeOneTable) {
+    SLICHashIndex index(scratch.path);
+    for (uint32_t first = 0; first < IMAGE_COUNT; first += IMAGE_COUNT / 3) {
+        SLICHashTable segment;
+        hashImages(segment, images, first, first + IMAGE_COUNT / 3);
+        ASSERT_TRUE(index.append(segment));
+    }
+    ASSERT_EQ(index.segment_count(), 3u);
+
+    VoteAccumulator votes;
+    std::vector<ImageMatch> expected, appended, merged;
+    std::vector<std::vector<ImageMatch>> before;
+    for (uint32_t image_id = 0; image_id < IMAGE_COUNT; image_id += 11) {
+        table.query(images[image_id], 10, 2, votes, expected);
+        index.query(images[image_id], 10, 2, votes, appended);
+        expectSameMatches(expected, appended);
+        before.push_back(expected);
+    }
+
+    ASSERT_TRUE(index.merge_in_background());
+    index.wait_for_merge();
+    ASSERT_EQ(index.segment_count(), 1u);
+    EXPECT_EQ(index.image_path(IMAGE_COUNT - 1), table.image_path(IMAGE_COUNT - 1));
+    for (uint32_t image_id = 0, q = 0; image_id < IMAGE_COUNT; image_id += 11, q++) {
+        index.query(images[image_id], 10, 2, votes, merged);
+        expectSameMatches(before[q], merged);
+    }
+
+    // the merged base is what a reopened index finds
+    SLICHashIndex reopened(scratch.path);
+    ASSERT_EQ(reopened.segment_count(), 1u);
+    reopened.query(images[0], 10, 2, votes, merged);
+    expectSameMatches(before[0], merged);
+}
+
+//=============================================================================
+// Rejected Files
+//=============================================================================
+
+TEST_F(IndexFileTest, RejectsMissingFile) {
+    SLICHashTable loaded;
+    EXPECT_FALSE(loaded.load(scratch.file("missing.slic")));
+}
+
+TEST_F(IndexFileTest, RejectsTruncatedFile) {
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+
+    // cut in the header, in the records and in the image paths
+    std::vector<size_t> sizes = { sizeof(HashIndexFileHeader) / 2, (size_t) header.entries_start + 16,
+                                  (size_t) (header.paths_start + header.paths_size - 1) };
+    for (size_t size : sizes) {
+        expectRejected(std::vector<unsigned char>(bytes.begin(), bytes.begin() + size));
+    }
+}
+
+TEST_F(IndexFileTest, RejectsOtherVersion) {
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+    header.version = SLIC_HASH_INDEX_VERSION - 1;
+    memcpy(bytes.data(), &header, sizeof(header));
+    expectRejected(bytes);
+}
+
+TEST_F(IndexFileTest, RejectsOtherGrid) {
+    // same number of buckets as the default 8 x 8 grid, split as 16 x 4
+    SLICHashTableT<SLICBucketConfig<4, 4, 2>> other_grid;
+    EXPECT_FALSE(other_grid.load(saved));
+
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+    header.x_buckets *= 2;
+    memcpy(bytes.data(), &header, sizeof(header));
+    expectRejected(bytes);
+}
+
+TEST_F(IndexFileTest, RejectsSectionsThatWrapAround) {
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+
+    // paths_start + paths_size wraps around to 1, which is inside the file
+    HashIndexFileHeader paths = header;
+    paths.paths_size = ~(uint64_t) 0 - paths.paths_start + 2;
+    memcpy(bytes.data(), &paths, sizeof(paths));
+    expectRejected(bytes);
+
+    // entry_count * sizeof(SuperpixelRecord) wraps around to the real size of the records
+    HashIndexFileHeader entries = header;
+    entries.entry_count += (uint64_t) 1 << 60;
+    memcpy(bytes.data(), &entries, sizeof(entries));
+    expectRejected(bytes);
+
+    // offsets that would start in the header
+    HashIndexFileHeader offsets = header;
+    offsets.offsets_start = 0;
+    memcpy(bytes.data(), &offsets, sizeof(offsets));
+    expectRejected(bytes);
+
+    // more images than the paths have room for
+    HashIndexFileHeader images = header;
+    images.image_count = ~(uint32_t) 0;
+    memcpy(bytes.data(), &images, sizeof(images));
+    expectRejected(bytes);
+}
+
+TEST_F(IndexFileTest, RejectsOffsetsOutOfOrder) {
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+    unsigned int* offsets = (unsigned int*) (bytes.data() + header.offsets_start);
+
+    // a bucket that ends before it starts
+    int key = 0;
+    while (offsets[key + 1] == offsets[key]) key++;
+    offsets[key + 1] = offsets[key] - 1;
+    expectRejected(bytes);
+}
+
+TEST_F(IndexFileTest, RejectsOffsetsPastTheRecords) {
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+    unsigned int* offsets = (unsigned int*) (bytes.data() + header.offsets_start);
+    offsets[DefaultBucketConfig::bucket_count] = (unsigned int) header.entry_count + 1;
+    expectRejected(bytes);
+}
+
+TEST_F(IndexFileTest, RejectsImageIdOutOfRange) {
+    std::vector<unsigned char> bytes = readFile(saved);
+    HashIndexFileHeader header = headerOf(bytes);
+    SuperpixelRecord* records = (SuperpixelRecord*) (bytes.data() + header.entries_start);
+    records[header.entry_count - 1].image_id = header.image_count;
+    expectRejected(bytes);
+}
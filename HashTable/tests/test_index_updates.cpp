@@ -0,0 +1,224 @@
+/**
+ * Tests for removing and replacing images in a SLICHashIndex. After every change the index has to answer
+ * queries exactly like a single table holding the current version of every image: removed images don't
+ * vote anymore, upserted images vote with their new superpixels only, and neither reopening the directory
+ * nor a merge (even one running while the images change) brings an old version back.
+ */
+
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "SLICHashIndex.hpp"
+#include "hash_test_data.hpp"
+
+namespace {
+
+const int IMAGE_COUNT = 150;
+const int SUPERPIXEL_COUNT = 150;
+// images that aren't in the index at first, used as new versions of indexed ones
+const int SPARE_COUNT = 20;
+
+class IndexUpdateTest : public testing::Test {
+    protected:
+        void SetUp() override {
+            ASSERT_FALSE(scratch.path.empty());
+            images = makeImages(IMAGE_COUNT + SPARE_COUNT, SUPERPIXEL_COUNT);
+            current.assign(IMAGE_COUNT, std::vector<HashKey>());
+        }
+
+        // appends images [first, end) as one segment
+        void appendImages(SLICHashIndex& index, uint32_t first, uint32_t end) {
+            SLICHashTable segment;
+            for (uint32_t image_id = first; image_id < end; image_id++) {
+                segment.Hash(images[image_id]);
+                segment.set_image_path(image_id, "image_" + std::to_string(image_id) + ".png");
+                current[image_id] = images[image_id];
+            }
+            ASSERT_TRUE(index.append(segment));
+        }
+
+        void fillIndex(SLICHashIndex& index) {
+            for (uint32_t first = 0; first < IMAGE_COUNT; first += IMAGE_COUNT / 3) {
+                appendImages(index, first, first + IMAGE_COUNT / 3);
+            }
+        }
+
+        // a segment with the superpixels of spare image `spare` as the new version of image_id
+        void hashNewVersion(SLICHashTable& segment, uint32_t image_id, int spare) {
+            std::vector<HashKey> version = withImageId(images[IMAGE_COUNT + spare], image_id);
+            segment.Hash(version);
+            segment.set_image_path(image_id, "image_" + std::to_string(image_id) + "_v2.png");
+            current[image_id] = version;
+        }
+
+        // every image (old and new versions) as a query, against one table holding the current versions
+        void expectAnswersLikeCurrent(const SLICHashIndex& index) {
+            SLICHashTable reference;
+            for (const std::vector<HashKey>& image : current) {
+                if (!image.empty()) reference.Hash(image);
+            }
+            reference.freeze();
+
+            VoteAccumulator votes;
+            std::vector<ImageMatch> expected, actual;
+            for (size_t query = 0; query < images.size(); query += 3) {
+                reference.query(images[query], 10, 2, votes, expected);
+                index.query(images[query], 10, 2, votes, actual);
+                SCOPED_TRACE("query " + std::to_string(query));
+                expectSameMatches(expected, actual);
+            }
+        }
+
+        void removeFromCurrent(const std::vector<uint32_t>& image_ids) {
+            for (uint32_t image_id : image_ids) current[image_id].clear();
+        }
+
+        ScratchDirectory scratch;
+        std::vector<std::vector<HashKey>> images;
+        // current version of every image id, empty if it isn't in the index
+        std::vector<std::vector<HashKey>> current;
+};
+
+} // namespace
+
+//=============================================================================
+// Remove / Upsert
+//=============================================================================
+
+TEST_F(IndexUpdateTest, RemovedImagesStopVoting) {
+    SLICHashIndex index(scratch.path);
+    fillIndex(index);
+
+    // from the first, a middle and the last segment
+    std::vector<uint32_t> removed = { 3, 70, 149 };
+    ASSERT_TRUE(index.remove_images(removed));
+    removeFromCurrent(removed);
+
+    expectAnswersLikeCurrent(index);
+    EXPECT_EQ(index.image_path(70), "");
+    EXPECT_EQ(index.image_path(71), "image_71.png");
+    EXPECT_EQ(index.segment_count(), 3u);
+}
+
+TEST_F(IndexUpdateTest, UpsertedImagesVoteWithTheirNewVersion) {
+    SLICHashIndex index(scratch.path);
+    fillIndex(index);
+
+    SLICHashTable segment;
+    hashNewVersion(segment, 10, 0);
+    hashNewVersion(segment, 120, 1);
+    ASSERT_TRUE(index.upsert(segment));
+
+    expectAnswersLikeCurrent(index);
+    EXPECT_EQ(index.image_path(10), "image_10_v2.png");
+    EXPECT_EQ(index.segment_count(), 4u);
+
+    // a second upsert of the same image replaces the first one
+    SLICHashTable again;
+    hashNewVersion(again, 10, 2);
+    ASSERT_TRUE(index.upsert(again));
+    expectAnswersLikeCurrent(index);
+}
+
+TEST_F(IndexUpdateTest, ReopenedIndexKeepsTombstones) {
+    {
+        SLICHashIndex index(scratch.path);
+        fillIndex(index);
+        ASSERT_TRUE(index.remove_images({ 5, 90 }));
+        SLICHashTable segment;
+        hashNewVersion(segment, 60, 0);
+        ASSERT_TRUE(index.upsert(segment));
+    }
+    removeFromCurrent({ 5, 90 });
+
+    SLICHashIndex reopened(scratch.path);
+    EXPECT_EQ(reopened.segment_count(), 4u);
+    expectAnswersLikeCurrent(reopened);
+    EXPECT_EQ(reopened.image_path(5), "");
+    EXPECT_EQ(reopened.image_path(60), "image_60_v2.png");
+}
+
+TEST_F(IndexUpdateTest, ReopenedIndexLeavesOutCutTombstones) {
+    {
+        SLICHashIndex index(scratch.path);
+        fillIndex(index);
+        ASSERT_TRUE(index.remove_images({ 75 }));
+    }
+
+    // the tombstones of the middle segment, cut short
+    std::string removed = scratch.file("segment_1.slic.removed");
+    ASSERT_EQ(truncate(removed.c_str(), 8), 0);
+
+    SLICHashIndex reopened(scratch.path);
+    EXPECT_EQ(reopened.segment_count(), 2u);
+    EXPECT_EQ(reopened.image_path(75), "");
+    EXPECT_EQ(reopened.image_path(76), "");
+    EXPECT_EQ(reopened.image_path(0), "image_0.png");
+}
+
+//=============================================================================
+// Merges
+//=============================================================================
+
+TEST_F(IndexUpdateTest, MergeDropsRemovedEntries) {
+    SLICHashIndex index(scratch.path);
+    fillIndex(index);
+    std::vector<uint32_t> removed = { 0, 1, 75, 140 };
+    ASSERT_TRUE(index.remove_images(removed));
+    removeFromCurrent(removed);
+    SLICHashTable segment;
+    hashNewVersion(segment, 30, 0);
+    ASSERT_TRUE(index.upsert(segment));
+
+    ASSERT_TRUE(index.merge_in_background());
+    index.wait_for_merge();
+    ASSERT_EQ(index.segment_count(), 1u);
+    expectAnswersLikeCurrent(index);
+    EXPECT_EQ(index.image_path(75), "");
+    EXPECT_EQ(index.image_path(30), "image_30_v2.png");
+
+    // the new base holds the current versions only, and has no tombstones left
+    std::ifstream list(scratch.file("segments").c_str());
+    int next_segment;
+    std::string base;
+    ASSERT_TRUE(list >> next_segment >> base);
+    SLICHashTable merged;
+    ASSERT_TRUE(merged.load(scratch.file(base)));
+    size_t current_entries = 0;
+    for (const std::vector<HashKey>& image : current) current_entries += image.size();
+    EXPECT_EQ(merged.size(), current_entries);
+    EXPECT_FALSE(std::ifstream(scratch.file(base + ".removed").c_str()).good());
+}
+
+TEST_F(IndexUpdateTest, ChangesDuringMergeKeepTheNewVersion) {
+    SLICHashIndex index(scratch.path);
+    fillIndex(index);
+
+    // the merge freezes and saves every image before it swaps the new base in, these changes land on
+    // the segments it is merging (and one of them on a segment it isn't)
+    ASSERT_TRUE(index.merge_in_background());
+    SLICHashTable segment;
+    hashNewVersion(segment, 20, 0);
+    ASSERT_TRUE(index.upsert(segment));
+    ASSERT_TRUE(index.remove_images({ 110 }));
+    removeFromCurrent({ 110 });
+    SLICHashTable appended;
+    hashNewVersion(appended, 110, 1);
+    ASSERT_TRUE(index.append(appended));
+    index.wait_for_merge();
+
+    EXPECT_EQ(index.segment_count(), 3u);
+    expectAnswersLikeCurrent(index);
+    EXPECT_EQ(index.image_path(20), "image_20_v2.png");
+    EXPECT_EQ(index.image_path(110), "image_110_v2.png");
+
+    // and after the next merge, and in the reopened directory
+    ASSERT_TRUE(index.merge_in_background());
+    index.wait_for_merge();
+    EXPECT_EQ(index.segment_count(), 1u);
+    expectAnswersLikeCurrent(index);
+    SLICHashIndex reopened(scratch.path);
+    expectAnswersLikeCurrent(reopened);
+}
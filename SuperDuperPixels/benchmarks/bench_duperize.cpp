@@ -0,0 +1,158 @@
+// bench_duperize.cpp
+// Measures how duperizeWithAverage() and duperizeWithHistogram() scale with the image size and the
+// number of superpixels, so the O(n log n) claim for the duperize pass can be checked with the
+// complexity fit of Google Benchmark (BigO / RMS rows at the end of each family).
+//
+// Every stage of the duperize pass is also reported as a counter (adjacency_ms, stats_ms,
+// grouping_ms, relabel_ms) so a change in the fitted complexity can be traced back to one stage.
+//
+// Run with:
+// bench_duperize --benchmark_counters_tabular=true
+
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <opencv2/core.hpp>
+#include "../src/sdp_slic.hpp"
+using namespace cv;
+
+// Builds the same image for every run: 4 flat quadrants (so the superpixels have something to be
+// grouped into) with a small deterministic texture on top of them.
+static Mat makeImage(const int width, const int height)
+{
+	Mat image(height, width, CV_8UC3);
+	for (int y = 0; y < height; y += 1)
+	for (int x = 0; x < width; x += 1)
+	{
+		int quadrant = (x < width / 2 ? 0 : 1) + (y < height / 2 ? 0 : 2);
+		Vec3b& pixel = image.at<Vec3b>(y, x);
+		pixel[0] = (uchar) (40 + 50 * quadrant + (x * 7 + y * 3) % 23);
+		pixel[1] = (uchar) (100 + 20 * quadrant + (x * y) % 11);
+		pixel[2] = (uchar) (200 - 30 * quadrant + (x * 5 + y) % 7);
+	}
+	return image;
+}
+
+// Segments the image the way the demo does
+static Ptr<SuperpixelSLIC> makeSuperpixels(const Mat& image, const int region_size)
+{
+	Ptr<SuperpixelSLIC> slic = createSuperpixelSLIC(image, SLIC, region_size, 10.0f);
+	slic->iterate(3);
+	slic->enforceLabelConnectivity(25);
+	return slic;
+}
+
+// Adds the stage timings of the last duperize call to the running totals
+static void addTimings(DuperizeTimings& totals, const DuperizeTimings& timings)
+{
+	totals.adjacency += timings.adjacency;
+	totals.stats += timings.stats;
+	totals.grouping += timings.grouping;
+	totals.relabel += timings.relabel;
+}
+
+// Reports the stage timings as per-iteration averages
+static void reportTimings(benchmark::State& state, const DuperizeTimings& totals)
+{
+	state.counters["adjacency_ms"] = benchmark::Counter(totals.adjacency, benchmark::Counter::kAvgIterations);
+	state.counters["stats_ms"] = benchmark::Counter(totals.stats, benchmark::Counter::kAvgIterations);
+	state.counters["grouping_ms"] = benchmark::Counter(totals.grouping, benchmark::Counter::kAvgIterations);
+	state.counters["relabel_ms"] = benchmark::Counter(totals.relabel, benchmark::Counter::kAvgIterations);
+}
+
+// Runs one duperize (with relabeling) per iteration on the base superpixels.
+// Before every call (untimed) resetDuperize() puts the base superpixels back and drops what the
+// previous call kept, so every iteration pays for the whole pass on the same segmentation.
+template<class Duperize>
+static void runDuperize(benchmark::State& state, Ptr<SuperpixelSLIC>& slic, Duperize duperize)
+{
+	const int superpixels = slic->getNumberOfSuperpixels();
+	DuperizeTimings totals = DuperizeTimings();
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		slic->resetDuperize();
+		state.ResumeTiming();
+
+		duperize();
+		addTimings(totals, slic->getDuperizeTimings());
+	}
+	reportTimings(state, totals);
+	state.counters["superpixels"] = superpixels;
+	state.counters["superduperpixels"] = slic->getNumberOfSuperduperpixels();
+}
+
+// duperizeWithAverage() on square images of side state.range(0), N = pixels
+static void BM_DuperizeWithAverage(benchmark::State& state, const int region_size)
+{
+	const int side = (int) state.range(0);
+	Mat image = makeImage(side, side);
+	Ptr<SuperpixelSLIC> slic = makeSuperpixels(image, region_size);
+
+	runDuperize(state, slic, [&]() { slic->duperizeWithAverage(30.0f); });
+	state.SetComplexityN((int64_t) side * side);
+}
+BENCHMARK_CAPTURE(BM_DuperizeWithAverage, region_10, 10)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+BENCHMARK_CAPTURE(BM_DuperizeWithAverage, region_20, 20)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+BENCHMARK_CAPTURE(BM_DuperizeWithAverage, region_40, 40)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+
+// duperizeWithHistogram() on square images of side state.range(0), N = pixels
+static void BM_DuperizeWithHistogram(benchmark::State& state, const int buckets)
+{
+	const int side = (int) state.range(0);
+	Mat image = makeImage(side, side);
+	Ptr<SuperpixelSLIC> slic = makeSuperpixels(image, 20);
+	const int num_buckets[] = { buckets, buckets, buckets };
+
+	runDuperize(state, slic, [&]() { slic->duperizeWithHistogram(num_buckets, 0.8f); });
+	state.SetComplexityN((int64_t) side * side);
+}
+BENCHMARK_CAPTURE(BM_DuperizeWithHistogram, buckets_4, 4)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+BENCHMARK_CAPTURE(BM_DuperizeWithHistogram, buckets_8, 8)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+BENCHMARK_CAPTURE(BM_DuperizeWithHistogram, buckets_16, 16)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+BENCHMARK_CAPTURE(BM_DuperizeWithHistogram, buckets_32, 32)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+
+// duperizeWithAverage() on a fixed 1024x1024 image with region size state.range(0),
+// N = superpixels, so the grouping cost can be told apart from the per-pixel cost
+static void BM_DuperizeSuperpixelCount(benchmark::State& state)
+{
+	Mat image = makeImage(1024, 1024);
+	Ptr<SuperpixelSLIC> slic = makeSuperpixels(image, (int) state.range(0));
+
+	const int superpixels = slic->getNumberOfSuperpixels();
+	runDuperize(state, slic, [&]() { slic->duperizeWithAverage(30.0f); });
+	state.SetComplexityN(superpixels);
+}
+BENCHMARK(BM_DuperizeSuperpixelCount)
+	->Arg(64)->Arg(32)->Arg(16)->Arg(8)->Arg(4)->Unit(benchmark::kMillisecond)->Complexity();
+
+// duperizeWithAverage() called again with a new threshold, reusing the stats of the previous call
+// (what a threshold slider in a UI does), N = pixels
+static void BM_ReduperizeWithAverage(benchmark::State& state)
+{
+	const int side = (int) state.range(0);
+	Mat image = makeImage(side, side);
+	Ptr<SuperpixelSLIC> slic = makeSuperpixels(image, 20);
+	slic->duperizeWithAverage(30.0f, false);
+
+	DuperizeTimings totals = DuperizeTimings();
+	float distance = 10.0f;
+	for (auto _ : state)
+	{
+		slic->duperizeWithAverage(distance, false);
+		addTimings(totals, slic->getDuperizeTimings());
+		distance = distance == 10.0f ? 30.0f : 10.0f;
+	}
+	reportTimings(state, totals);
+	state.SetComplexityN((int64_t) side * side);
+}
+BENCHMARK(BM_ReduperizeWithAverage)
+	->RangeMultiplier(2)->Range(128, 2048)->Unit(benchmark::kMillisecond)->Complexity();
+
+BENCHMARK_MAIN();
@@ -58,13 +58,14 @@ int main(int argc, char* argv[])
 	slic->iterate(1);
 	slic->enforceLabelConnectivity(min_superpixel_size_percent);
 	// 50.0 good for aguilles_rogues, 32.0 good for cosmo
-	slic->duperizeWithAverage(30.0);
+	// Don't relabel in place, the contour pass below maps the labels itself
+	slic->duperizeWithAverage(30.0, false);
 	// const int num_buckets[] = {16, 16, 16};
-	// slic->duperizeWithHistogram(num_buckets, 2.0f);
+	// slic->duperizeWithHistogram(num_buckets, 2.0f, false);
 
-	// Gets overlay image of superpixels
+	// Gets overlay image of super-duper-pixels
 	Mat superpixels;
-	slic->getLabelContourMask(superpixels);
+	slic->getSuperduperpixelLabels(noArray(), superpixels);
 
 	// Creates the output image of superpixels
 	Mat output(input_image);
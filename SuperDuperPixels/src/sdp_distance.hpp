@@ -0,0 +1,178 @@
+// sdp_distance.hpp
+// Distance policies used to compare superpixel colors when grouping them into super-duper-pixels.
+//
+// Each policy is a struct with a static compute() function, so the grouping code can be a template
+// over the policy and every metric gets its own inlined copy of the grouping loop instead of paying
+// for a virtual call (or a switch) on every comparison.
+//
+// Features are flat float arrays: average colors (one value per color channel) or normalized color
+// histograms (the buckets of every color channel back to back).
+
+#ifndef SDP_DISTANCE_HPP
+#define SDP_DISTANCE_HPP
+
+#include <cmath>
+#include <algorithm>
+
+// Manhattan distance (what SD-SLIC has always used)
+struct L1Distance
+{
+	static inline float compute(const float* a, const float* b, const int size)
+	{
+		float dist = 0;
+		for (int i = 0; i < size; i += 1)
+		{
+			dist += std::abs(a[i] - b[i]);
+		}
+		return dist;
+	}
+};
+
+// Euclidian distance
+struct L2Distance
+{
+	static inline float compute(const float* a, const float* b, const int size)
+	{
+		float dist = 0;
+		for (int i = 0; i < size; i += 1)
+		{
+			float diff = a[i] - b[i];
+			dist += diff * diff;
+		}
+		return std::sqrt(dist);
+	}
+};
+
+// CIEDE2000 color difference between the first 3 features, computed in single precision.
+// Expects real CIELAB values (L* in [0, 100], a* and b* centered on 0), so 8-bit OpenCV Lab colors
+// have to be converted with from8BitLab() first.
+struct CIEDE2000Distance
+{
+	// Rescales an 8-bit OpenCV Lab color (L * 255 / 100, a + 128, b + 128) into CIELAB in place
+	static inline void from8BitLab(float* lab)
+	{
+		lab[0] = lab[0] * 100.0f / 255.0f;
+		lab[1] -= 128.0f;
+		lab[2] -= 128.0f;
+	}
+
+	static inline float compute(const float* a, const float* b, const int size)
+	{
+		(void) size;
+		const float pi = 3.14159265f;
+		const float to_radians = pi / 180.0f;
+		const float pow25_7 = 6103515625.0f; // 25^7
+
+		// Stretch a* so neutral colors get a more perceptual chroma
+		float c1 = std::sqrt(a[1] * a[1] + a[2] * a[2]);
+		float c2 = std::sqrt(b[1] * b[1] + b[2] * b[2]);
+		float c_bar = (c1 + c2) * 0.5f;
+		float c_bar7 = std::pow(c_bar, 7.0f);
+		float g = 0.5f * (1.0f - std::sqrt(c_bar7 / (c_bar7 + pow25_7)));
+		float a1 = (1.0f + g) * a[1];
+		float a2 = (1.0f + g) * b[1];
+
+		float c1_prime = std::sqrt(a1 * a1 + a[2] * a[2]);
+		float c2_prime = std::sqrt(a2 * a2 + b[2] * b[2]);
+		float h1 = (a1 == 0 && a[2] == 0) ? 0 : std::atan2(a[2], a1) / to_radians;
+		float h2 = (a2 == 0 && b[2] == 0) ? 0 : std::atan2(b[2], a2) / to_radians;
+		if (h1 < 0) h1 += 360.0f;
+		if (h2 < 0) h2 += 360.0f;
+
+		// Differences in lightness, chroma and hue
+		float delta_l = b[0] - a[0];
+		float delta_c = c2_prime - c1_prime;
+		float delta_h = 0;
+		bool has_hue = c1_prime * c2_prime != 0;
+		if (has_hue)
+		{
+			delta_h = h2 - h1;
+			if (delta_h > 180.0f) delta_h -= 360.0f;
+			else if (delta_h < -180.0f) delta_h += 360.0f;
+		}
+		float delta_hue = 2.0f * std::sqrt(c1_prime * c2_prime) * std::sin(delta_h * 0.5f * to_radians);
+
+		// Means used by the weighting functions
+		float l_bar = (a[0] + b[0]) * 0.5f;
+		float c_bar_prime = (c1_prime + c2_prime) * 0.5f;
+		float h_bar = h1 + h2;
+		if (has_hue)
+		{
+			if (std::abs(h1 - h2) <= 180.0f) h_bar *= 0.5f;
+			else if (h_bar < 360.0f) h_bar = (h_bar + 360.0f) * 0.5f;
+			else h_bar = (h_bar - 360.0f) * 0.5f;
+		}
+
+		float t = 1.0f
+			- 0.17f * std::cos((h_bar - 30.0f) * to_radians)
+			+ 0.24f * std::cos(2.0f * h_bar * to_radians)
+			+ 0.32f * std::cos((3.0f * h_bar + 6.0f) * to_radians)
+			- 0.20f * std::cos((4.0f * h_bar - 63.0f) * to_radians);
+		float h_offset = (h_bar - 275.0f) / 25.0f;
+		float delta_theta = 30.0f * std::exp(-h_offset * h_offset);
+		float c_bar_prime7 = std::pow(c_bar_prime, 7.0f);
+		float r_c = 2.0f * std::sqrt(c_bar_prime7 / (c_bar_prime7 + pow25_7));
+		float l_offset = (l_bar - 50.0f) * (l_bar - 50.0f);
+		float s_l = 1.0f + 0.015f * l_offset / std::sqrt(20.0f + l_offset);
+		float s_c = 1.0f + 0.045f * c_bar_prime;
+		float s_h = 1.0f + 0.015f * c_bar_prime * t;
+		float r_t = -std::sin(2.0f * delta_theta * to_radians) * r_c;
+
+		float l_term = delta_l / s_l;
+		float c_term = delta_c / s_c;
+		float h_term = delta_hue / s_h;
+		return std::sqrt(l_term * l_term + c_term * c_term + h_term * h_term + r_t * c_term * h_term);
+	}
+};
+
+// Chi-square distance between (normalized) histograms.
+// Buckets that are empty in both histograms are skipped.
+struct ChiSquareDistance
+{
+	static inline float compute(const float* a, const float* b, const int size)
+	{
+		float dist = 0;
+		for (int i = 0; i < size; i += 1)
+		{
+			float diff = a[i] - b[i];
+			float sum = a[i] + b[i];
+			dist += sum > 0 ? diff * diff / sum : 0;
+		}
+		return dist;
+	}
+};
+
+// Histogram intersection turned into a distance: the part of the first histogram that isn't shared
+// with the second one. For normalized histograms that is 1 - intersection per color channel.
+struct HistogramIntersectionDistance
+{
+	static inline float compute(const float* a, const float* b, const int size)
+	{
+		float dist = 0;
+		for (int i = 0; i < size; i += 1)
+		{
+			dist += a[i] - std::min(a[i], b[i]);
+		}
+		return dist;
+	}
+};
+
+// Texture histograms are LTriDP codes folded into uniform patterns: the 58 8-bit codes with at most 2
+// circular 0/1 transitions get a bucket each and every other code shares the last bucket
+const int SDP_TEXTURE_BUCKETS = 59;
+
+// Color distance plus the L1 distance between texture histograms.
+// Features are the average colors followed by SDP_TEXTURE_BUCKETS texture buckets, which are expected
+// to be scaled by the texture weight already so the weight doesn't have to be passed in here.
+template<class ColorDistance>
+struct ColorTextureDistance
+{
+	static inline float compute(const float* a, const float* b, const int size)
+	{
+		const int color_size = size - SDP_TEXTURE_BUCKETS;
+		return ColorDistance::compute(a, b, color_size)
+			+ L1Distance::compute(a + color_size, b + color_size, SDP_TEXTURE_BUCKETS);
+	}
+};
+
+#endif
@@ -103,6 +103,7 @@ Below is the original OpenCV SLIC implementation header.
 #include <cstdlib>
 #include <numeric>
 #include <cassert>
+#include <atomic>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include "sdp_slic.hpp"
@@ -134,6 +135,51 @@ void parallel_reduce(const Range& range, Body& body)
   body(range);
 }
 
+// Most memory the per-band copies of the superpixel stats tables can take up together before the
+// bands add into one shared table with atomics instead (roughly what fits in a shared cache)
+const size_t SDP_PRIVATE_STATS_BYTES = 4 * 1024 * 1024;
+
+// What one pass over the image gathers for every superpixel
+struct SuperpixelStatsSweep
+{
+	// Color histogram buckets per channel, NULL for color sums
+	const int* num_buckets;
+	// Texture code per pixel (counted after the color sums), NULL for none
+	const Mat* texture_codes;
+	// Texture bucket of every code
+	const uchar* texture_buckets;
+	// Histograms only count every n-th pixel of each superpixel, NULL for every pixel
+	const int* sample_steps;
+	// Features per superpixel
+	int feature_size;
+	// Bands of rows worked on in parallel
+	int bands;
+};
+
+// Whether a pixel is on the sampling lattice of a superpixel that counts one in every step pixels.
+// Each row gets one in every step pixels, and the row shift (about step / golden ratio) keeps the
+// picked pixels from lining up into columns.
+static inline bool isSampledPixel(const int step, const int x, const int y)
+{
+	const int row_shift = std::max(1, (int) (step * 0.618f));
+	return (x + (int64) y * row_shift) % step == 0;
+}
+
+// Adds to a table only one band writes to
+static inline void addToTable(float* table, const int index, const float value) { table[index] += value; }
+static inline void addToTable(int* table, const int index, const int value) { table[index] += value; }
+
+// Adds to a table every band writes to
+static inline void addToTable(std::atomic<float>* table, const int index, const float value)
+{
+	float old_value = table[index].load(std::memory_order_relaxed);
+	while (!table[index].compare_exchange_weak(old_value, old_value + value, std::memory_order_relaxed));
+}
+static inline void addToTable(std::atomic<int>* table, const int index, const int value)
+{
+	table[index].fetch_add(value, std::memory_order_relaxed);
+}
+
 class SuperpixelSLICImpl : public SuperpixelSLIC
 {
 public:
@@ -164,10 +210,81 @@ public:
 	//////////////////////////////////////////////////
 
 	// combines similar adjacent superpixels into super-duper-pixels using average colors of superpixels
-	virtual void duperizeWithAverage(const float distance) CV_OVERRIDE;
+	virtual void duperizeWithAverage
+	(
+		const float distance,
+		const bool relabel = true,
+		const int distance_metric = SDP_L1
+	) CV_OVERRIDE;
 
 	// combines similar adjacent superpixels into super-duper-pixels using (normalized) color histograms of superpixels
-	virtual void duperizeWithHistogram(const int num_buckets[], const float distance) CV_OVERRIDE;
+	virtual void duperizeWithHistogram
+	(
+		const int num_buckets[],
+		const float distance,
+		const bool relabel = true,
+		const int distance_metric = SDP_L1,
+		const int max_samples = 0
+	) CV_OVERRIDE;
+
+	// get the estimated error of sampled histograms
+	virtual float getHistogramSamplingError() const CV_OVERRIDE;
+
+	// get the features of the base superpixels
+	virtual void getSuperpixelFeatures( OutputArray features ) const CV_OVERRIDE;
+
+	// combines similar adjacent superpixels into super-duper-pixels using average colors and texture histograms of superpixels
+	virtual void duperizeWithTexture
+	(
+		InputArray texture_codes,
+		const float distance,
+		const float texture_weight = 1.0f,
+		const bool relabel = true,
+		const int distance_metric = SDP_L1
+	) CV_OVERRIDE;
+
+	// builds a nested hierarchy of super-duper-pixels, one level per distance
+	virtual void buildSuperduperpixelPyramid
+	(
+		const std::vector<float>& distances,
+		const int distance_metric = SDP_L1
+	) CV_OVERRIDE;
+
+	// get amount of pyramid levels
+	virtual int getNumberOfPyramidLevels() const CV_OVERRIDE;
+
+	// get amount of super-duper-pixels in a pyramid level
+	virtual int getPyramidLevelSize( int level ) const CV_OVERRIDE;
+
+	// get the labels and contours of a pyramid level
+	virtual void getPyramidLevelLabels
+	(
+		int level,
+		OutputArray labels_out,
+		OutputArray mask = noArray(),
+		OutputArray boundary = noArray(),
+		bool thick_line = true
+	) const CV_OVERRIDE;
+
+	// get the super-duper-pixel of the next pyramid level of each super-duper-pixel of a level
+	virtual void getPyramidLevelParents( int level, OutputArray parents ) const CV_OVERRIDE;
+
+	// get time spent in each stage of the last duperize call
+	virtual DuperizeTimings getDuperizeTimings() const CV_OVERRIDE;
+
+	virtual void resetDuperize() CV_OVERRIDE;
+
+	// get amount of super-duper-pixels
+	virtual int getNumberOfSuperduperpixels() const CV_OVERRIDE;
+
+	// get super-duper-pixel labels, contour mask and / or border pixels in one pass without changing the labels
+	virtual void getSuperduperpixelLabels
+	(
+		OutputArray labels_out,
+		OutputArray mask = noArray(),
+		OutputArray boundary = noArray(),
+		bool thick_line = true
+	) const CV_OVERRIDE;
 
 
 protected:
@@ -230,6 +347,54 @@ private:
     // merge threshold (MSLIC)
     float m_merge;
 
+    // super-duper-pixel of each label in m_klabels
+    // (from the last duperize call, empty if labels aren't waiting to be mapped)
+    vector<int> m_superduperpixel_indexes;
+
+    // super-duper-pixels no
+    int m_numsuperduperpixels;
+
+    // base superpixel labels, kept when m_klabels gets relabeled
+    // with super-duper-pixels (empty if m_klabels has them)
+    Mat m_base_klabels;
+
+    // base superpixels no (while m_base_klabels is kept)
+    int m_base_numlabels;
+
+    // adjacency graph of the base superpixels
+    vector< set<int> > m_superpixel_neighbors;
+
+    // average colors or color histograms of the base
+    // superpixels, one superpixel after another
+    vector<float> m_superpixel_features;
+
+    // pixels in each base superpixel
+    vector<int> m_superpixel_population;
+
+    // what m_superpixel_features holds (AVERAGE,
+    // HISTOGRAM or -1 if nothing is cached)
+    int m_feature_mode;
+
+    // histogram buckets per channel of m_superpixel_features
+    vector<int> m_feature_buckets;
+
+    // max pixels counted per superpixel for the histograms
+    // of m_superpixel_features (0 for every pixel)
+    int m_feature_max_samples;
+
+    // estimated error of the sampled histograms
+    float m_histogram_sampling_error;
+
+    // super-duper-pixel of each base superpixel for
+    // every pyramid level (smallest distance first)
+    vector< vector<int> > m_pyramid_indexes;
+
+    // super-duper-pixels no of every pyramid level
+    vector<int> m_pyramid_counts;
+
+    // time spent in each stage of the last duperize call
+    DuperizeTimings m_duperize_timings;
+
     // initialization
     inline void initialize();
 
@@ -262,134 +427,175 @@ private:
 	inline void findSuperpixelNeighborsAndAverages
 	(
 		vector< set<int> >& superpixel_neighbors,
-		vector< vector<float> >& superpixel_average_colors,
+		vector<float>& superpixel_average_colors,
 		vector<int>& superpixel_population
 	);
 
 	inline void findSuperpixelNeighborsAndHistograms
 	(
 		const int num_buckets[],
+		const int max_samples,
+		vector< set<int> >& superpixel_neighbors,
+		vector<float>& superpixel_color_histograms,
+		vector<int>& superpixel_population
+	);
+
+	inline void findSuperpixelNeighborsAndTextures
+	(
+		const Mat& texture_codes,
+		const float texture_weight,
+		vector< set<int> >& superpixel_neighbors,
+		vector<float>& superpixel_features,
+		vector<int>& superpixel_population
+	);
+
+	inline void findSuperpixelStats
+	(
+		const int num_buckets[],
+		const Mat* texture_codes,
+		const int* sample_steps,
+		const int feature_size,
 		vector< set<int> >& superpixel_neighbors,
-		vector< vector< vector<float> >>& superpixel_color_histograms,
+		vector<float>& superpixel_features,
 		vector<int>& superpixel_population
 	);
 
+	template<class FeatureTable, class PopulationTable>
+	inline void accumulateBandStats
+	(
+		const SuperpixelStatsSweep& sweep,
+		const int band,
+		FeatureTable* superpixel_features,
+		PopulationTable* superpixel_population,
+		vector< std::pair<int, int> >& edges,
+		int64& adjacency_ticks,
+		int64& stats_ticks
+	) const;
+
+	template<class FeatureTable>
 	inline void addColorsToAverages
 	(
-		vector< vector<float> >& superpixel_average_colors,
-		const int current_superpixel,
+		FeatureTable* superpixel_average_colors,
+		const int feature_offset,
 		const int x,
 		const int y
-	);
+	) const;
 
+	template<class FeatureTable>
 	inline void addColorsToHistograms
 	(
 		const int num_buckets[],
-		vector< vector< vector<float> >>& superpixel_color_histograms,
-		const int current_superpixel,
+		FeatureTable* superpixel_color_histograms,
+		const int feature_offset,
 		const int x,
 		const int y
-	);
+	) const;
 
 	inline void linkNeighborSuperpixels
 	(
-		vector< set<int> >& superpixel_neighbors,
+		vector< std::pair<int, int> >& edges,
 		const int current_superpixel,
-		const int x,
-		const int y
-	);
+		const int neighbor
+	) const;
 
-	inline void groupSuperpixels
-	(
-		const float max_distance,
-		const vector< set<int> >& superpixel_neighbors,
-		const vector< vector<float> >& superpixel_average_colors,
-		const vector<int>& superpixel_population,
-		std::list<SuperDuperPixel>& superduperpixels,
-		vector<SuperDuperPixel*>& superduperpixel_pointers,
-		vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators
-	);
+	friend struct SuperpixelStatsInvoker;
+
+	inline void convertAveragesToCIELab(vector<float>& superpixel_features, const int feature_size);
 
+	template<class Distance>
 	inline void groupSuperpixels
 	(
-		const int num_buckets[],
 		const float max_distance,
+		const SuperDuperPixelMode mode,
+		const int feature_size,
 		const vector< set<int> >& superpixel_neighbors,
-		const vector< vector< vector<float> >>& superpixel_color_histograms,
+		const vector<float>& superpixel_features,
 		const vector<int>& superpixel_population,
+		SuperpixelLinks& superpixel_links,
 		std::list<SuperDuperPixel>& superduperpixels,
 		vector<SuperDuperPixel*>& superduperpixel_pointers,
 		vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators
 	);
 
+	template<class Distance>
 	inline float getColorDistance
 	(
-		const std::list<SuperDuperPixel>& superduperpixels,
+		const int feature_size,
 		const vector<SuperDuperPixel*>& superduperpixel_pointers,
-		const vector< vector<float> >& superpixel_average_colors, 
-		vector<float>& average_colors,
+		const vector<float>& superpixel_features,
 		const int superpixel,
 		const int neighbor
 	);
 
-	inline float getColorDistance
+	inline void combineIntoSuperDuperPixel
 	(
-		const int num_buckets[],
-		const std::list<SuperDuperPixel>& superduperpixels,
-		const vector<SuperDuperPixel*>& superduperpixel_pointers,
-		const vector< vector< vector<float> >>& superpixel_color_histograms, 
-		vector< vector<float> >& color_histogram,
+		const SuperDuperPixelMode mode,
+		const int feature_size,
+		SuperpixelLinks& superpixel_links,
+		std::list<SuperDuperPixel>& superduperpixels,
+		vector<SuperDuperPixel*>& superduperpixel_pointers,
+		vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators,
+		const vector<float>& superpixel_features,
+		const vector<int>& superpixel_population,
 		const int superpixel,
 		const int neighbor
 	);
 
-	inline void extractAverageColors
+	inline int indexSuperduperpixels
 	(
-		const vector< vector<float> >& superpixel_average_colors,
-		vector<float>& average_colors,
-		const int superpixel
+		const std::list<SuperDuperPixel>& superduperpixels,
+		vector<int>& superduperpixel_indexes
 	);
 
-	inline void extractColorHistogram
-	(
-		const int num_buckets[],
-		const vector< vector< vector<float> >>& superpixel_color_histograms,
-		vector< vector<float> >& color_histogram,
-		const int superpixel
-	);
+	inline void assignSuperduperpixels(const vector<int>& superduperpixel_indexes);
 
-	inline void combineIntoSuperDuperPixel
+	inline void restoreBaseSuperpixels();
+
+	inline void clearDuperizeCache();
+
+	template<class Distance>
+	inline int duperizeCachedSuperpixels
 	(
-		std::list<SuperDuperPixel>& superduperpixels,
-		vector<SuperDuperPixel*>& superduperpixel_pointers,
-		vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators,
-		const vector< vector<float> >& superpixel_average_colors,
-		const vector<float>& average_colors,
-		const vector<int>& superpixel_population,
-		const int superpixel,
-		const int neighbor
+		const float max_distance,
+		const SuperDuperPixelMode mode,
+		const int feature_size,
+		const vector<float>& superpixel_features,
+		vector<int>& superduperpixel_indexes
 	);
 
-	inline void combineIntoSuperDuperPixel
+	template<class Distance>
+	inline void buildPyramidLevels
 	(
-		const int num_buckets[],
-		std::list<SuperDuperPixel>& superduperpixels,
-		vector<SuperDuperPixel*>& superduperpixel_pointers,
-		vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators,
-		const vector< vector< vector<float> >>& superpixel_color_histograms,
-		const vector< vector<float> >& color_histogram,
-		const vector<int>& superpixel_population,
-		const int superpixel,
-		const int neighbor
+		const vector<float>& distances,
+		const vector<float>& superpixel_features
 	);
 
-	inline int indexSuperduperpixels
+	inline void finishDuperize
 	(
-		const std::list<SuperDuperPixel>& superduperpixels,
-		vector<int>& superduperpixel_indexes
+		vector<int>& superduperpixel_indexes,
+		const int superduperpixel_count,
+		const bool relabel
 	);
 
-	inline void assignSuperduperpixels(const vector<int>& superduperpixel_indexes);
+	inline void getLabelsThroughIndexes
+	(
+		const Mat& superpixel_labels,
+		const vector<int>& superduperpixel_indexes,
+		OutputArray labels_out,
+		OutputArray mask,
+		OutputArray boundary,
+		const bool thick_line
+	) const;
+
+	inline void relabelSuperduperpixels
+	(
+		const Mat& superpixel_labels,
+		const vector<int>& superduperpixel_indexes,
+		Mat* labels_out,
+		Mat* mask,
+		vector<Point>* boundary,
+		const bool thick_line
+	) const;
 
 	//////////////////// Custom Methods ////////////////////
 
@@ -451,6 +657,39 @@ int SuperpixelSLICImpl::getNumberOfSuperpixels() const
     return m_numlabels;
 }
 
+float SuperpixelSLICImpl::getHistogramSamplingError() const
+{
+	return m_histogram_sampling_error;
+}
+
+void SuperpixelSLICImpl::getSuperpixelFeatures( OutputArray features ) const
+{
+	if (m_superpixel_population.empty())
+	{
+		features.release();
+		return;
+	}
+	const int superpixels = (int) m_superpixel_population.size();
+	Mat(superpixels, (int) m_superpixel_features.size() / superpixels, CV_32FC1, (void*) m_superpixel_features.data()).copyTo(features);
+}
+
+DuperizeTimings SuperpixelSLICImpl::getDuperizeTimings() const
+{
+	return m_duperize_timings;
+}
+
+void SuperpixelSLICImpl::resetDuperize()
+{
+	this->restoreBaseSuperpixels();
+	this->clearDuperizeCache();
+}
+
+int SuperpixelSLICImpl::getNumberOfSuperduperpixels() const
+{
+	if (m_superduperpixel_indexes.empty()) return m_numlabels;
+	return m_numsuperduperpixels;
+}
+
 void SuperpixelSLICImpl::initialize()
 {
     // total amount of superpixels given its size as input
@@ -482,6 +721,7 @@ void SuperpixelSLICImpl::initialize()
 
     // update amount of labels now
     m_numlabels = (int)m_kseeds[0].size();
+    clearDuperizeCache();
 
     // perturb seeds given edges
     if (perturbseeds)
@@ -510,6 +750,9 @@ void SuperpixelSLICImpl::iterate( int num_iterations )
 
     // re-update amount of labels
     m_numlabels = (int)m_kseeds[0].size();
+
+    // labels changed, drop any pending super-duper-pixels and cached superpixel stats
+    clearDuperizeCache();
 }
 
 void SuperpixelSLICImpl::getLabels(OutputArray labels_out) const
@@ -767,6 +1010,9 @@ void SuperpixelSLICImpl::enforceLabelConnectivity( int min_element_size )
     m_klabels = nlabels;
     m_numlabels = label;
 
+    // labels changed, drop any pending super-duper-pixels and cached superpixel stats
+    clearDuperizeCache();
+
     m_adaptk.clear();
     m_adaptk = adaptk;
 }
@@ -775,246 +1021,928 @@ void SuperpixelSLICImpl::enforceLabelConnectivity( int min_element_size )
  * Combine adjacent superpixels into super-duper-pixels if they're similar enough in color.
  * Uses average colors of superpixels to determine if they're similar enough in color.
  */
-void SuperpixelSLICImpl::duperizeWithAverage(const float max_distance)
+void SuperpixelSLICImpl::duperizeWithAverage(const float max_distance, const bool relabel, const int distance_metric)
 {
-	// Graph of which superpixels are adjecent to each other
-	// First dimension is each superpixel
-	// Second dimension is index of each neighboring superpixel
-	vector< set<int> > superpixel_neighbors;
+	m_duperize_timings = DuperizeTimings();
 
-	// Average colors of each superpixel
-	// First dimension is each color channel
-	// Second dimension is each superpixel
-	vector< vector<float> > superpixel_average_colors;
+	// Always start from the base superpixels so the threshold can be changed between calls
+	this->restoreBaseSuperpixels();
 
-	// The number of pixels in each superpixel
-	vector<int> superpixel_population;
+	// Find the superpixel graph and average colors unless the last duperize call already did
+	// m_superpixel_neighbors: indexes of the neighboring superpixels of each superpixel
+	// m_superpixel_features: m_nr_channels average colors for each superpixel, back to back
+	// m_superpixel_population: the number of pixels in each superpixel
+	if (m_feature_mode != AVERAGE)
+	{
+		this->findSuperpixelNeighborsAndAverages(m_superpixel_neighbors, m_superpixel_features, m_superpixel_population);
+		m_feature_mode = AVERAGE;
+		m_feature_buckets.clear();
+	}
 
-	this->findSuperpixelNeighborsAndAverages(superpixel_neighbors, superpixel_average_colors, superpixel_population);
+	// Stores which super-duper-pixel each superpixel belong to
+	vector<int> superduperpixel_indexes;
+	int superduperpixel_count = 0;
 
-	std::list<SuperDuperPixel> superduperpixels;
-	vector<SuperDuperPixel*> superduperpixel_pointers;
-	vector<std::list<SuperDuperPixel>::iterator> superduperpixel_iterators;
+	int64 grouping_start = getTickCount();
 
-	this->groupSuperpixels
-	(
-		max_distance,
-		superpixel_neighbors,
-		superpixel_average_colors,
-		superpixel_population,
-		superduperpixels,
-		superduperpixel_pointers,
-		superduperpixel_iterators
-	);
+	// Pick the distance metric once here so the grouping loop gets compiled separately for each metric
+	switch (distance_metric)
+	{
+		case SDP_L1:
+			superduperpixel_count = this->duperizeCachedSuperpixels<L1Distance>
+			(
+				max_distance,
+				AVERAGE,
+				m_nr_channels,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
 
-	// Stores which super-duper-pixel each superpixel belong to
-	// super-duper-pixel value of -1 means it doesn't belong to a superduperpixel yet
-	vector<int> superduperpixel_indexes(m_numlabels, -1);
-	int superduperpixel_count = this->indexSuperduperpixels(superduperpixels, superduperpixel_indexes);
+		case SDP_L2:
+			superduperpixel_count = this->duperizeCachedSuperpixels<L2Distance>
+			(
+				max_distance,
+				AVERAGE,
+				m_nr_channels,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		case SDP_CIEDE2000:
+		{
+			CV_Assert( m_nr_channels == 3 );
+			// Convert a copy so the cached averages stay usable by the other metrics
+			vector<float> cielab_average_colors = m_superpixel_features;
+			this->convertAveragesToCIELab(cielab_average_colors, m_nr_channels);
+			superduperpixel_count = this->duperizeCachedSuperpixels<CIEDE2000Distance>
+			(
+				max_distance,
+				AVERAGE,
+				m_nr_channels,
+				cielab_average_colors,
+				superduperpixel_indexes
+			);
+			break;
+		}
 
-	this->assignSuperduperpixels(superduperpixel_indexes);
+		default:
+			CV_Error( Error::StsBadArg, "Distance metric not supported for average colors" );
+			break;
+	}
+
+	int64 relabel_start = getTickCount();
+	m_duperize_timings.grouping = (relabel_start - grouping_start) * 1000.0 / getTickFrequency();
 
-	m_numlabels = superduperpixel_count;
+	this->finishDuperize(superduperpixel_indexes, superduperpixel_count, relabel);
+	m_duperize_timings.relabel = (getTickCount() - relabel_start) * 1000.0 / getTickFrequency();
 }
 
 /*
  * Combine adjacent superpixels into super-duper-pixels if they're similar enough in color.
  * Uses (normalized) color histograms of superpixels to determine if they're similar enough in color.
  */
-void SuperpixelSLICImpl::duperizeWithHistogram(const int num_buckets[], const float distance)
+void SuperpixelSLICImpl::duperizeWithHistogram
+(
+	const int num_buckets[],
+	const float distance,
+	const bool relabel,
+	const int distance_metric,
+	const int max_samples
+)
 {
-	// Graph of which superpixels are adjecent to each other
-	// First dimension is each superpixel
-	// Second dimension is index of each neighboring superpixel
-	vector< set<int> > superpixel_neighbors(m_numlabels);
+	m_duperize_timings = DuperizeTimings();
+
+	// Always start from the base superpixels so the threshold can be changed between calls
+	this->restoreBaseSuperpixels();
+
+	// Find the superpixel graph and color histograms unless the last duperize call already did
+	// with the same number of buckets and samples
+	// m_superpixel_neighbors: indexes of the neighboring superpixels of each superpixel
+	// m_superpixel_features: the buckets of every color channel back to back for each superpixel
+	// m_superpixel_population: the number of pixels in each superpixel
+	vector<int> buckets(num_buckets, num_buckets + m_nr_channels);
+	if (m_feature_mode != HISTOGRAM || m_feature_buckets != buckets || m_feature_max_samples != max_samples)
+	{
+		this->findSuperpixelNeighborsAndHistograms
+		(
+			num_buckets,
+			max_samples,
+			m_superpixel_neighbors,
+			m_superpixel_features,
+			m_superpixel_population
+		);
+		m_feature_mode = HISTOGRAM;
+		m_feature_buckets = buckets;
+		m_feature_max_samples = max_samples;
+	}
 
-	// The number of pixels in each superpixel
-	vector<int> superpixel_population(m_numlabels, 0);
+	const int histogram_size = std::accumulate(num_buckets, num_buckets + m_nr_channels, 0);
 
-	// Color histograms of each superpixel
-	// First dimension is each color channel
-	// Second dimension is each histogram basket
-	// Third dimension is each superpixel
-	vector< vector< vector<float> >> superpixel_color_histograms;
+	// Stores which super-duper-pixel each superpixel belong to
+	vector<int> superduperpixel_indexes;
+	int superduperpixel_count = 0;
 
-	this->findSuperpixelNeighborsAndHistograms
-	(
-		num_buckets,
-		superpixel_neighbors,
-		superpixel_color_histograms,
-		superpixel_population
-	);
+	int64 grouping_start = getTickCount();
 
-	std::list<SuperDuperPixel> superduperpixels;
-	vector<SuperDuperPixel*> superduperpixel_pointers;
-	vector<std::list<SuperDuperPixel>::iterator> superduperpixel_iterators;
+	// Pick the distance metric once here so the grouping loop gets compiled separately for each metric
+	switch (distance_metric)
+	{
+		case SDP_L1:
+			superduperpixel_count = this->duperizeCachedSuperpixels<L1Distance>
+			(
+				distance,
+				HISTOGRAM,
+				histogram_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		case SDP_L2:
+			superduperpixel_count = this->duperizeCachedSuperpixels<L2Distance>
+			(
+				distance,
+				HISTOGRAM,
+				histogram_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		case SDP_CHI_SQUARE:
+			superduperpixel_count = this->duperizeCachedSuperpixels<ChiSquareDistance>
+			(
+				distance,
+				HISTOGRAM,
+				histogram_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		case SDP_INTERSECTION:
+			superduperpixel_count = this->duperizeCachedSuperpixels<HistogramIntersectionDistance>
+			(
+				distance,
+				HISTOGRAM,
+				histogram_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		default:
+			CV_Error( Error::StsBadArg, "Distance metric not supported for color histograms" );
+			break;
+	}
+
+	int64 relabel_start = getTickCount();
+	m_duperize_timings.grouping = (relabel_start - grouping_start) * 1000.0 / getTickFrequency();
+
+	this->finishDuperize(superduperpixel_indexes, superduperpixel_count, relabel);
+	m_duperize_timings.relabel = (getTickCount() - relabel_start) * 1000.0 / getTickFrequency();
+}
+
+/*
+ * Combine adjacent superpixels into super-duper-pixels if they're similar enough in color and texture.
+ * Uses average colors and texture code histograms of superpixels, found in the same pass over the image.
+ */
+void SuperpixelSLICImpl::duperizeWithTexture
+(
+	InputArray texture_codes,
+	const float distance,
+	const float texture_weight,
+	const bool relabel,
+	const int distance_metric
+)
+{
+	m_duperize_timings = DuperizeTimings();
+
+	Mat codes = texture_codes.getMat();
+	CV_Assert( codes.type() == CV_8UC1 );
+	CV_Assert( codes.rows == m_height && codes.cols == m_width );
 
-	this->groupSuperpixels
+	// Always start from the base superpixels so the threshold can be changed between calls
+	this->restoreBaseSuperpixels();
+
+	// Find the superpixel graph, average colors and texture histograms
+	// The codes can't be told apart from the ones of the last call, so nothing cached is reused
+	// and the features aren't kept for the other duperize methods either
+	// m_superpixel_features: m_nr_channels average colors then SDP_TEXTURE_BUCKETS texture buckets for each superpixel
+	this->findSuperpixelNeighborsAndTextures
 	(
-		num_buckets,
-		distance,
-		superpixel_neighbors,
-		superpixel_color_histograms,
-		superpixel_population,
-		superduperpixels,
-		superduperpixel_pointers,
-		superduperpixel_iterators
+		codes,
+		texture_weight,
+		m_superpixel_neighbors,
+		m_superpixel_features,
+		m_superpixel_population
 	);
-	
+	m_feature_mode = -1;
+	m_feature_buckets.clear();
+
+	const int feature_size = m_nr_channels + SDP_TEXTURE_BUCKETS;
+
 	// Stores which super-duper-pixel each superpixel belong to
-	// super-duper-pixel value of -1 means it doesn't belong to a superduperpixel yet
-	vector<int> superduperpixel_indexes(m_numlabels, -1);
-	int superduperpixel_count = this->indexSuperduperpixels(superduperpixels, superduperpixel_indexes);
+	vector<int> superduperpixel_indexes;
+	int superduperpixel_count = 0;
+
+	int64 grouping_start = getTickCount();
+
+	// Pick the distance metric once here so the grouping loop gets compiled separately for each metric
+	switch (distance_metric)
+	{
+		case SDP_L1:
+			superduperpixel_count = this->duperizeCachedSuperpixels< ColorTextureDistance<L1Distance> >
+			(
+				distance,
+				AVERAGE,
+				feature_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		case SDP_L2:
+			superduperpixel_count = this->duperizeCachedSuperpixels< ColorTextureDistance<L2Distance> >
+			(
+				distance,
+				AVERAGE,
+				feature_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
+
+		case SDP_CIEDE2000:
+			CV_Assert( m_nr_channels == 3 );
+			this->convertAveragesToCIELab(m_superpixel_features, feature_size);
+			superduperpixel_count = this->duperizeCachedSuperpixels< ColorTextureDistance<CIEDE2000Distance> >
+			(
+				distance,
+				AVERAGE,
+				feature_size,
+				m_superpixel_features,
+				superduperpixel_indexes
+			);
+			break;
 
-	this->assignSuperduperpixels(superduperpixel_indexes);
+		default:
+			CV_Error( Error::StsBadArg, "Distance metric not supported for average colors and textures" );
+			break;
+	}
+
+	int64 relabel_start = getTickCount();
+	m_duperize_timings.grouping = (relabel_start - grouping_start) * 1000.0 / getTickFrequency();
 
-	m_numlabels = superduperpixel_count;
+	this->finishDuperize(superduperpixel_indexes, superduperpixel_count, relabel);
+	m_duperize_timings.relabel = (getTickCount() - relabel_start) * 1000.0 / getTickFrequency();
 }
 
-void SuperpixelSLICImpl::findSuperpixelNeighborsAndAverages
-(
-	vector< set<int> >& superpixel_neighbors,
-	vector< vector<float> >& superpixel_average_colors,
-	vector<int>& superpixel_population
-)
+/*
+ * Build one super-duper-pixel lookup table over the base superpixels for each distance.
+ * The superpixel graph and average colors are found (at most) once for all of the levels.
+ */
+void SuperpixelSLICImpl::buildSuperduperpixelPyramid(const std::vector<float>& distances, const int distance_metric)
 {
-	superpixel_neighbors = vector< set<int> >(m_numlabels);
-	superpixel_average_colors = vector< vector<float> >(m_nr_channels, vector<float>(m_numlabels, 0));
-	superpixel_population = vector<int>(m_numlabels, 0);
-	// Loop through each pixel
-	// Find superpixel connections
-	// Get average color of superpixels
-	for (int y = 0; y < m_height; y += 1)
-	for (int x = 0; x < m_width; x += 1)
+	m_duperize_timings = DuperizeTimings();
+
+	// Levels are made over the base superpixels, which stay in m_klabels afterwards
+	this->restoreBaseSuperpixels();
+	m_numsuperduperpixels = m_numlabels;
+
+	if (m_feature_mode != AVERAGE)
 	{
-		int current_superpixel = m_klabels.at<int>(y, x);
-		this->linkNeighborSuperpixels(superpixel_neighbors, current_superpixel, x, y);
-		// Keeps count of the number of pixels in each superpixel (for calculating average color)
-		superpixel_population[current_superpixel] += 1;
-		this->addColorsToAverages(superpixel_average_colors, current_superpixel, x, y);
+		this->findSuperpixelNeighborsAndAverages(m_superpixel_neighbors, m_superpixel_features, m_superpixel_population);
+		m_feature_mode = AVERAGE;
+		m_feature_buckets.clear();
 	}
-	
-	// Loop through each superpixel
-	// Remove superpixels being connected to themselves
-	// Divide each superpixel average color value by the number of pixels in that superpixel to get the actual average
-	for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
+
+	// Smallest distance first so each level is inside the next one
+	vector<float> sorted_distances(distances.begin(), distances.end());
+	std::sort(sorted_distances.begin(), sorted_distances.end());
+
+	int64 grouping_start = getTickCount();
+
+	switch (distance_metric)
 	{
-		superpixel_neighbors[superpixel].erase(superpixel);
-		for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
+		case SDP_L1:
+			this->buildPyramidLevels<L1Distance>(sorted_distances, m_superpixel_features);
+			break;
+
+		case SDP_L2:
+			this->buildPyramidLevels<L2Distance>(sorted_distances, m_superpixel_features);
+			break;
+
+		case SDP_CIEDE2000:
 		{
-			superpixel_average_colors[color_channel][superpixel] /= superpixel_population[superpixel];
+			CV_Assert( m_nr_channels == 3 );
+			// Convert a copy so the cached averages stay usable by the other metrics
+			vector<float> cielab_average_colors = m_superpixel_features;
+			this->convertAveragesToCIELab(cielab_average_colors, m_nr_channels);
+			this->buildPyramidLevels<CIEDE2000Distance>(sorted_distances, cielab_average_colors);
+			break;
 		}
+
+		default:
+			CV_Error( Error::StsBadArg, "Distance metric not supported for average colors" );
+			break;
 	}
+
+	m_duperize_timings.grouping = (getTickCount() - grouping_start) * 1000.0 / getTickFrequency();
 }
 
-void SuperpixelSLICImpl::findSuperpixelNeighborsAndHistograms
+template<class Distance>
+void SuperpixelSLICImpl::buildPyramidLevels
 (
-	const int num_buckets[],
-	vector< set<int> >& superpixel_neighbors,
-	vector< vector< vector<float> >>& superpixel_color_histograms,
-	vector<int>& superpixel_population
+	const vector<float>& distances,
+	const vector<float>& superpixel_features
 )
 {
-	superpixel_neighbors = vector< set<int> >(m_numlabels);
-	superpixel_color_histograms = vector< vector< vector<float> >>(m_nr_channels);
-	for (int channel = 0; channel < m_nr_channels; channel += 1)
+	const int levels = (int) distances.size();
+	m_pyramid_indexes.assign(levels, vector<int>());
+	m_pyramid_counts.assign(levels, 0);
+	for (int level = 0; level < levels; level += 1)
 	{
-		superpixel_color_histograms[channel] = vector< vector<float> >(num_buckets[channel], vector<float>(m_numlabels, 0.0));
+		m_pyramid_counts[level] = this->duperizeCachedSuperpixels<Distance>
+		(
+			distances[level],
+			AVERAGE,
+			m_nr_channels,
+			superpixel_features,
+			m_pyramid_indexes[level]
+		);
 	}
-	superpixel_population = vector<int>(m_numlabels, 0);
+}
+
+int SuperpixelSLICImpl::getNumberOfPyramidLevels() const
+{
+	return (int) m_pyramid_indexes.size();
+}
+
+int SuperpixelSLICImpl::getPyramidLevelSize( int level ) const
+{
+	CV_Assert( level >= 0 && level < (int) m_pyramid_counts.size() );
+	return m_pyramid_counts[level];
+}
+
+void SuperpixelSLICImpl::getPyramidLevelLabels
+(
+	int level,
+	OutputArray labels_out,
+	OutputArray mask,
+	OutputArray boundary,
+	bool thick_line
+) const
+{
+	CV_Assert( level >= 0 && level < (int) m_pyramid_indexes.size() );
+
+	// A duperize call since the pyramid was built may have relabeled m_klabels in place
+	const Mat& superpixel_labels = m_base_klabels.empty() ? m_klabels : m_base_klabels;
+	this->getLabelsThroughIndexes(superpixel_labels, m_pyramid_indexes[level], labels_out, mask, boundary, thick_line);
+}
+
+void SuperpixelSLICImpl::getPyramidLevelParents( int level, OutputArray parents ) const
+{
+	CV_Assert( level >= 0 && level < (int) m_pyramid_indexes.size() - 1 );
+
+	// Any base superpixel of a super-duper-pixel tells which super-duper-pixel of the next level it's in
+	const vector<int>& indexes = m_pyramid_indexes[level];
+	const vector<int>& next_indexes = m_pyramid_indexes[level + 1];
+	vector<int> level_parents(m_pyramid_counts[level], -1);
+	for (int superpixel = 0; superpixel < (int) indexes.size(); superpixel += 1)
+	{
+		level_parents[indexes[superpixel]] = next_indexes[superpixel];
+	}
+	Mat(level_parents).copyTo(parents);
+}
+
+/*
+ * Group the cached base superpixels into super-duper-pixels.
+ * Only works on the superpixel graph, no pixels are visited.
+ */
+template<class Distance>
+int SuperpixelSLICImpl::duperizeCachedSuperpixels
+(
+	const float max_distance,
+	const SuperDuperPixelMode mode,
+	const int feature_size,
+	const vector<float>& superpixel_features,
+	vector<int>& superduperpixel_indexes
+)
+{
+	// Superpixels of every super-duper-pixel live in this one array instead of a vector per group
+	SuperpixelLinks superpixel_links(m_numlabels);
+	std::list<SuperDuperPixel> superduperpixels;
+	vector<SuperDuperPixel*> superduperpixel_pointers;
+	vector<std::list<SuperDuperPixel>::iterator> superduperpixel_iterators;
+
+	this->groupSuperpixels<Distance>
+	(
+		max_distance,
+		mode,
+		feature_size,
+		m_superpixel_neighbors,
+		superpixel_features,
+		m_superpixel_population,
+		superpixel_links,
+		superduperpixels,
+		superduperpixel_pointers,
+		superduperpixel_iterators
+	);
+
+	// super-duper-pixel value of -1 means it doesn't belong to a superduperpixel yet
+	superduperpixel_indexes = vector<int>(m_numlabels, -1);
+	return this->indexSuperduperpixels(superduperpixels, superduperpixel_indexes);
+}
 
-	// Loop through each pixel
+void SuperpixelSLICImpl::findSuperpixelNeighborsAndAverages
+(
+	vector< set<int> >& superpixel_neighbors,
+	vector<float>& superpixel_average_colors,
+	vector<int>& superpixel_population
+)
+{
 	// Find superpixel connections
-	// Get color histograms of superpixels
-	for (int y = 0; y < m_height; y += 1)
-	for (int x = 0; x < m_width; x += 1)
+	// Get the color sums of superpixels
+	this->findSuperpixelStats(NULL, NULL, NULL, m_nr_channels, superpixel_neighbors, superpixel_average_colors, superpixel_population);
+
+	// Loop through each superpixel
+	// Divide each superpixel color sum by the number of pixels in that superpixel to get the actual average
+	int64 totals_start = getTickCount();
+	for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
 	{
-		int current_superpixel = m_klabels.at<int>(y, x);
-		this->linkNeighborSuperpixels(superpixel_neighbors, current_superpixel, x, y);
-		// Keeps count of the number of pixels in each superpixel (for normalizing color histogram values to percentages)
-		superpixel_population[current_superpixel] += 1;
-		this->addColorsToHistograms(num_buckets, superpixel_color_histograms, current_superpixel, x, y);
+		for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
+		{
+			superpixel_average_colors[superpixel * m_nr_channels + color_channel] /= superpixel_population[superpixel];
+		}
 	}
+	m_duperize_timings.stats += (getTickCount() - totals_start) * 1000.0 / getTickFrequency();
+}
+
+void SuperpixelSLICImpl::findSuperpixelNeighborsAndTextures
+(
+	const Mat& texture_codes,
+	const float texture_weight,
+	vector< set<int> >& superpixel_neighbors,
+	vector<float>& superpixel_features,
+	vector<int>& superpixel_population
+)
+{
+	const int feature_size = m_nr_channels + SDP_TEXTURE_BUCKETS;
+
+	// Find superpixel connections
+	// Get the color sums and texture bucket counts of superpixels
+	this->findSuperpixelStats(NULL, &texture_codes, NULL, feature_size, superpixel_neighbors, superpixel_features, superpixel_population);
 
 	// Loop through each superpixel
-	// Remove superpixels being connected to themselves
-	// Divide each superpixel color histogram value by the number of pixels in that superpixel to normalize them into percentages
+	// Turn the color sums into averages and the texture counts into weighted, normalized histograms
+	int64 totals_start = getTickCount();
 	for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
 	{
-		superpixel_neighbors[superpixel].erase(superpixel);
+		float* features = &superpixel_features[superpixel * feature_size];
 		for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
-		for (int bucket = 0; bucket < num_buckets[color_channel]; bucket += 1)
 		{
-			superpixel_color_histograms[color_channel][bucket][superpixel] /= superpixel_population[superpixel];
+			features[color_channel] /= superpixel_population[superpixel];
+		}
+		float* texture_counts = features + m_nr_channels;
+		const float texture_total = std::accumulate(texture_counts, texture_counts + SDP_TEXTURE_BUCKETS, 0.0f);
+		// Superpixels that only cover the image border have no texture and stay all 0
+		if (texture_total == 0) continue;
+		for (int bucket = 0; bucket < SDP_TEXTURE_BUCKETS; bucket += 1)
+		{
+			texture_counts[bucket] = texture_weight * texture_counts[bucket] / texture_total;
 		}
 	}
+	m_duperize_timings.stats += (getTickCount() - totals_start) * 1000.0 / getTickFrequency();
 }
 
-void SuperpixelSLICImpl::linkNeighborSuperpixels
+void SuperpixelSLICImpl::findSuperpixelNeighborsAndHistograms
 (
+	const int num_buckets[],
+	const int max_samples,
 	vector< set<int> >& superpixel_neighbors,
-	const int current_superpixel,
-	const int x,
-	const int y
+	vector<float>& superpixel_color_histograms,
+	vector<int>& superpixel_population
 )
 {
-	// Create connections between adjacent superpixels based on where adjacent pixels are
-	// in different superpixels
-	bool not_left_column = x > 0;
-	bool not_top_row = y > 0;
-	if (not_left_column)
+	const int histogram_size = std::accumulate(num_buckets, num_buckets + m_nr_channels, 0);
+
+	// Only every sample_steps[superpixel]-th pixel of a superpixel gets counted in its histograms
+	// Counting the pixels of each superpixel first only reads the labels, which is cheap next to
+	// finding the buckets of every color channel
+	vector<int> sample_steps;
+	if (max_samples > 0)
 	{
-		int superpixel_to_left = m_klabels.at<int>(y, x - 1);
-		superpixel_neighbors[current_superpixel].insert(superpixel_to_left);
-		superpixel_neighbors[superpixel_to_left].insert(current_superpixel);
+		int64 count_start = getTickCount();
+		vector<int> label_counts(m_numlabels, 0);
+		for (int y = 0; y < m_height; y += 1)
+		{
+			const int* row = m_klabels.ptr<int>(y);
+			for (int x = 0; x < m_width; x += 1)
+			{
+				label_counts[row[x]] += 1;
+			}
+		}
+		sample_steps = vector<int>(m_numlabels, 1);
+		for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
+		{
+			sample_steps[superpixel] = std::max(1, (label_counts[superpixel] + max_samples - 1) / max_samples);
+		}
+		m_duperize_timings.stats += (getTickCount() - count_start) * 1000.0 / getTickFrequency();
 	}
-	if (not_top_row)
+
+	// Find superpixel connections
+	// Get the color histogram counts of superpixels
+	this->findSuperpixelStats
+	(
+		num_buckets,
+		NULL,
+		max_samples > 0 ? sample_steps.data() : NULL,
+		histogram_size,
+		superpixel_neighbors,
+		superpixel_color_histograms,
+		superpixel_population
+	);
+
+	// Loop through each superpixel
+	// Divide each superpixel color histogram value by the number of pixels counted in that superpixel to normalize them into percentages
+	// Add up how far off the sampled histograms are expected to be
+	int64 totals_start = getTickCount();
+	double sampling_error = 0;
+	for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
 	{
-		int superpixel_above = m_klabels.at<int>(y - 1, x);
-		superpixel_neighbors[current_superpixel].insert(superpixel_above);
-		superpixel_neighbors[superpixel_above].insert(current_superpixel);
+		float* histograms = &superpixel_color_histograms[superpixel * histogram_size];
+		// Every counted pixel is in one bucket of the first color channel
+		const float samples = std::accumulate(histograms, histograms + num_buckets[0], 0.0f);
+		// Superpixels too thin to touch the sampling lattice keep empty histograms
+		if (samples == 0) continue;
+		for (int bucket = 0; bucket < histogram_size; bucket += 1)
+		{
+			histograms[bucket] /= samples;
+		}
+
+		const float population = (float) superpixel_population[superpixel];
+		if (samples >= population) continue;
+		// Expected absolute error of each bucket (normal approximation of sampling without replacement)
+		const float finite_population = (population - samples) / (population - 1);
+		for (int bucket = 0; bucket < histogram_size; bucket += 1)
+		{
+			const float p = histograms[bucket];
+			sampling_error += std::sqrt(0.63662f * p * (1 - p) / samples * finite_population);
+		}
 	}
+	m_histogram_sampling_error = m_numlabels > 0 ? (float) (sampling_error / m_numlabels) : 0;
+	m_duperize_timings.stats += (getTickCount() - totals_start) * 1000.0 / getTickFrequency();
 }
 
-void SuperpixelSLICImpl::addColorsToAverages
+/*
+ * Texture bucket of every 8-bit code: uniform patterns (at most 2 circular 0/1 transitions) get
+ * buckets 0 to 57 in code order, every other code goes in bucket 58.
+ */
+static vector<uchar> makeUniformTextureBuckets()
+{
+	vector<uchar> texture_buckets(256);
+	int next_bucket = 0;
+	for (int code = 0; code < 256; code += 1)
+	{
+		int rotated = ((code << 1) | (code >> 7)) & 255;
+		int transitions = 0;
+		for (int bits = code ^ rotated; bits != 0; bits &= bits - 1)
+		{
+			transitions += 1;
+		}
+		texture_buckets[code] = (uchar) (transitions <= 2 ? next_bucket++ : SDP_TEXTURE_BUCKETS - 1);
+	}
+	return texture_buckets;
+}
+
+struct SuperpixelStatsInvoker : ParallelLoopBody
+{
+	SuperpixelStatsInvoker
+	(
+		const SuperpixelSLICImpl* _slic,
+		const SuperpixelStatsSweep* _sweep,
+		vector<float*>* _band_features,
+		vector<int*>* _band_population,
+		std::atomic<float>* _shared_features,
+		std::atomic<int>* _shared_population,
+		vector< vector< std::pair<int, int> > >* _band_edges,
+		vector<int64>* _band_adjacency_ticks,
+		vector<int64>* _band_stats_ticks
+	)
+	{
+		slic = _slic;
+		sweep = _sweep;
+		band_features = _band_features;
+		band_population = _band_population;
+		shared_features = _shared_features;
+		shared_population = _shared_population;
+		band_edges = _band_edges;
+		band_adjacency_ticks = _band_adjacency_ticks;
+		band_stats_ticks = _band_stats_ticks;
+	}
+
+	void operator ()(const cv::Range& range) const CV_OVERRIDE
+	{
+		for (int band = range.start; band < range.end; band += 1)
+		{
+			// Bands either add into their own partial tables or all add into the shared (atomic) ones
+			if (shared_features != NULL)
+			{
+				slic->accumulateBandStats
+				(
+					*sweep,
+					band,
+					shared_features,
+					shared_population,
+					(*band_edges)[band],
+					(*band_adjacency_ticks)[band],
+					(*band_stats_ticks)[band]
+				);
+			}
+			else
+			{
+				slic->accumulateBandStats
+				(
+					*sweep,
+					band,
+					(*band_features)[band],
+					(*band_population)[band],
+					(*band_edges)[band],
+					(*band_adjacency_ticks)[band],
+					(*band_stats_ticks)[band]
+				);
+			}
+		}
+	}
+
+	const SuperpixelSLICImpl* slic;
+	const SuperpixelStatsSweep* sweep;
+	vector<float*>* band_features;
+	vector<int*>* band_population;
+	std::atomic<float>* shared_features;
+	std::atomic<int>* shared_population;
+	vector< vector< std::pair<int, int> > >* band_edges;
+	vector<int64>* band_adjacency_ticks;
+	vector<int64>* band_stats_ticks;
+};
+
+/*
+ * Find the superpixel graph plus the feature sums and pixel counts of every superpixel in one pass
+ * over the image, split into bands of rows that are worked on in parallel.
+ * With few superpixels each band adds into its own copy of the tables and the copies are added up at
+ * the end. Once the copies of all bands wouldn't fit in cache anymore, the bands add into one shared
+ * table with atomics instead (with that many superpixels, bands rarely hit the same entries).
+ */
+void SuperpixelSLICImpl::findSuperpixelStats
 (
-	vector< vector<float> >& superpixel_average_colors,
+	const int num_buckets[],
+	const Mat* texture_codes,
+	const int* sample_steps,
+	const int feature_size,
+	vector< set<int> >& superpixel_neighbors,
+	vector<float>& superpixel_features,
+	vector<int>& superpixel_population
+)
+{
+	static const vector<uchar> texture_buckets = makeUniformTextureBuckets();
+
+	SuperpixelStatsSweep sweep;
+	sweep.num_buckets = num_buckets;
+	sweep.texture_codes = texture_codes;
+	sweep.texture_buckets = texture_buckets.data();
+	sweep.sample_steps = sample_steps;
+	sweep.feature_size = feature_size;
+	sweep.bands = std::max(1, std::min(getNumThreads(), m_height));
+
+	const size_t table_size = (size_t) m_numlabels * feature_size;
+	const size_t private_tables_bytes = (size_t) sweep.bands * m_numlabels * (feature_size * sizeof(float) + sizeof(int));
+	const bool shared_tables = sweep.bands > 1 && private_tables_bytes > SDP_PRIVATE_STATS_BYTES;
+
+	superpixel_features = vector<float>(table_size, 0);
+	superpixel_population = vector<int>(m_numlabels, 0);
+
+	// Band 0 adds straight into the output tables, the others get their own partial tables
+	vector< vector<float> > partial_features;
+	vector< vector<int> > partial_population;
+	vector<float*> band_features(sweep.bands, NULL);
+	vector<int*> band_population(sweep.bands, NULL);
+	vector< std::atomic<float> > shared_features;
+	vector< std::atomic<int> > shared_population;
+	if (shared_tables)
+	{
+		shared_features = vector< std::atomic<float> >(table_size);
+		shared_population = vector< std::atomic<int> >(m_numlabels);
+	}
+	else
+	{
+		partial_features.resize(sweep.bands - 1, vector<float>(table_size, 0));
+		partial_population.resize(sweep.bands - 1, vector<int>(m_numlabels, 0));
+		band_features[0] = superpixel_features.data();
+		band_population[0] = superpixel_population.data();
+		for (int band = 1; band < sweep.bands; band += 1)
+		{
+			band_features[band] = partial_features[band - 1].data();
+			band_population[band] = partial_population[band - 1].data();
+		}
+	}
+
+	vector< vector< std::pair<int, int> > > band_edges(sweep.bands);
+	vector<int64> band_adjacency_ticks(sweep.bands, 0);
+	vector<int64> band_stats_ticks(sweep.bands, 0);
+
+	int64 sweep_start = getTickCount();
+	parallel_for_
+	(
+		Range(0, sweep.bands),
+		SuperpixelStatsInvoker
+		(
+			this,
+			&sweep,
+			&band_features,
+			&band_population,
+			shared_tables ? shared_features.data() : NULL,
+			shared_tables ? shared_population.data() : NULL,
+			&band_edges,
+			&band_adjacency_ticks,
+			&band_stats_ticks
+		)
+	);
+	int64 sweep_ticks = getTickCount() - sweep_start;
+
+	// Add up the tables of the bands
+	int64 merge_start = getTickCount();
+	if (shared_tables)
+	{
+		for (size_t feature = 0; feature < table_size; feature += 1)
+		{
+			superpixel_features[feature] = shared_features[feature].load(std::memory_order_relaxed);
+		}
+		for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
+		{
+			superpixel_population[superpixel] = shared_population[superpixel].load(std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		for (int band = 1; band < sweep.bands; band += 1)
+		{
+			const float* features = band_features[band];
+			const int* population = band_population[band];
+			for (size_t feature = 0; feature < table_size; feature += 1)
+			{
+				superpixel_features[feature] += features[feature];
+			}
+			for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
+			{
+				superpixel_population[superpixel] += population[superpixel];
+			}
+		}
+	}
+	int64 stats_merge_ticks = getTickCount() - merge_start;
+
+	// Connect the superpixels found next to each other by every band (edges are already unique within a band)
+	int64 link_start = getTickCount();
+	superpixel_neighbors = vector< set<int> >(m_numlabels);
+	for (const vector< std::pair<int, int> >& edges : band_edges)
+	{
+		for (const std::pair<int, int>& edge : edges)
+		{
+			superpixel_neighbors[edge.first].insert(edge.second);
+			superpixel_neighbors[edge.second].insert(edge.first);
+		}
+	}
+	int64 link_ticks = getTickCount() - link_start;
+
+	// The bands run at the same time, so split the time of the sweep between both stages by how long
+	// the bands spent on each
+	int64 adjacency_ticks = std::accumulate(band_adjacency_ticks.begin(), band_adjacency_ticks.end(), (int64) 0);
+	int64 stats_ticks = std::accumulate(band_stats_ticks.begin(), band_stats_ticks.end(), (int64) 0);
+	double adjacency_share = adjacency_ticks + stats_ticks > 0 ? (double) adjacency_ticks / (adjacency_ticks + stats_ticks) : 0;
+	m_duperize_timings.adjacency = (sweep_ticks * adjacency_share + link_ticks) * 1000.0 / getTickFrequency();
+	m_duperize_timings.stats = (sweep_ticks * (1 - adjacency_share) + stats_merge_ticks) * 1000.0 / getTickFrequency();
+}
+
+template<class FeatureTable, class PopulationTable>
+void SuperpixelSLICImpl::accumulateBandStats
+(
+	const SuperpixelStatsSweep& sweep,
+	const int band,
+	FeatureTable* superpixel_features,
+	PopulationTable* superpixel_population,
+	vector< std::pair<int, int> >& edges,
+	int64& adjacency_ticks,
+	int64& stats_ticks
+) const
+{
+	const int band_start = (int) ((int64) m_height * band / sweep.bands);
+	const int band_end = (int) ((int64) m_height * (band + 1) / sweep.bands);
+
+	// Loop through each row of pixels in the band
+	// Find superpixel connections
+	// Add up the features of superpixels
+	// Both are done one row at a time (while the row is still in cache) so each can be timed on its own
+	for (int y = band_start; y < band_end; y += 1)
+	{
+		const int* row = m_klabels.ptr<int>(y);
+		// The row above can be in the band before this one, it's only read
+		const int* row_above = y > 0 ? m_klabels.ptr<int>(y - 1) : NULL;
+
+		int64 row_start = getTickCount();
+		for (int x = 0; x < m_width; x += 1)
+		{
+			// Only pixels next to a pixel of another superpixel connect anything
+			if (x > 0 && row[x - 1] != row[x])
+				this->linkNeighborSuperpixels(edges, row[x], row[x - 1]);
+			if (row_above != NULL && row_above[x] != row[x])
+				this->linkNeighborSuperpixels(edges, row[x], row_above[x]);
+		}
+
+		int64 row_linked = getTickCount();
+		const uchar* row_codes = sweep.texture_codes != NULL ? sweep.texture_codes->ptr<uchar>(y) : NULL;
+		const bool border_row = y == 0 || y == m_height - 1;
+		for (int x = 0; x < m_width; x += 1)
+		{
+			const int current_superpixel = row[x];
+			const int feature_offset = current_superpixel * sweep.feature_size;
+			// Keeps count of the number of pixels in each superpixel (for averaging / normalizing)
+			addToTable(superpixel_population, current_superpixel, 1);
+			if (sweep.num_buckets == NULL)
+				this->addColorsToAverages(superpixel_features, feature_offset, x, y);
+			else if (sweep.sample_steps == NULL || isSampledPixel(sweep.sample_steps[current_superpixel], x, y))
+				this->addColorsToHistograms(sweep.num_buckets, superpixel_features, feature_offset, x, y);
+			// Texture buckets come after the average colors, codes on the image border are undefined
+			if (row_codes != NULL && !border_row && x > 0 && x < m_width - 1)
+				addToTable(superpixel_features, feature_offset + m_nr_channels + sweep.texture_buckets[row_codes[x]], 1.0f);
+		}
+
+		adjacency_ticks += row_linked - row_start;
+		stats_ticks += getTickCount() - row_linked;
+	}
+
+	// Each superpixel border is crossed by many pixels, only keep every connection once
+	std::sort(edges.begin(), edges.end());
+	edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+}
+
+void SuperpixelSLICImpl::linkNeighborSuperpixels
+(
+	vector< std::pair<int, int> >& edges,
 	const int current_superpixel,
+	const int neighbor
+) const
+{
+	// Create a connection between adjacent superpixels, smallest index first so both directions match
+	std::pair<int, int> edge = current_superpixel < neighbor
+		? std::make_pair(current_superpixel, neighbor)
+		: std::make_pair(neighbor, current_superpixel);
+	// Neighboring pixels along a border mostly give the connection just made
+	if (edges.empty() || edges.back() != edge)
+		edges.push_back(edge);
+}
+
+template<class FeatureTable>
+void SuperpixelSLICImpl::addColorsToAverages
+(
+	FeatureTable* superpixel_average_colors,
+	const int feature_offset,
 	const int x,
 	const int y
-)
+) const
 {
-	// Get average colors and color histograms for each superpixel
+	// Add the colors of the pixel to the color sums of its superpixel
 	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
 	{
 		switch ( m_chvec[0].depth() )
 		{
 			case CV_8U:
-				superpixel_average_colors[color_channel][current_superpixel] += m_chvec[color_channel].at<uchar>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<uchar>(y, x));
 				break;
 
 			case CV_8S:
-				superpixel_average_colors[color_channel][current_superpixel] += m_chvec[color_channel].at<char>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<char>(y, x));
 				break;
 
 			case CV_16U:
-				superpixel_average_colors[color_channel][current_superpixel] += m_chvec[color_channel].at<ushort>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<ushort>(y, x));
 				break;
 
 			case CV_16S:
-				superpixel_average_colors[color_channel][current_superpixel] += m_chvec[color_channel].at<short>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<short>(y, x));
 				break;
 
 			case CV_32S:
-				superpixel_average_colors[color_channel][current_superpixel] += m_chvec[color_channel].at<int>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<int>(y, x));
 				break;
 
 			case CV_32F:
-				superpixel_average_colors[color_channel][current_superpixel] += m_chvec[color_channel].at<float>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<float>(y, x));
 				break;
 
 			case CV_64F:
-				superpixel_average_colors[color_channel][current_superpixel] += (float) m_chvec[color_channel].at<double>(y, x);
+				addToTable(superpixel_average_colors, feature_offset + color_channel, (float) m_chvec[color_channel].at<double>(y, x));
 				break;
 
 			default:
@@ -1024,15 +1952,18 @@ void SuperpixelSLICImpl::addColorsToAverages
 	}
 }
 
+template<class FeatureTable>
 void SuperpixelSLICImpl::addColorsToHistograms
 (
 	const int num_buckets[],
-	vector< vector< vector<float> >>& superpixel_color_histograms,
-	const int current_superpixel,
+	FeatureTable* superpixel_color_histograms,
+	const int feature_offset,
 	const int x,
 	const int y
-)
+) const
 {
+	// Where the histogram of the current color channel starts
+	int bucket_offset = feature_offset;
 	// Get color histograms for each superpixel
 	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
 	{
@@ -1101,76 +2032,36 @@ void SuperpixelSLICImpl::addColorsToHistograms
 				CV_Error( Error::StsInternal, "Invalid matrix depth" );
 				break;
 		}
-		superpixel_color_histograms[color_channel][bucket_index][current_superpixel] += 1;
+		addToTable(superpixel_color_histograms, bucket_offset + bucket_index, 1.0f);
+		bucket_offset += num_buckets[color_channel];
 	}
 }
 
-void SuperpixelSLICImpl::groupSuperpixels
-(
-	const float max_distance,
-	const vector< set<int> >& superpixel_neighbors,
-	const vector< vector<float> >& superpixel_average_colors,
-	const vector<int>& superpixel_population,
-	std::list<SuperDuperPixel>& superduperpixels,
-	vector<SuperDuperPixel*>& superduperpixel_pointers,
-	vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators
-)
+/*
+ * Rescale 8-bit OpenCV Lab average colors (L * 255 / 100, a + 128, b + 128) into real CIELAB values
+ * so the CIEDE2000 distance works on them. Float images are already in CIELAB units.
+ */
+void SuperpixelSLICImpl::convertAveragesToCIELab(vector<float>& superpixel_features, const int feature_size)
 {
-	superduperpixel_pointers = vector<SuperDuperPixel*>(m_numlabels, NULL);
-	superduperpixel_iterators = vector<std::list<SuperDuperPixel>::iterator>(m_numlabels, superduperpixels.end());
-	// Loop through each superpixel
-	// Group them together based on distances between average colors
+	if (m_chvec[0].depth() != CV_8U) return;
+
+	// The average colors are the first 3 features of each superpixel
 	for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
 	{
-		vector<float> average_colors(m_nr_channels);
-		this->extractAverageColors(superpixel_average_colors, average_colors, superpixel);
-		for (int neighbor: superpixel_neighbors[superpixel])
-		{
-			// Don't try to group together superpixels that are already grouped together
-			if (superduperpixel_pointers[neighbor] == superduperpixel_pointers[superpixel] && superduperpixel_pointers[neighbor] != NULL)
-			continue;
-
-			float neighbor_distance = this->getColorDistance
-			(
-				superduperpixels,
-				superduperpixel_pointers,
-				superpixel_average_colors,
-				average_colors,
-				superpixel,
-				neighbor
-			);
-
-			if (neighbor_distance < max_distance)
-			{
-				this->combineIntoSuperDuperPixel
-				(
-					superduperpixels,
-					superduperpixel_pointers,
-					superduperpixel_iterators,
-					superpixel_average_colors,
-					average_colors,
-					superpixel_population,
-					superpixel,
-					neighbor
-				);
-			}
-		}
-
-		if (superduperpixel_pointers[superpixel] == NULL)
-		{
-			superduperpixels.push_back(SuperDuperPixel(superpixel, average_colors, superpixel_population[superpixel]));
-			superduperpixel_pointers[superpixel] = &superduperpixels.back();
-		}
+		CIEDE2000Distance::from8BitLab(&superpixel_features[superpixel * feature_size]);
 	}
 }
 
+template<class Distance>
 void SuperpixelSLICImpl::groupSuperpixels
 (
-	const int num_buckets[],
 	const float max_distance,
+	const SuperDuperPixelMode mode,
+	const int feature_size,
 	const vector< set<int> >& superpixel_neighbors,
-	const vector< vector< vector<float> >>& superpixel_color_histograms,
+	const vector<float>& superpixel_features,
 	const vector<int>& superpixel_population,
+	SuperpixelLinks& superpixel_links,
 	std::list<SuperDuperPixel>& superduperpixels,
 	vector<SuperDuperPixel*>& superduperpixel_pointers,
 	vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators
@@ -1179,25 +2070,20 @@ void SuperpixelSLICImpl::groupSuperpixels
 	superduperpixel_pointers = vector<SuperDuperPixel*>(m_numlabels, NULL);
 	superduperpixel_iterators = vector<std::list<SuperDuperPixel>::iterator>(m_numlabels, superduperpixels.end());
 	// Loop through each superpixel
-	// Group them together based on distances between average colors
+	// Group them together based on distances between colors
 	for (int superpixel = 0; superpixel < m_numlabels; superpixel += 1)
 	{
-		vector< vector<float> > color_histogram(m_nr_channels);
-		this->extractColorHistogram(num_buckets, superpixel_color_histograms, color_histogram, superpixel);
-		
 		for (int neighbor: superpixel_neighbors[superpixel])
 		{
 			// Don't try to group together superpixels that are already grouped together
 			if (superduperpixel_pointers[neighbor] == superduperpixel_pointers[superpixel] && superduperpixel_pointers[neighbor] != NULL)
 			continue;
 
-			float neighbor_distance = this->getColorDistance
+			float neighbor_distance = this->getColorDistance<Distance>
 			(
-				num_buckets,
-				superduperpixels,
+				feature_size,
 				superduperpixel_pointers,
-				superpixel_color_histograms,
-				color_histogram,
+				superpixel_features,
 				superpixel,
 				neighbor
 			);
@@ -1206,12 +2092,13 @@ void SuperpixelSLICImpl::groupSuperpixels
 			{
 				this->combineIntoSuperDuperPixel
 				(
-					num_buckets,
+					mode,
+					feature_size,
+					superpixel_links,
 					superduperpixels,
 					superduperpixel_pointers,
 					superduperpixel_iterators,
-					superpixel_color_histograms,
-					color_histogram,
+					superpixel_features,
 					superpixel_population,
 					superpixel,
 					neighbor
@@ -1221,128 +2108,58 @@ void SuperpixelSLICImpl::groupSuperpixels
 
 		if (superduperpixel_pointers[superpixel] == NULL)
 		{
-			superduperpixels.push_back(SuperDuperPixel(superpixel, color_histogram, superpixel_population[superpixel]));
+			const float* features = &superpixel_features[superpixel * feature_size];
+			superduperpixels.push_back(SuperDuperPixel(superpixel, features, feature_size, superpixel_population[superpixel], mode, &superpixel_links));
 			superduperpixel_pointers[superpixel] = &superduperpixels.back();
+			// Later superpixels can still merge into this one, which erases it through its iterator
+			superduperpixel_iterators[superpixel] = --superduperpixels.end();
 		}
 	}
 }
 
+template<class Distance>
 float SuperpixelSLICImpl::getColorDistance
 (
-	const std::list<SuperDuperPixel>& superduperpixels,
-	const vector<SuperDuperPixel*>& superduperpixel_pointers,
-	const vector< vector<float> >& superpixel_average_colors,
-	vector<float>& average_colors,
-	const int superpixel,
-	const int neighbor
-)
-{
-	// TODO: Fix this
-	// if (superduperpixel_pointers[neighbor] != NULL)
-	// 	return (*superduperpixel_pointers[neighbor]).distance_from(average_colors);
-
-	float neighbor_distance = 0;
-	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
-	{
-		float difference = superpixel_average_colors[color_channel][superpixel] - superpixel_average_colors[color_channel][neighbor];
-		// opencv slic algorithm square diff before adding it to dist.
-		// neighbor_distance += difference * difference;
-		// Just take absolute value to do mahnattan distance instead.
-		neighbor_distance += abs(difference);
-	}
-	// Just use manhattan distance here.
-	// Could do this to be more precise (euclidian distance, would also need to square the diff above), but OpenCV
-	// SLIC algorithm doesn't use it either.
-	// neighbor_distance = sqrt(neighbor_distance);
-	return neighbor_distance;
-}
-
-float SuperpixelSLICImpl::getColorDistance
-(
-	const int num_buckets[],
-	const std::list<SuperDuperPixel>& superduperpixels,
+	const int feature_size,
 	const vector<SuperDuperPixel*>& superduperpixel_pointers,
-	const vector< vector< vector<float> >>& superpixel_color_histograms, 
-	vector< vector<float> >& color_histogram,
+	const vector<float>& superpixel_features,
 	const int superpixel,
 	const int neighbor
 )
 {
-	// TODO: Fix this
-	// if (superduperpixel_pointers[neighbor] != NULL)
-	// 	return (*superduperpixel_pointers[neighbor]).distance_from(color_histogram);
-
-	float neighbor_distance = 0;
-	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
-	for (int bucket = 0; bucket < num_buckets[color_channel]; bucket += 1)
-	{
-		float difference = superpixel_color_histograms[color_channel][bucket][superpixel] - superpixel_color_histograms[color_channel][bucket][neighbor];
-		// opencv slic algorithm square diff before adding it to dist.
-		// neighbor_distance += difference * difference;
-		// Just take absolute value to do mahnattan distance instead.
-		neighbor_distance += abs(difference);
-	}
-	// Just use manhattan distance here.
-	// Could do this to be more precise (euclidian distance, would also need to square the diff above), but OpenCV
-	// SLIC algorithm doesn't use it either.
-	// neighbor_distance = sqrt(neighbor_distance);
-	return neighbor_distance;
-}
-
-void SuperpixelSLICImpl::extractAverageColors
-(
-	const vector< vector<float> >& superpixel_average_colors,
-	vector<float>& average_colors,
-	const int superpixel
-)
-{
-	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
-	{
-		average_colors[color_channel] = superpixel_average_colors[color_channel][superpixel];
-	}
-}
-
-void SuperpixelSLICImpl::extractColorHistogram
-(
-	const int num_buckets[],
-	const vector< vector< vector<float> >>& superpixel_color_histograms,
-	vector< vector<float> >& color_histogram,
-	const int superpixel
-)
-{
-	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
-	{
-		color_histogram[color_channel] = vector<float>(num_buckets[color_channel]);
-		for (int bucket = 0; bucket < num_buckets[color_channel]; bucket += 1)
-		{
-			color_histogram[color_channel][bucket] = superpixel_color_histograms[color_channel][bucket][superpixel];
-		}
-	}
+	return Distance::compute
+	(
+		&superpixel_features[superpixel * feature_size],
+		&superpixel_features[neighbor * feature_size],
+		feature_size
+	);
 }
 
 void SuperpixelSLICImpl::combineIntoSuperDuperPixel
 (
+	const SuperDuperPixelMode mode,
+	const int feature_size,
+	SuperpixelLinks& superpixel_links,
 	std::list<SuperDuperPixel>& superduperpixels,
 	vector<SuperDuperPixel*>& superduperpixel_pointers,
 	vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators,
-	const vector< vector<float> >& superpixel_average_colors,
-	const vector<float>& average_colors,
+	const vector<float>& superpixel_features,
 	const vector<int>& superpixel_population,
 	const int superpixel,
 	const int neighbor
 )
 {
+	const float* features = &superpixel_features[superpixel * feature_size];
+	const float* neighbor_features = &superpixel_features[neighbor * feature_size];
 	if (superduperpixel_pointers[neighbor] == NULL)
 	{
 		if (superduperpixel_pointers[superpixel] == NULL)
 		{
-			superduperpixels.push_back(SuperDuperPixel(superpixel, average_colors, superpixel_population[superpixel]));
+			superduperpixels.push_back(SuperDuperPixel(superpixel, features, feature_size, superpixel_population[superpixel], mode, &superpixel_links));
 			superduperpixel_pointers[superpixel] = &superduperpixels.back();
 			superduperpixel_iterators[superpixel] = --superduperpixels.end();
 		}
-		vector<float> neighbor_average_colors(m_nr_channels);
-		this->extractAverageColors(superpixel_average_colors, neighbor_average_colors, neighbor);
-		superduperpixel_pointers[superpixel]->add_superpixel(neighbor, neighbor_average_colors, superpixel_population[neighbor]);
+		superduperpixel_pointers[superpixel]->add_superpixel(neighbor, neighbor_features, superpixel_population[neighbor]);
 		superduperpixel_pointers[neighbor] = superduperpixel_pointers[superpixel];
 		superduperpixel_iterators[neighbor] = superduperpixel_iterators[superpixel];
 	}
@@ -1350,100 +2167,283 @@ void SuperpixelSLICImpl::combineIntoSuperDuperPixel
 	{
 		if (superduperpixel_pointers[superpixel] == NULL)
 		{
-			superduperpixel_pointers[neighbor]->add_superpixel(superpixel, average_colors, superpixel_population[superpixel]);
+			superduperpixel_pointers[neighbor]->add_superpixel(superpixel, features, superpixel_population[superpixel]);
 			superduperpixel_pointers[superpixel] = superduperpixel_pointers[neighbor];
 			superduperpixel_iterators[superpixel] = superduperpixel_iterators[neighbor];
 		}
 		else
 		{
-			std::list<SuperDuperPixel>::iterator merging_superduperpixel = superduperpixel_iterators[neighbor];
-			(*superduperpixel_pointers[superpixel]) += superduperpixel_pointers[neighbor];
-			for (int connected_neighbor : superduperpixel_pointers[neighbor]->get_superpixels())
+			// Merge the smaller super-duper-pixel into the larger one, so only the superpixels of the smaller
+			// one are repointed and every superpixel is repointed O(log n) times over all the merges
+			int kept = superpixel;
+			int merged = neighbor;
+			if (superduperpixel_pointers[merged]->get_superpixels().size() > superduperpixel_pointers[kept]->get_superpixels().size())
+			{
+				std::swap(kept, merged);
+			}
+			std::list<SuperDuperPixel>::iterator merging_superduperpixel = superduperpixel_iterators[merged];
+			SuperDuperPixel* merging_pointer = superduperpixel_pointers[merged];
+			SuperDuperPixel* kept_pointer = superduperpixel_pointers[kept];
+			std::list<SuperDuperPixel>::iterator kept_superduperpixel = superduperpixel_iterators[kept];
+			// Point the superpixels of the merging super-duper-pixel at the kept one before its list is joined on
+			for (int connected_neighbor : merging_pointer->get_superpixels())
 			{
-				superduperpixel_pointers[connected_neighbor] = superduperpixel_pointers[superpixel];
-				superduperpixel_iterators[connected_neighbor] = superduperpixel_iterators[superpixel];
+				superduperpixel_pointers[connected_neighbor] = kept_pointer;
+				superduperpixel_iterators[connected_neighbor] = kept_superduperpixel;
 			}
+			(*kept_pointer) += merging_pointer;
 			superduperpixels.erase(merging_superduperpixel);
 		}
 	}
 }
 
-void SuperpixelSLICImpl::combineIntoSuperDuperPixel
+int SuperpixelSLICImpl::indexSuperduperpixels
 (
-	const int num_buckets[],
-	std::list<SuperDuperPixel>& superduperpixels,
-	vector<SuperDuperPixel*>& superduperpixel_pointers,
-	vector<std::list<SuperDuperPixel>::iterator>& superduperpixel_iterators,
-	const vector< vector< vector<float> >>& superpixel_color_histograms,
-	const vector< vector<float> >& color_histogram,
-	const vector<int>& superpixel_population,
-	const int superpixel,
-	const int neighbor
+	const std::list<SuperDuperPixel>& superduperpixels,
+	vector<int>& superduperpixel_indexes
 )
 {
-	if (superduperpixel_pointers[neighbor] == NULL)
+	superduperpixel_indexes = vector<int>(m_numlabels, -1);
+	int superduperpixel_count = 0;
+	for (const SuperDuperPixel& sdp : superduperpixels)
 	{
-		if (superduperpixel_pointers[superpixel] == NULL)
+		for (int superpixel : sdp.get_superpixels())
 		{
-			superduperpixels.push_back(SuperDuperPixel(superpixel, color_histogram, superpixel_population[superpixel]));
-			superduperpixel_pointers[superpixel] = &superduperpixels.back();
-			superduperpixel_iterators[superpixel] = --superduperpixels.end();
+			superduperpixel_indexes[superpixel] = superduperpixel_count;
 		}
-		vector< vector<float>> neighbor_color_histogram(m_nr_channels);
-		this->extractColorHistogram(num_buckets, superpixel_color_histograms, neighbor_color_histogram, neighbor);
-		superduperpixel_pointers[superpixel]->add_superpixel(neighbor, neighbor_color_histogram, superpixel_population[neighbor]);
-		superduperpixel_pointers[neighbor] = superduperpixel_pointers[superpixel];
-		superduperpixel_iterators[neighbor] = superduperpixel_iterators[superpixel];
+		superduperpixel_count += 1;
+	}
+	return superduperpixel_count;
+}
+
+void SuperpixelSLICImpl::finishDuperize
+(
+	vector<int>& superduperpixel_indexes,
+	const int superduperpixel_count,
+	const bool relabel
+)
+{
+	if (relabel)
+	{
+		this->assignSuperduperpixels(superduperpixel_indexes);
+		m_base_numlabels = m_numlabels;
+		m_numlabels = superduperpixel_count;
+		m_numsuperduperpixels = superduperpixel_count;
+		m_superduperpixel_indexes.clear();
 	}
 	else
 	{
-		if (superduperpixel_pointers[superpixel] == NULL)
-		{
-			superduperpixel_pointers[neighbor]->add_superpixel(superpixel, color_histogram, superpixel_population[superpixel]);
-			superduperpixel_pointers[superpixel] = superduperpixel_pointers[neighbor];
-			superduperpixel_iterators[superpixel] = superduperpixel_iterators[neighbor];
-		}
-		else
+		// Keep the base superpixels in m_klabels and map them later in getSuperduperpixelLabels()
+		m_numsuperduperpixels = superduperpixel_count;
+		m_superduperpixel_indexes.swap(superduperpixel_indexes);
+	}
+}
+
+void SuperpixelSLICImpl::getSuperduperpixelLabels
+(
+	OutputArray labels_out,
+	OutputArray mask,
+	OutputArray boundary,
+	bool thick_line
+) const
+{
+	// Labels that were never duperized (or were relabeled in place) map to themselves
+	vector<int> identity_indexes;
+	const vector<int>* superduperpixel_indexes = &m_superduperpixel_indexes;
+	if (m_superduperpixel_indexes.empty())
+	{
+		identity_indexes.resize(m_numlabels);
+		std::iota(identity_indexes.begin(), identity_indexes.end(), 0);
+		superduperpixel_indexes = &identity_indexes;
+	}
+
+	this->getLabelsThroughIndexes(m_klabels, *superduperpixel_indexes, labels_out, mask, boundary, thick_line);
+}
+
+void SuperpixelSLICImpl::getLabelsThroughIndexes
+(
+	const Mat& superpixel_labels,
+	const vector<int>& superduperpixel_indexes,
+	OutputArray labels_out,
+	OutputArray mask,
+	OutputArray boundary,
+	const bool thick_line
+) const
+{
+	Mat labels;
+	if (labels_out.needed())
+	{
+		labels_out.create(m_height, m_width, CV_32SC1);
+		labels = labels_out.getMat();
+	}
+
+	Mat contour_mask;
+	if (mask.needed())
+	{
+		mask.create(m_height, m_width, CV_8UC1);
+		contour_mask = mask.getMat();
+	}
+
+	vector<Point> boundary_points;
+
+	this->relabelSuperduperpixels
+	(
+		superpixel_labels,
+		superduperpixel_indexes,
+		labels_out.needed() ? &labels : NULL,
+		mask.needed() ? &contour_mask : NULL,
+		boundary.needed() ? &boundary_points : NULL,
+		thick_line
+	);
+
+	if (boundary.needed())
+		Mat(boundary_points).copyTo(boundary);
+}
+
+struct SuperduperpixelRelabelInvoker : ParallelLoopBody
+{
+	SuperduperpixelRelabelInvoker
+	(
+		const Mat* _klabels,
+		const vector<int>* _superduperpixel_indexes,
+		Mat* _labels_out,
+		Mat* _mask,
+		vector< vector<Point> >* _row_boundaries,
+		bool _thick_line
+	)
+	{
+		klabels = _klabels;
+		superduperpixel_indexes = _superduperpixel_indexes;
+		labels_out = _labels_out;
+		mask = _mask;
+		row_boundaries = _row_boundaries;
+		thick_line = _thick_line;
+	}
+
+	void operator ()(const cv::Range& range) const CV_OVERRIDE
+	{
+		const int width = klabels->cols;
+		const int height = klabels->rows;
+		const int* lut = superduperpixel_indexes->data();
+		const bool find_borders = mask != NULL || row_boundaries != NULL;
+
+		for (int y = range.start; y < range.end; y += 1)
 		{
-			std::list<SuperDuperPixel>::iterator merging_superduperpixel = superduperpixel_iterators[neighbor];
-			(*superduperpixel_pointers[superpixel]) += superduperpixel_pointers[neighbor];
-			for (int connected_neighbor : superduperpixel_pointers[neighbor]->get_superpixels())
+			// Rows above and below are only read (never written) so other threads can work on them
+			const int* row = klabels->ptr<int>(y);
+			const int* row_above = y > 0 ? klabels->ptr<int>(y - 1) : NULL;
+			const int* row_below = y < height - 1 ? klabels->ptr<int>(y + 1) : NULL;
+			int* out_row = labels_out != NULL ? labels_out->ptr<int>(y) : NULL;
+			uchar* mask_row = mask != NULL ? mask->ptr<uchar>(y) : NULL;
+
+			for (int x = 0; x < width; x += 1)
 			{
-				superduperpixel_pointers[connected_neighbor] = superduperpixel_pointers[superpixel];
-				superduperpixel_iterators[connected_neighbor] = superduperpixel_iterators[superpixel];
+				const int superduperpixel = lut[row[x]];
+				if (out_row != NULL) out_row[x] = superduperpixel;
+				if (!find_borders) continue;
+
+				bool is_border =
+					(x < width - 1 && lut[row[x + 1]] != superduperpixel) ||
+					(row_below != NULL && lut[row_below[x]] != superduperpixel);
+				if (thick_line && !is_border)
+				{
+					is_border =
+						(x > 0 && lut[row[x - 1]] != superduperpixel) ||
+						(row_above != NULL && lut[row_above[x]] != superduperpixel);
+				}
+
+				if (mask_row != NULL) mask_row[x] = is_border ? (uchar)255 : (uchar)0;
+				if (is_border && row_boundaries != NULL) (*row_boundaries)[y].push_back(Point(x, y));
 			}
-			superduperpixels.erase(merging_superduperpixel);
 		}
 	}
-}
 
-int SuperpixelSLICImpl::indexSuperduperpixels
+	const Mat* klabels;
+	const vector<int>* superduperpixel_indexes;
+	Mat* labels_out;
+	Mat* mask;
+	vector< vector<Point> >* row_boundaries;
+	bool thick_line;
+};
+
+void SuperpixelSLICImpl::relabelSuperduperpixels
 (
-	const std::list<SuperDuperPixel>& superduperpixels,
-	vector<int>& superduperpixel_indexes
-)
+	const Mat& superpixel_labels,
+	const vector<int>& superduperpixel_indexes,
+	Mat* labels_out,
+	Mat* mask,
+	vector<Point>* boundary,
+	const bool thick_line
+) const
 {
-	superduperpixel_indexes = vector<int>(m_numlabels, -1);
-	int superduperpixel_count = 0;
-	for (SuperDuperPixel sdp : superduperpixels)
+	// Writing labels in place is only safe when no row needs to read its neighbors' old labels
+	CV_Assert( labels_out == NULL || labels_out->data != superpixel_labels.data || (mask == NULL && boundary == NULL) );
+
+	// Each row keeps its own border list so rows can be found in parallel and joined in order
+	vector< vector<Point> > row_boundaries;
+	if (boundary != NULL) row_boundaries.resize(m_height);
+
+	parallel_for_
+	(
+		Range(0, m_height),
+		SuperduperpixelRelabelInvoker
+		(
+			&superpixel_labels,
+			&superduperpixel_indexes,
+			labels_out,
+			mask,
+			boundary != NULL ? &row_boundaries : NULL,
+			thick_line
+		)
+	);
+
+	if (boundary != NULL)
 	{
-		for (int superpixel : sdp.get_superpixels())
+		boundary->clear();
+		for (const vector<Point>& row_boundary : row_boundaries)
 		{
-			superduperpixel_indexes[superpixel] = superduperpixel_count;
+			boundary->insert(boundary->end(), row_boundary.begin(), row_boundary.end());
 		}
-		superduperpixel_count += 1;
 	}
-	return superduperpixel_count;
 }
 
 void SuperpixelSLICImpl::assignSuperduperpixels(const vector<int>& superduperpixel_indexes)
 {
 	// Change m_klabels so pixels use superduperpixels instead of their old superpixels
-	for (int y = 0; y < m_height; y += 1)
-	for (int x = 0; x < m_width; x += 1)
+	// The old labels move to m_base_klabels so later duperize calls can start from them again
+	Mat superduperpixel_labels( m_height, m_width, CV_32S );
+	this->relabelSuperduperpixels(m_klabels, superduperpixel_indexes, &superduperpixel_labels, NULL, NULL, false);
+	m_base_klabels = m_klabels;
+	m_klabels = superduperpixel_labels;
+}
+
+void SuperpixelSLICImpl::restoreBaseSuperpixels()
+{
+	// Put back the base superpixels if the last duperize call relabeled m_klabels
+	if (!m_base_klabels.empty())
 	{
-		m_klabels.at<int>(y, x) = superduperpixel_indexes[m_klabels.at<int>(y, x)];
+		m_klabels = m_base_klabels;
+		m_numlabels = m_base_numlabels;
+		m_base_klabels.release();
 	}
+	m_superduperpixel_indexes.clear();
+}
+
+void SuperpixelSLICImpl::clearDuperizeCache()
+{
+	// Labels changed, so the superpixels they had before are gone for good
+	m_base_klabels.release();
+	m_superduperpixel_indexes.clear();
+	m_numsuperduperpixels = m_numlabels;
+	m_superpixel_neighbors.clear();
+	m_superpixel_features.clear();
+	m_superpixel_population.clear();
+	m_feature_mode = -1;
+	m_feature_buckets.clear();
+	m_feature_max_samples = 0;
+	m_histogram_sampling_error = 0;
+	m_pyramid_indexes.clear();
+	m_pyramid_counts.clear();
 }
 
 /*
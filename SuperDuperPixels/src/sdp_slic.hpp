@@ -59,6 +59,36 @@ using namespace cv;
 
     enum SLICType { SLIC = 100, SLICO = 101, MSLIC = 102 };
 
+	/** @brief Distance metrics super-duper-pixels can use to compare superpixel colors.
+
+	SDP_L1 and SDP_L2 work with average colors and histograms. SDP_CIEDE2000 only works with average
+	colors of a CIELAB image. SDP_CHI_SQUARE and SDP_INTERSECTION only work with histograms.
+	 */
+	enum SuperDuperPixelDistance
+	{
+		SDP_L1 = 0,
+		SDP_L2 = 1,
+		SDP_CIEDE2000 = 2,
+		SDP_CHI_SQUARE = 3,
+		SDP_INTERSECTION = 4
+	};
+
+	/** @brief Time in milliseconds spent in each stage of a duperize call.
+
+	Stages that were skipped because their results were kept from the previous call are 0.
+	 */
+	struct DuperizeTimings
+	{
+		// Finding which superpixels are adjacent to each other
+		double adjacency;
+		// Finding the average colors / color histograms of the superpixels
+		double stats;
+		// Grouping superpixels into super-duper-pixels on the superpixel graph
+		double grouping;
+		// Writing super-duper-pixel labels into the labels of the image
+		double relabel;
+	};
+
 /** @brief Class implementing the SLIC (Simple Linear Iterative Clustering) superpixels
 algorithm described in @cite Achanta2012.
 
@@ -141,23 +171,223 @@ public:
 	
 	Uses average colors of superpixels to determine if they're similar enough in color.
 
+	Calling it again (e.g. with another distance) starts over from the base superpixels. Their
+	adjacency and average colors are kept from the previous call, so only the grouping is redone.
+	iterate() and enforceLabelConnectivity() make the current labels the new base superpixels.
+
     @param distance The max distance the average colors of superpixels can be from each other to be
 	combined.
+
+	@param relabel If true, the labels stored in the SuperpixelSLIC object are replaced with the
+	super-duper-pixel labels. If false, the base superpixel segmentation is left untouched and the
+	super-duper-pixel labels can be fetched with getSuperduperpixelLabels().
+
+	@param distance_metric How average colors are compared (see SuperDuperPixelDistance): SDP_L1,
+	SDP_L2 or SDP_CIEDE2000. The scale of distance depends on the metric.
      */
-	CV_WRAP virtual void duperizeWithAverage(const float distance) = 0;
+	CV_WRAP virtual void duperizeWithAverage
+	(
+		const float distance,
+		const bool relabel = true,
+		const int distance_metric = SDP_L1
+	) = 0;
 
 	/** @brief Combines adjacent superpixels into super-duper-pixels if they're similar enough in color.
 	
 	Uses distances between (normalized) color histograms of superpixels to determine if they're similar
 	enough in color.
 
+	Calling it again with the same num_buckets and max_samples starts over from the base superpixels and
+	reuses their adjacency and histograms from the previous call, so only the grouping is redone.
+
     @param num_buckets The number of histogram buckets to use for each color channel
 	(RGB, HSV, LAB, etc.).
 
 	@param distance The max distance the (normalized) color histograms of superpixels can be from each
 	other to be combined.
+
+	@param relabel If true, the labels stored in the SuperpixelSLIC object are replaced with the
+	super-duper-pixel labels. If false, the base superpixel segmentation is left untouched and the
+	super-duper-pixel labels can be fetched with getSuperduperpixelLabels().
+
+	@param distance_metric How histograms are compared (see SuperDuperPixelDistance): SDP_L1, SDP_L2,
+	SDP_CHI_SQUARE or SDP_INTERSECTION. The scale of distance depends on the metric.
+
+	@param max_samples If more than 0, histograms of superpixels with more pixels than this are
+	approximated from about max_samples of their pixels, picked on a fixed lattice (so the result is the
+	same on every run). The estimated error is returned by getHistogramSamplingError(). If 0, every
+	pixel is counted.
+     */
+	CV_WRAP virtual void duperizeWithHistogram
+	(
+		const int num_buckets[],
+		const float distance,
+		const bool relabel = true,
+		const int distance_metric = SDP_L1,
+		const int max_samples = 0
+	) = 0;
+
+	/** @brief Returns the estimated error of the sampled histograms of the last duperizeWithHistogram()
+	call.
+
+	This is the expected L1 distance between a sampled histogram and the exact one (summed over the
+	color channels), averaged over every superpixel. Superpixels that were counted exactly add 0, so
+	it's 0 when max_samples was 0.
+     */
+	CV_WRAP virtual float getHistogramSamplingError() const = 0;
+
+	/** @brief Returns the features the base superpixels were compared with in the last duperize call.
+
+	@param features Return: CV_32FC1 Mat with one row per base superpixel: its average colors, its
+	normalized color histograms or its average colors followed by its texture buckets.
+     */
+	CV_WRAP virtual void getSuperpixelFeatures( OutputArray features ) const = 0;
+
+	/** @brief Combines adjacent superpixels into super-duper-pixels if they're similar enough in color
+	and texture.
+
+	Uses the average colors of superpixels plus histograms of per-pixel texture codes, such as the
+	LTriDP codes made by ltridp_slic_improved::FeatureExtractor::extract(). Both are gathered in the
+	same pass over the image. Codes are counted in 59 uniform-pattern buckets (one for each 8-bit code
+	with at most 2 circular 0/1 transitions, one for every other code) and the 1-pixel image border is
+	left out since LTriDP leaves it undefined.
+
+	Since the codes can change between calls, the adjacency and features are found again on every call.
+
+	@param texture_codes CV_8UC1 code per pixel, the same size as the image.
+
+	@param distance The max distance superpixels can be from each other to be combined: the color
+	distance of their average colors plus texture_weight times the L1 distance of their normalized
+	texture histograms (which is between 0 and 2).
+
+	@param texture_weight How much the texture distance counts compared to the color distance.
+
+	@param relabel If true, the labels stored in the SuperpixelSLIC object are replaced with the
+	super-duper-pixel labels. If false, the base superpixel segmentation is left untouched and the
+	super-duper-pixel labels can be fetched with getSuperduperpixelLabels().
+
+	@param distance_metric How average colors are compared (see SuperDuperPixelDistance): SDP_L1,
+	SDP_L2 or SDP_CIEDE2000.
+     */
+	CV_WRAP virtual void duperizeWithTexture
+	(
+		InputArray texture_codes,
+		const float distance,
+		const float texture_weight = 1.0f,
+		const bool relabel = true,
+		const int distance_metric = SDP_L1
+	) = 0;
+
+	/** @brief Builds a nested hierarchy of super-duper-pixels from the current superpixels in one call.
+
+	Each level groups the base superpixels like duperizeWithAverage() with one of the distances.
+	Distances are sorted from smallest to largest first, and since grouping only joins superpixels whose
+	average colors are closer than the distance, every super-duper-pixel of a level is inside exactly
+	one super-duper-pixel of the next level. Levels are only kept as lookup tables over the base
+	superpixels; their labels are made when asked for with getPyramidLevelLabels().
+
+	The base superpixels are put back (and stay in the SuperpixelSLIC object), and their adjacency and
+	average colors are kept like for duperizeWithAverage(). Later duperize calls don't change the
+	levels, but iterate() and enforceLabelConnectivity() drop them.
+
+	@param distances The max distance of each level (see duperizeWithAverage()).
+
+	@param distance_metric How average colors are compared (see SuperDuperPixelDistance): SDP_L1,
+	SDP_L2 or SDP_CIEDE2000.
+     */
+	CV_WRAP virtual void buildSuperduperpixelPyramid
+	(
+		const std::vector<float>& distances,
+		const int distance_metric = SDP_L1
+	) = 0;
+
+	/** @brief Returns the number of levels made by the last buildSuperduperpixelPyramid() call.
+     */
+	CV_WRAP virtual int getNumberOfPyramidLevels() const = 0;
+
+	/** @brief Returns the number of super-duper-pixels in a level of the pyramid.
+
+	@param level Level of the pyramid, from 0 (smallest distance) to getNumberOfPyramidLevels() - 1.
+     */
+	CV_WRAP virtual int getPyramidLevelSize( int level ) const = 0;
+
+	/** @brief Returns the labels of a level of the pyramid and their contours, computed in a single pass.
+
+	Works like getSuperduperpixelLabels() on the lookup table of the level.
+
+	@param level Level of the pyramid, from 0 (smallest distance) to getNumberOfPyramidLevels() - 1.
+
+	@param labels_out Return: CV_32SC1 labels of the level. Pass noArray() to skip.
+
+	@param mask Return: CV_8UC1 image mask where 255 indicates a border between super-duper-pixels of
+	the level and 0 otherwise. Pass noArray() to skip.
+
+	@param boundary Return: Sparse list of the border pixels as a vector of Point in row-major order.
+	Pass noArray() to skip.
+
+	@param thick_line See getSuperduperpixelLabels().
+     */
+	CV_WRAP virtual void getPyramidLevelLabels
+	(
+		int level,
+		OutputArray labels_out,
+		OutputArray mask = noArray(),
+		OutputArray boundary = noArray(),
+		bool thick_line = true
+	) const = 0;
+
+	/** @brief Returns which super-duper-pixel of the next level each super-duper-pixel of a level is in.
+
+	@param level Level of the pyramid, from 0 to getNumberOfPyramidLevels() - 2.
+
+	@param parents Return: vector of int with getPyramidLevelSize(level) labels of level + 1.
+     */
+	CV_WRAP virtual void getPyramidLevelParents( int level, OutputArray parents ) const = 0;
+
+	/** @brief Returns how long each stage of the last duperize call took.
+     */
+	CV_WRAP virtual DuperizeTimings getDuperizeTimings() const = 0;
+
+	/** @brief Puts back the base superpixels and drops what duperize calls keep for the next one.
+
+	The adjacency and the features of the superpixels are computed again by the next duperize call, as if
+	it were the first one (e.g. to time the whole duperize pass more than once). The base superpixels and
+	their labels are left as they are.
+     */
+	CV_WRAP virtual void resetDuperize() = 0;
+
+	/** @brief Returns the number of super-duper-pixels found by the last duperize call.
+
+	Same as getNumberOfSuperpixels() if the labels were never duperized or were relabeled in place.
+     */
+	CV_WRAP virtual int getNumberOfSuperduperpixels() const = 0;
+
+	/** @brief Returns the super-duper-pixel labels and their contours, computed in a single pass.
+
+	Maps the stored labels through the super-duper-pixel lookup table of the last duperize call
+	without modifying them. Image rows are processed in parallel, so unlike getLabelContourMask()
+	each border pixel is decided from its own neighbors only.
+
+	@param labels_out Return: CV_32SC1 super-duper-pixel labels. A caller-provided Mat of the right
+	size and type is written to in place. Pass noArray() to skip.
+
+	@param mask Return: CV_8UC1 image mask where 255 indicates a super-duper-pixel border and 0
+	otherwise. Pass noArray() to skip.
+
+	@param boundary Return: Sparse list of the border pixels as a vector of Point in row-major order.
+	Pass noArray() to skip.
+
+	@param thick_line If false, only pixels whose right or bottom neighbor has a different label are
+	borders (one pixel wide). Otherwise any differing 4-connected neighbor makes a border (two pixels
+	wide).
      */
-	CV_WRAP virtual void duperizeWithHistogram(const int num_buckets[], const float distance) = 0;
+	CV_WRAP virtual void getSuperduperpixelLabels
+	(
+		OutputArray labels_out,
+		OutputArray mask = noArray(),
+		OutputArray boundary = noArray(),
+		bool thick_line = true
+	) const = 0;
 
 
 };
@@ -0,0 +1,380 @@
+/*
+
+File:
+sdp_tiled.cpp
+
+Description:
+Streaming SD-SLIC over tiled segmentations (see sdp_tiled.hpp).
+
+Inside a tile, superpixels are grouped exactly like
+SuperpixelSLIC::duperizeWithAverage() groups them: two adjacent
+superpixels end up in the same super-duper-pixel when their average
+colors are closer than the max distance. That makes super-duper-pixels
+the connected components of the "close enough" superpixel graph, so a
+union-find over all superpixels gives the same grouping while only
+needing the edges of one tile (and its seams) at a time.
+
+*/
+
+#include <set>
+#include <numeric>
+#include <utility>
+#include "sdp_tiled.hpp"
+#include "sdp_distance.hpp"
+
+using namespace std;
+
+// Adds one color channel of a tile to the color sums of its superpixels
+template<typename T>
+static void addTileColors
+(
+	const Mat& channel,
+	const Mat& labels,
+	const int color_channel,
+	const int nr_channels,
+	vector<float>& average_colors
+)
+{
+	for (int y = 0; y < labels.rows; y += 1)
+	{
+		const T* colors = channel.ptr<T>(y);
+		const int* superpixels = labels.ptr<int>(y);
+		for (int x = 0; x < labels.cols; x += 1)
+		{
+			average_colors[superpixels[x] * nr_channels + color_channel] += (float) colors[x];
+		}
+	}
+}
+
+TiledSuperDuperPixels::TiledSuperDuperPixels(const int tiles_x, const float max_distance, const int distance_metric)
+{
+	CV_Assert( tiles_x > 0 );
+	if (distance_metric != SDP_L1 && distance_metric != SDP_L2 && distance_metric != SDP_CIEDE2000)
+		CV_Error( Error::StsBadArg, "Distance metric not supported for average colors" );
+
+	m_tiles_x = tiles_x;
+	m_max_distance = max_distance;
+	m_distance_metric = distance_metric;
+	m_nr_channels = 0;
+	m_numsuperduperpixels = 0;
+}
+
+void TiledSuperDuperPixels::addTile(InputArray image, InputArray labels, const int num_labels)
+{
+	CV_Assert( m_superduperpixel_indexes.empty() );
+
+	Mat tile_labels = labels.getMat();
+	CV_Assert( tile_labels.type() == CV_32SC1 && !tile_labels.empty() && num_labels > 0 );
+
+	vector<Mat> channels;
+	if (image.isMatVector()) image.getMatVector(channels);
+	else split(image.getMat(), channels);
+	CV_Assert( !channels.empty() && channels[0].size() == tile_labels.size() );
+
+	if (m_tile_offsets.empty()) m_nr_channels = (int) channels.size();
+	CV_Assert( (int) channels.size() == m_nr_channels );
+
+	vector<float> average_colors;
+	this->findTileAverages(channels, tile_labels, num_labels, average_colors);
+
+	// Pick the distance metric once per tile so the merge loops get compiled separately for each metric
+	switch (m_distance_metric)
+	{
+		case SDP_L1:
+			this->mergeTile<L1Distance>(tile_labels, num_labels, average_colors);
+			break;
+
+		case SDP_L2:
+			this->mergeTile<L2Distance>(tile_labels, num_labels, average_colors);
+			break;
+
+		case SDP_CIEDE2000:
+			CV_Assert( m_nr_channels == 3 );
+			if (channels[0].depth() == CV_8U)
+			{
+				for (int superpixel = 0; superpixel < num_labels; superpixel += 1)
+				{
+					CIEDE2000Distance::from8BitLab(&average_colors[superpixel * m_nr_channels]);
+				}
+			}
+			this->mergeTile<CIEDE2000Distance>(tile_labels, num_labels, average_colors);
+			break;
+	}
+
+	this->keepSeams(tile_labels, average_colors);
+}
+
+void TiledSuperDuperPixels::findTileAverages
+(
+	const vector<Mat>& channels,
+	const Mat& labels,
+	const int num_labels,
+	vector<float>& average_colors
+)
+{
+	average_colors.assign(num_labels * m_nr_channels, 0);
+	vector<int> population(num_labels, 0);
+	for (int y = 0; y < labels.rows; y += 1)
+	{
+		const int* superpixels = labels.ptr<int>(y);
+		for (int x = 0; x < labels.cols; x += 1)
+		{
+			CV_Assert( superpixels[x] >= 0 && superpixels[x] < num_labels );
+			population[superpixels[x]] += 1;
+		}
+	}
+
+	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
+	{
+		const Mat& channel = channels[color_channel];
+		switch ( channel.depth() )
+		{
+			case CV_8U:
+				addTileColors<uchar>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			case CV_8S:
+				addTileColors<char>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			case CV_16U:
+				addTileColors<ushort>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			case CV_16S:
+				addTileColors<short>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			case CV_32S:
+				addTileColors<int>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			case CV_32F:
+				addTileColors<float>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			case CV_64F:
+				addTileColors<double>(channel, labels, color_channel, m_nr_channels, average_colors);
+				break;
+
+			default:
+				CV_Error( Error::StsInternal, "Invalid matrix depth" );
+				break;
+		}
+	}
+
+	// Superpixels with no pixels keep an average of 0
+	for (int superpixel = 0; superpixel < num_labels; superpixel += 1)
+	for (int color_channel = 0; color_channel < m_nr_channels; color_channel += 1)
+	{
+		if (population[superpixel] > 0)
+			average_colors[superpixel * m_nr_channels + color_channel] /= population[superpixel];
+	}
+}
+
+template<class Distance>
+void TiledSuperDuperPixels::mergeTile(const Mat& labels, const int num_labels, const vector<float>& average_colors)
+{
+	const int tile = (int) m_tile_offsets.size();
+	const int tile_x = tile % m_tiles_x;
+	const int tile_y = tile / m_tiles_x;
+	const int offset = (int) m_parents.size();
+
+	// The first tile row decides how wide each tile column is
+	if (tile_y == 0)
+	{
+		if (tile_x == 0) m_column_starts.assign(1, 0);
+		m_column_starts.push_back(m_column_starts.back() + labels.cols);
+		m_bottom_row.resize(m_column_starts.back(), -1);
+	}
+	else
+	{
+		CV_Assert( labels.cols == m_column_starts[tile_x + 1] - m_column_starts[tile_x] );
+	}
+	if (tile_x > 0) CV_Assert( labels.rows == (int) m_right_column.size() );
+
+	// Every superpixel of the tile starts as its own super-duper-pixel
+	m_tile_offsets.push_back(offset);
+	m_parents.resize(offset + num_labels);
+	std::iota(m_parents.begin() + offset, m_parents.end(), offset);
+
+	// Graph of which superpixels inside the tile are adjacent to each other (4-connected)
+	vector< set<int> > superpixel_neighbors(num_labels);
+	for (int y = 0; y < labels.rows; y += 1)
+	for (int x = 0; x < labels.cols; x += 1)
+	{
+		int superpixel = labels.at<int>(y, x);
+		if (x > 0 && labels.at<int>(y, x - 1) != superpixel)
+			superpixel_neighbors[superpixel].insert(labels.at<int>(y, x - 1));
+		if (y > 0 && labels.at<int>(y - 1, x) != superpixel)
+			superpixel_neighbors[superpixel].insert(labels.at<int>(y - 1, x));
+	}
+
+	for (int superpixel = 0; superpixel < num_labels; superpixel += 1)
+	for (int neighbor : superpixel_neighbors[superpixel])
+	{
+		// Don't compare superpixels that are already grouped together
+		if (this->findRoot(offset + superpixel) == this->findRoot(offset + neighbor)) continue;
+
+		const float* colors = &average_colors[superpixel * m_nr_channels];
+		const float* neighbor_colors = &average_colors[neighbor * m_nr_channels];
+		if (Distance::compute(colors, neighbor_colors, m_nr_channels) < m_max_distance)
+			this->unite(offset + superpixel, offset + neighbor);
+	}
+
+	// Superpixel pairs across the seams with the tile to the left and the tile above
+	// (global index of the superpixel in the older tile, local index in this tile)
+	set< pair<int, int> > seam_pairs;
+	if (tile_x > 0)
+	{
+		for (int y = 0; y < labels.rows; y += 1)
+		{
+			seam_pairs.insert(make_pair(m_right_column[y], labels.at<int>(y, 0)));
+		}
+	}
+	if (tile_y > 0)
+	{
+		const int column_start = m_column_starts[tile_x];
+		for (int x = 0; x < labels.cols; x += 1)
+		{
+			seam_pairs.insert(make_pair(m_bottom_row[column_start + x], labels.at<int>(0, x)));
+		}
+	}
+
+	for (const pair<int, int>& seam_pair : seam_pairs)
+	{
+		if (this->findRoot(seam_pair.first) == this->findRoot(offset + seam_pair.second)) continue;
+
+		const float* seam_colors = m_seam_colors[seam_pair.first].data();
+		const float* colors = &average_colors[seam_pair.second * m_nr_channels];
+		if (Distance::compute(seam_colors, colors, m_nr_channels) < m_max_distance)
+			this->unite(seam_pair.first, offset + seam_pair.second);
+	}
+}
+
+void TiledSuperDuperPixels::keepSeams(const Mat& labels, const vector<float>& average_colors)
+{
+	const int tile = (int) m_tile_offsets.size() - 1;
+	const int tile_x = tile % m_tiles_x;
+	const int offset = m_tile_offsets.back();
+
+	// The last column is the seam with the next tile of this tile row
+	m_right_column.clear();
+	if (tile_x < m_tiles_x - 1)
+	{
+		m_right_column.resize(labels.rows);
+		for (int y = 0; y < labels.rows; y += 1)
+		{
+			m_right_column[y] = offset + labels.at<int>(y, labels.cols - 1);
+		}
+	}
+
+	// The last row is the seam with the tile below
+	const int column_start = m_column_starts[tile_x];
+	for (int x = 0; x < labels.cols; x += 1)
+	{
+		m_bottom_row[column_start + x] = offset + labels.at<int>(labels.rows - 1, x);
+	}
+
+	// Only keep the colors of superpixels that are still on a seam
+	std::unordered_map< int, vector<float> > seam_colors;
+	for (int pass = 0; pass < 2; pass += 1)
+	{
+		const vector<int>& seam = pass == 0 ? m_bottom_row : m_right_column;
+		for (int superpixel : seam)
+		{
+			if (superpixel < 0 || seam_colors.count(superpixel)) continue;
+
+			if (superpixel >= offset)
+			{
+				const float* colors = &average_colors[(superpixel - offset) * m_nr_channels];
+				seam_colors[superpixel] = vector<float>(colors, colors + m_nr_channels);
+			}
+			else
+			{
+				seam_colors[superpixel] = std::move(m_seam_colors[superpixel]);
+			}
+		}
+	}
+	m_seam_colors.swap(seam_colors);
+}
+
+int TiledSuperDuperPixels::findRoot(int superpixel)
+{
+	// Path halving keeps the trees flat without recursion
+	while (m_parents[superpixel] != superpixel)
+	{
+		m_parents[superpixel] = m_parents[m_parents[superpixel]];
+		superpixel = m_parents[superpixel];
+	}
+	return superpixel;
+}
+
+void TiledSuperDuperPixels::unite(const int superpixel, const int neighbor)
+{
+	int root = this->findRoot(superpixel);
+	int neighbor_root = this->findRoot(neighbor);
+	// The smaller index always becomes the root so finish() can number groups in one pass
+	if (root < neighbor_root) m_parents[neighbor_root] = root;
+	else if (neighbor_root < root) m_parents[root] = neighbor_root;
+}
+
+int TiledSuperDuperPixels::finish()
+{
+	m_superduperpixel_indexes.assign(m_parents.size(), -1);
+	m_numsuperduperpixels = 0;
+	for (int superpixel = 0; superpixel < (int) m_parents.size(); superpixel += 1)
+	{
+		// Roots come before every other superpixel of their group
+		int root = this->findRoot(superpixel);
+		if (m_superduperpixel_indexes[root] == -1)
+		{
+			m_superduperpixel_indexes[root] = m_numsuperduperpixels;
+			m_numsuperduperpixels += 1;
+		}
+		m_superduperpixel_indexes[superpixel] = m_superduperpixel_indexes[root];
+	}
+
+	// The seams aren't needed anymore
+	m_bottom_row.clear();
+	m_right_column.clear();
+	m_seam_colors.clear();
+	return m_numsuperduperpixels;
+}
+
+void TiledSuperDuperPixels::getTileLabels(const int tile, InputArray labels, OutputArray labels_out) const
+{
+	CV_Assert( !m_superduperpixel_indexes.empty() );
+	CV_Assert( tile >= 0 && tile < (int) m_tile_offsets.size() );
+
+	Mat tile_labels = labels.getMat();
+	CV_Assert( tile_labels.type() == CV_32SC1 );
+	labels_out.create(tile_labels.rows, tile_labels.cols, CV_32SC1);
+	Mat superduperpixel_labels = labels_out.getMat();
+
+	const int* superduperpixel_indexes = &m_superduperpixel_indexes[m_tile_offsets[tile]];
+	for (int y = 0; y < tile_labels.rows; y += 1)
+	{
+		const int* superpixels = tile_labels.ptr<int>(y);
+		int* superduperpixels = superduperpixel_labels.ptr<int>(y);
+		for (int x = 0; x < tile_labels.cols; x += 1)
+		{
+			superduperpixels[x] = superduperpixel_indexes[superpixels[x]];
+		}
+	}
+}
+
+int TiledSuperDuperPixels::getNumberOfTiles() const
+{
+	return (int) m_tile_offsets.size();
+}
+
+int TiledSuperDuperPixels::getNumberOfSuperpixels() const
+{
+	return (int) m_parents.size();
+}
+
+int TiledSuperDuperPixels::getNumberOfSuperduperpixels() const
+{
+	return m_numsuperduperpixels;
+}
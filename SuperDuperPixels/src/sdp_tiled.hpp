@@ -0,0 +1,127 @@
+/*
+
+File:
+sdp_tiled.hpp
+
+Description:
+Streaming SD-SLIC for large mosaics that are segmented tile by tile. Each
+tile is given once, with its own superpixel labels, in row-major order.
+Superpixels are grouped inside the tile right away and only the labels on
+the tile's last row / last column (plus the average colors of the
+superpixels on them) are kept, so super-duper-pixels can be merged across
+the seam with the next tiles. Merges are tracked with one union-find over
+every superpixel of the mosaic, so memory stays at one tile plus the seam
+state plus one int per superpixel.
+
+*/
+
+#ifndef SDP_TILED_HPP
+#define SDP_TILED_HPP
+
+#include <vector>
+#include <unordered_map>
+#include <opencv2/core.hpp>
+#include "sdp_slic.hpp"
+
+/** @brief Groups superpixels of a tiled segmentation into super-duper-pixels one tile at a time.
+
+Tiles must form a grid: every tile of a tile row has the same height and every tile of a tile column
+has the same width. Average colors of the superpixels are compared the same way as
+SuperpixelSLIC::duperizeWithAverage().
+ */
+class TiledSuperDuperPixels
+{
+public:
+
+	/** @brief Starts a tiled duperize.
+
+	@param tiles_x Number of tiles in each row of the mosaic.
+	@param max_distance The max distance the average colors of superpixels can be from each other to be
+	combined.
+	@param distance_metric SDP_L1, SDP_L2 or SDP_CIEDE2000 (see SuperDuperPixelDistance).
+	 */
+	TiledSuperDuperPixels(const int tiles_x, const float max_distance, const int distance_metric = SDP_L1);
+
+	/** @brief Groups the superpixels of the next tile (row-major order) and merges them across its seams.
+
+	@param image Tile image (same kind of input as createSuperpixelSLIC()).
+	@param labels CV_32SC1 superpixel labels of the tile, in the range [0, num_labels).
+	@param num_labels Number of superpixels in the tile.
+	 */
+	void addTile(InputArray image, InputArray labels, const int num_labels);
+
+	/** @brief Resolves the merges of all tiles and numbers the super-duper-pixels.
+
+	@return The number of super-duper-pixels in the mosaic.
+	 */
+	int finish();
+
+	/** @brief Maps the labels of a tile to super-duper-pixel labels of the mosaic (call after finish()).
+
+	@param tile Index of the tile in the order it was added.
+	@param labels The same labels that were given to addTile() for that tile.
+	@param labels_out Return: CV_32SC1 super-duper-pixel labels of the tile.
+	 */
+	void getTileLabels(const int tile, InputArray labels, OutputArray labels_out) const;
+
+	int getNumberOfTiles() const;
+	int getNumberOfSuperpixels() const;
+	int getNumberOfSuperduperpixels() const;
+
+private:
+
+	template<class Distance>
+	void mergeTile(const Mat& labels, const int num_labels, const std::vector<float>& average_colors);
+
+	void findTileAverages
+	(
+		const std::vector<Mat>& channels,
+		const Mat& labels,
+		const int num_labels,
+		std::vector<float>& average_colors
+	);
+
+	void keepSeams(const Mat& labels, const std::vector<float>& average_colors);
+
+	int findRoot(int superpixel);
+
+	void unite(const int superpixel, const int neighbor);
+
+	// tiles per row of the mosaic
+	int m_tiles_x;
+
+	// merge threshold
+	float m_max_distance;
+
+	// SuperDuperPixelDistance
+	int m_distance_metric;
+
+	// color channels (from the first tile)
+	int m_nr_channels;
+
+	// first global superpixel index of each tile
+	std::vector<int> m_tile_offsets;
+
+	// union-find parent of every superpixel of the mosaic
+	std::vector<int> m_parents;
+
+	// global labels along the bottom row of the last tile row (whole mosaic width)
+	std::vector<int> m_bottom_row;
+
+	// first column of each tile column in m_bottom_row (m_tiles_x + 1 entries once known)
+	std::vector<int> m_column_starts;
+
+	// global labels along the right column of the previous tile in the current tile row
+	std::vector<int> m_right_column;
+
+	// average colors of the superpixels on the seams
+	std::unordered_map< int, std::vector<float> > m_seam_colors;
+
+	// super-duper-pixel of every superpixel of the mosaic (after finish())
+	std::vector<int> m_superduperpixel_indexes;
+
+	// super-duper-pixels no
+	int m_numsuperduperpixels;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include <vector>
+#include "sdp_distance.hpp"
 
 enum SuperDuperPixelMode
 {
@@ -6,27 +7,71 @@ enum SuperDuperPixelMode
 	HISTOGRAM = 1
 };
 
+// Superpixels of every super-duper-pixel, kept as singly linked lists threaded through one array
+// indexed by superpixel (next[superpixel] is the next superpixel of the same super-duper-pixel, -1
+// at the end). Every superpixel is in exactly one list, so the array never grows past the number of
+// superpixels, two lists are joined in O(1) and walking one never allocates.
+class SuperpixelLinks
+{
+public:
+	SuperpixelLinks(int superpixel_count);
+	int next(int superpixel) const;
+	void join(int last, int first);
+private:
+	std::vector<int> next_superpixels;
+};
+
+// Walks the superpixels of one super-duper-pixel through SuperpixelLinks
+class SuperpixelIterator
+{
+public:
+	SuperpixelIterator(const SuperpixelLinks* links, int superpixel) : links(links), superpixel(superpixel) {}
+	int operator*() const { return this->superpixel; }
+	SuperpixelIterator& operator++() { this->superpixel = this->links->next(this->superpixel); return *this; }
+	bool operator!=(const SuperpixelIterator& other) const { return this->superpixel != other.superpixel; }
+private:
+	const SuperpixelLinks* links;
+	int superpixel;
+};
+
+// Superpixels of one super-duper-pixel (for range-based for loops)
+class SuperpixelRange
+{
+public:
+	SuperpixelRange(const SuperpixelLinks* links, int first, int count) : links(links), first(first), count(count) {}
+	SuperpixelIterator begin() const { return SuperpixelIterator(this->links, this->first); }
+	SuperpixelIterator end() const { return SuperpixelIterator(this->links, -1); }
+	int size() const { return this->count; }
+private:
+	const SuperpixelLinks* links;
+	int first;
+	int count;
+};
+
 class SuperDuperPixel
 {
 public:
-	SuperDuperPixel(int superpixel, std::vector<float> average, int pixel_count);
-	SuperDuperPixel(int superpixel, std::vector< std::vector<float> >, int pixel_count);
+	SuperDuperPixel(int superpixel, const float* features, int feature_size, int pixel_count, SuperDuperPixelMode mode, SuperpixelLinks* links);
 	SuperDuperPixelMode get_mode();
-	std::vector<int> get_superpixels();
-	float distance_from(const std::vector<float>& average);
-	float distance_from(const std::vector< std::vector<float> >& histogram);
-	void add_superpixel(int superpixel, const std::vector<float>& average, int pixel_count);
-	void add_superpixel(int superpixel, const std::vector< std::vector<float> >& histogram, int pixel_count);
+	SuperpixelRange get_superpixels() const;
+	template<class Distance>
+	float distance_from(const float* features) const
+	{
+		return Distance::compute(this->features.data(), features, (int) this->features.size());
+	}
+	void add_superpixel(int superpixel, const float* features, int pixel_count);
 	void operator+=(const SuperDuperPixel* other);
 private:
-	std::vector<int> superpixels;
-	std::vector<float> average;
-	// First dimension is color channel
-	// Second dimension is bucket
-	std::vector< std::vector<float> > histogram;
+	// Superpixels of this super-duper-pixel: first_superpixel -> ... -> last_superpixel in links
+	SuperpixelLinks* links;
+	int first_superpixel;
+	int last_superpixel;
+	int superpixel_count;
+	// Average colors (one per color channel) or normalized color histograms
+	// (the buckets of each color channel back to back)
+	std::vector<float> features;
 	int pixel_count;
 	SuperDuperPixelMode mode;
 
-	void add_average_superduperpixels(const SuperDuperPixel* other);
-	void add_histogram_superduperpixels(const SuperDuperPixel* other);
+	void add_features(const float* features, int pixel_count);
 };
@@ -0,0 +1,183 @@
+/**
+ * Tests for the sampled (approximate) histograms of duperizeWithHistogram().
+ * Measures how far the sampled histograms are from the exact ones and checks that the error reported
+ * by getHistogramSamplingError() matches what is measured.
+ */
+
+#include <cmath>
+#include <vector>
+#include <gtest/gtest.h>
+#include <opencv2/core.hpp>
+#include "sdp_slic.hpp"
+
+using namespace cv;
+
+namespace {
+
+const int NUM_BUCKETS[] = { 8, 8, 8 };
+
+// Same image on every run: 4 flat quadrants with strong pseudo-random noise on top of them, so the
+// histograms of big superpixels are spread over many buckets
+Mat makeNoisyQuadrants(const int width, const int height)
+{
+    Mat image(height, width, CV_8UC3);
+    unsigned int state = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int quadrant = (x < width / 2 ? 0 : 1) + (y < height / 2 ? 0 : 2);
+            Vec3b& pixel = image.at<Vec3b>(y, x);
+            for (int c = 0; c < 3; c++) {
+                state = state * 1664525u + 1013904223u;
+                int noise = (int) (state >> 24) % 64;
+                pixel[c] = (uchar) (20 + 50 * quadrant + noise);
+            }
+        }
+    }
+    return image;
+}
+
+Ptr<SuperpixelSLIC> makeBigSuperpixels(const Mat& image)
+{
+    Ptr<SuperpixelSLIC> slic = createSuperpixelSLIC(image, SLIC, 60, 10.0f);
+    slic->iterate(3);
+    slic->enforceLabelConnectivity(25);
+    return slic;
+}
+
+Mat histogramsOf(Ptr<SuperpixelSLIC>& slic, const int max_samples)
+{
+    slic->duperizeWithHistogram(NUM_BUCKETS, 0.0f, false, SDP_L1, max_samples);
+    Mat features;
+    slic->getSuperpixelFeatures(features);
+    return features;
+}
+
+// Mean (over superpixels) L1 distance between the histograms of two feature tables
+double meanL1Distance(const Mat& a, const Mat& b)
+{
+    double total = 0;
+    for (int row = 0; row < a.rows; row++) {
+        for (int col = 0; col < a.cols; col++) {
+            total += std::abs(a.at<float>(row, col) - b.at<float>(row, col));
+        }
+    }
+    return total / a.rows;
+}
+
+} // namespace
+
+//=============================================================================
+// Exact Histograms
+//=============================================================================
+
+TEST(HistogramSamplingTest, ExactHistogramsReportNoError) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> slic = makeBigSuperpixels(image);
+
+    histogramsOf(slic, 0);
+
+    EXPECT_EQ(slic->getHistogramSamplingError(), 0.0f);
+}
+
+TEST(HistogramSamplingTest, CapAboveSuperpixelSizeIsExact) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> slic = makeBigSuperpixels(image);
+
+    Mat exact = histogramsOf(slic, 0);
+    Mat capped = histogramsOf(slic, 480 * 480);
+
+    EXPECT_EQ(slic->getHistogramSamplingError(), 0.0f);
+    EXPECT_DOUBLE_EQ(meanL1Distance(exact, capped), 0.0);
+}
+
+//=============================================================================
+// Sampled Histogram Accuracy
+//=============================================================================
+
+TEST(HistogramSamplingTest, SampledHistogramsStayNormalized) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> slic = makeBigSuperpixels(image);
+
+    Mat sampled = histogramsOf(slic, 200);
+
+    for (int row = 0; row < sampled.rows; row++) {
+        // Each color channel of a normalized histogram adds up to 1
+        for (int channel = 0; channel < 3; channel++) {
+            float sum = 0;
+            for (int bucket = 0; bucket < NUM_BUCKETS[channel]; bucket++) {
+                sum += sampled.at<float>(row, channel * NUM_BUCKETS[channel] + bucket);
+            }
+            EXPECT_NEAR(sum, 1.0f, 1e-4f);
+        }
+    }
+}
+
+TEST(HistogramSamplingTest, ReportedErrorMatchesMeasuredError) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> slic = makeBigSuperpixels(image);
+
+    Mat exact = histogramsOf(slic, 0);
+    Mat sampled = histogramsOf(slic, 200);
+    double measured = meanL1Distance(exact, sampled);
+    double reported = slic->getHistogramSamplingError();
+
+    // A 60x60 superpixel counts roughly 1 in 18 pixels, which should stay within a few percent per channel
+    EXPECT_GT(measured, 0.0);
+    EXPECT_LT(measured, 0.5);
+    EXPECT_GT(reported, 0.0);
+    // The estimate is an expectation, the measured error of a lattice sample is close to it
+    EXPECT_LT(measured, 2.0 * reported);
+    EXPECT_GT(measured, 0.25 * reported);
+}
+
+TEST(HistogramSamplingTest, MoreSamplesGiveSmallerError) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> slic = makeBigSuperpixels(image);
+
+    Mat exact = histogramsOf(slic, 0);
+    Mat few = histogramsOf(slic, 100);
+    double few_reported = slic->getHistogramSamplingError();
+    Mat many = histogramsOf(slic, 1000);
+    double many_reported = slic->getHistogramSamplingError();
+
+    EXPECT_LT(many_reported, few_reported);
+    EXPECT_LT(meanL1Distance(exact, many), meanL1Distance(exact, few));
+}
+
+TEST(HistogramSamplingTest, SamplingIsDeterministic) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> first_slic = makeBigSuperpixels(image);
+    Ptr<SuperpixelSLIC> second_slic = makeBigSuperpixels(image);
+
+    Mat first = histogramsOf(first_slic, 200);
+    Mat second = histogramsOf(second_slic, 200);
+
+    EXPECT_DOUBLE_EQ(meanL1Distance(first, second), 0.0);
+}
+
+//=============================================================================
+// Grouping With Sampled Histograms
+//=============================================================================
+
+TEST(HistogramSamplingTest, SampledGroupingMatchesExactGrouping) {
+    Mat image = makeNoisyQuadrants(480, 480);
+    Ptr<SuperpixelSLIC> slic = makeBigSuperpixels(image);
+
+    slic->duperizeWithHistogram(NUM_BUCKETS, 1.0f, false, SDP_L1);
+    Mat exact_labels;
+    slic->getSuperduperpixelLabels(exact_labels);
+    int exact_count = slic->getNumberOfSuperduperpixels();
+
+    slic->duperizeWithHistogram(NUM_BUCKETS, 1.0f, false, SDP_L1, 200);
+    Mat sampled_labels;
+    slic->getSuperduperpixelLabels(sampled_labels);
+
+    EXPECT_EQ(slic->getNumberOfSuperduperpixels(), exact_count);
+    int differing = 0;
+    for (int y = 0; y < exact_labels.rows; y++) {
+        for (int x = 0; x < exact_labels.cols; x++) {
+            differing += exact_labels.at<int>(y, x) != sampled_labels.at<int>(y, x);
+        }
+    }
+    EXPECT_EQ(differing, 0);
+}
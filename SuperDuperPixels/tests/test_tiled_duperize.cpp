@@ -0,0 +1,157 @@
+/**
+ * Tests for TiledSuperDuperPixels: a segmentation split into tiles (2x2 and 3x1) and grouped tile by tile
+ * has to give the same super-duper-pixels as duperizeWithAverage() on the whole image, up to their labels.
+ */
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <gtest/gtest.h>
+#include <opencv2/core.hpp>
+#include "sdp_slic.hpp"
+#include "sdp_tiled.hpp"
+
+using namespace cv;
+
+namespace {
+
+// Side of the flat blocks the image is made of, and of the superpixels
+const int BLOCK_SIZE = 20;
+const int BLOCKS_X = 12;
+const int BLOCKS_Y = 6;
+
+// Same image on every run: flat BLOCK_SIZE blocks in 3 colors laid out as diagonal bands (3 blocks wide,
+// so every band crosses the seams of both tilings), each block a few levels off its band color. Blocks of
+// a band are within MAX_DISTANCE of their neighbors and blocks of different bands far from it
+const float MAX_DISTANCE = 40.0f;
+
+Mat makeBandedBlocks()
+{
+    const int band_colors[3][3] = { { 40, 40, 200 }, { 200, 60, 40 }, { 60, 200, 60 } };
+    Mat image(BLOCKS_Y * BLOCK_SIZE, BLOCKS_X * BLOCK_SIZE, CV_8UC3);
+    unsigned int state = 12345;
+    for (int block_y = 0; block_y < BLOCKS_Y; block_y++) {
+        for (int block_x = 0; block_x < BLOCKS_X; block_x++) {
+            const int* color = band_colors[(block_x + block_y) / 3 % 3];
+            int block_color[3];
+            for (int c = 0; c < 3; c++) {
+                state = state * 1664525u + 1013904223u;
+                block_color[c] = color[c] + (int) (state >> 24) % 9 - 4;
+            }
+            image(Rect(block_x * BLOCK_SIZE, block_y * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE))
+                .setTo(Scalar(block_color[0], block_color[1], block_color[2]));
+        }
+    }
+    return image;
+}
+
+Ptr<SuperpixelSLIC> makeBlockSuperpixels(const Mat& image)
+{
+    Ptr<SuperpixelSLIC> slic = createSuperpixelSLIC(image, SLIC, BLOCK_SIZE, 10.0f);
+    slic->iterate(10);
+    slic->enforceLabelConnectivity(25);
+    return slic;
+}
+
+// True if every superpixel lies in a single tile, so splitting the labels at the seams doesn't change them
+bool superpixelsStayInTiles(const Mat& labels, const int tile_width, const int tile_height)
+{
+    std::unordered_map<int, int> tile_of;
+    for (int y = 0; y < labels.rows; y++) {
+        for (int x = 0; x < labels.cols; x++) {
+            int tile = (y / tile_height) * (labels.cols / tile_width) + x / tile_width;
+            auto found = tile_of.emplace(labels.at<int>(y, x), tile);
+            if (found.first->second != tile) return false;
+        }
+    }
+    return true;
+}
+
+// Groups the whole-image superpixels tile by tile and returns the super-duper-pixel labels of the mosaic
+Mat duperizeTiled(const Mat& image, const Mat& labels, const int tiles_x, const int tiles_y, int& count)
+{
+    const int tile_width = image.cols / tiles_x;
+    const int tile_height = image.rows / tiles_y;
+    TiledSuperDuperPixels tiled(tiles_x, MAX_DISTANCE, SDP_L1);
+
+    // labels of every tile numbered from 0, in the order the tiles are added
+    std::vector<Mat> tile_labels;
+    for (int tile_y = 0; tile_y < tiles_y; tile_y++) {
+        for (int tile_x = 0; tile_x < tiles_x; tile_x++) {
+            Rect tile(tile_x * tile_width, tile_y * tile_height, tile_width, tile_height);
+            Mat local(tile_height, tile_width, CV_32SC1);
+            std::unordered_map<int, int> local_labels;
+            for (int y = 0; y < tile_height; y++) {
+                for (int x = 0; x < tile_width; x++) {
+                    int label = labels.at<int>(tile.y + y, tile.x + x);
+                    local.at<int>(y, x) = local_labels.emplace(label, (int) local_labels.size()).first->second;
+                }
+            }
+            tiled.addTile(image(tile).clone(), local, (int) local_labels.size());
+            tile_labels.push_back(local);
+        }
+    }
+    count = tiled.finish();
+
+    Mat mosaic(image.rows, image.cols, CV_32SC1);
+    for (int tile = 0; tile < (int) tile_labels.size(); tile++) {
+        Mat tile_out;
+        tiled.getTileLabels(tile, tile_labels[tile], tile_out);
+        Rect rect((tile % tiles_x) * tile_width, (tile / tiles_x) * tile_height, tile_width, tile_height);
+        Mat destination = mosaic(rect);
+        tile_out.copyTo(destination);
+    }
+    return mosaic;
+}
+
+// True if the two labelings split the image the same way: every label of one maps to exactly one of the other
+bool samePartition(const Mat& first, const Mat& second)
+{
+    std::map<int, int> first_to_second, second_to_first;
+    for (int y = 0; y < first.rows; y++) {
+        for (int x = 0; x < first.cols; x++) {
+            int a = first.at<int>(y, x);
+            int b = second.at<int>(y, x);
+            if (first_to_second.emplace(a, b).first->second != b) return false;
+            if (second_to_first.emplace(b, a).first->second != a) return false;
+        }
+    }
+    return true;
+}
+
+void expectTiledMatchesWhole(const int tiles_x, const int tiles_y)
+{
+    Mat image = makeBandedBlocks();
+    Ptr<SuperpixelSLIC> slic = makeBlockSuperpixels(image);
+    Mat labels;
+    slic->getLabels(labels);
+    ASSERT_TRUE(superpixelsStayInTiles(labels, image.cols / tiles_x, image.rows / tiles_y));
+
+    slic->duperizeWithAverage(MAX_DISTANCE, false, SDP_L1);
+    Mat whole_labels;
+    slic->getSuperduperpixelLabels(whole_labels);
+    int whole_count = slic->getNumberOfSuperduperpixels();
+    // the bands are merged across blocks, and kept apart from each other
+    EXPECT_GT(whole_count, 1);
+    EXPECT_LT(whole_count, slic->getNumberOfSuperpixels());
+
+    int tiled_count = 0;
+    Mat tiled_labels = duperizeTiled(image, labels, tiles_x, tiles_y, tiled_count);
+
+    EXPECT_EQ(tiled_count, whole_count);
+    EXPECT_TRUE(samePartition(whole_labels, tiled_labels));
+}
+
+} // namespace
+
+//=============================================================================
+// Tiled Grouping Against Whole-Image Grouping
+//=============================================================================
+
+TEST(TiledDuperizeTest, TwoByTwoTilesMatchWholeImage) {
+    expectTiledMatchesWhole(2, 2);
+}
+
+TEST(TiledDuperizeTest, ThreeByOneTilesMatchWholeImage) {
+    expectTiledMatchesWhole(3, 1);
+}